@@ -0,0 +1,350 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "boxdraw.h"
+
+/* For MIN, MAX, BETWEEN, LEN */
+#include "st.h"
+
+/* Line weights */
+enum { NO, LT, HV, DB };
+
+/*
+ * U+2500 to U+257F: the weights of the lines going left, right, up and
+ * down from the middle of the cell, or one of the other kinds.
+ */
+#define LN(l, r, u, d)  ((l) | (r) << 2 | (u) << 4 | (d) << 6)
+#define DASH(n, w, v)   (1 << 12 | (n) << 4 | (v) << 2 | (w))
+#define ARC(left, up)   (2 << 12 | (up) << 1 | (left))
+#define DIAG(m)         (3 << 12 | (m))
+
+/* Samples per pixel side of the curved and slanted shapes */
+#define SUBPX           4
+
+typedef struct {
+        uint8_t *buf;
+        int w, h;
+        int l;          /* light line thickness */
+} Canvas;
+
+static const uint16_t boxes[0x80] = {
+        /* ─ ━ │ ┃ ┄ ┅ ┆ ┇ */
+        LN(LT, LT, NO, NO), LN(HV, HV, NO, NO), LN(NO, NO, LT, LT), LN(NO, NO, HV, HV),
+        DASH(3, LT, 0), DASH(3, HV, 0), DASH(3, LT, 1), DASH(3, HV, 1),
+        /* ┈ ┉ ┊ ┋ ┌ ┍ ┎ ┏ */
+        DASH(4, LT, 0), DASH(4, HV, 0), DASH(4, LT, 1), DASH(4, HV, 1),
+        LN(NO, LT, NO, LT), LN(NO, HV, NO, LT), LN(NO, LT, NO, HV), LN(NO, HV, NO, HV),
+        /* ┐ ┑ ┒ ┓ └ ┕ ┖ ┗ */
+        LN(LT, NO, NO, LT), LN(HV, NO, NO, LT), LN(LT, NO, NO, HV), LN(HV, NO, NO, HV),
+        LN(NO, LT, LT, NO), LN(NO, HV, LT, NO), LN(NO, LT, HV, NO), LN(NO, HV, HV, NO),
+        /* ┘ ┙ ┚ ┛ ├ ┝ ┞ ┟ */
+        LN(LT, NO, LT, NO), LN(HV, NO, LT, NO), LN(LT, NO, HV, NO), LN(HV, NO, HV, NO),
+        LN(NO, LT, LT, LT), LN(NO, HV, LT, LT), LN(NO, LT, HV, LT), LN(NO, LT, LT, HV),
+        /* ┠ ┡ ┢ ┣ ┤ ┥ ┦ ┧ */
+        LN(NO, LT, HV, HV), LN(NO, HV, HV, LT), LN(NO, HV, LT, HV), LN(NO, HV, HV, HV),
+        LN(LT, NO, LT, LT), LN(HV, NO, LT, LT), LN(LT, NO, HV, LT), LN(LT, NO, LT, HV),
+        /* ┨ ┩ ┪ ┫ ┬ ┭ ┮ ┯ */
+        LN(LT, NO, HV, HV), LN(HV, NO, HV, LT), LN(HV, NO, LT, HV), LN(HV, NO, HV, HV),
+        LN(LT, LT, NO, LT), LN(HV, LT, NO, LT), LN(LT, HV, NO, LT), LN(HV, HV, NO, LT),
+        /* ┰ ┱ ┲ ┳ ┴ ┵ ┶ ┷ */
+        LN(LT, LT, NO, HV), LN(HV, LT, NO, HV), LN(LT, HV, NO, HV), LN(HV, HV, NO, HV),
+        LN(LT, LT, LT, NO), LN(HV, LT, LT, NO), LN(LT, HV, LT, NO), LN(HV, HV, LT, NO),
+        /* ┸ ┹ ┺ ┻ ┼ ┽ ┾ ┿ */
+        LN(LT, LT, HV, NO), LN(HV, LT, HV, NO), LN(LT, HV, HV, NO), LN(HV, HV, HV, NO),
+        LN(LT, LT, LT, LT), LN(HV, LT, LT, LT), LN(LT, HV, LT, LT), LN(HV, HV, LT, LT),
+        /* ╀ ╁ ╂ ╃ ╄ ╅ ╆ ╇ */
+        LN(LT, LT, HV, LT), LN(LT, LT, LT, HV), LN(LT, LT, HV, HV), LN(HV, LT, HV, LT),
+        LN(LT, HV, HV, LT), LN(HV, LT, LT, HV), LN(LT, HV, LT, HV), LN(HV, HV, HV, LT),
+        /* ╈ ╉ ╊ ╋ ╌ ╍ ╎ ╏ */
+        LN(HV, HV, LT, HV), LN(HV, LT, HV, HV), LN(LT, HV, HV, HV), LN(HV, HV, HV, HV),
+        DASH(2, LT, 0), DASH(2, HV, 0), DASH(2, LT, 1), DASH(2, HV, 1),
+        /* ═ ║ ╒ ╓ ╔ ╕ ╖ ╗ */
+        LN(DB, DB, NO, NO), LN(NO, NO, DB, DB), LN(NO, DB, NO, LT), LN(NO, LT, NO, DB),
+        LN(NO, DB, NO, DB), LN(DB, NO, NO, LT), LN(LT, NO, NO, DB), LN(DB, NO, NO, DB),
+        /* ╘ ╙ ╚ ╛ ╜ ╝ ╞ ╟ */
+        LN(NO, DB, LT, NO), LN(NO, LT, DB, NO), LN(NO, DB, DB, NO), LN(DB, NO, LT, NO),
+        LN(LT, NO, DB, NO), LN(DB, NO, DB, NO), LN(NO, DB, LT, LT), LN(NO, LT, DB, DB),
+        /* ╠ ╡ ╢ ╣ ╤ ╥ ╦ ╧ */
+        LN(NO, DB, DB, DB), LN(DB, NO, LT, LT), LN(LT, NO, DB, DB), LN(DB, NO, DB, DB),
+        LN(DB, DB, NO, LT), LN(LT, LT, NO, DB), LN(DB, DB, NO, DB), LN(DB, DB, LT, NO),
+        /* ╨ ╩ ╪ ╫ ╬ ╭ ╮ ╯ */
+        LN(LT, LT, DB, NO), LN(DB, DB, DB, NO), LN(DB, DB, LT, LT), LN(LT, LT, DB, DB),
+        LN(DB, DB, DB, DB), ARC(0, 0), ARC(1, 0), ARC(1, 1),
+        /* ╰ ╱ ╲ ╳ ╴ ╵ ╶ ╷ */
+        ARC(0, 1), DIAG(1), DIAG(2), DIAG(3),
+        LN(LT, NO, NO, NO), LN(NO, NO, LT, NO), LN(NO, LT, NO, NO), LN(NO, NO, NO, LT),
+        /* ╸ ╹ ╺ ╻ ╼ ╽ ╾ ╿ */
+        LN(HV, NO, NO, NO), LN(NO, NO, HV, NO), LN(NO, HV, NO, NO), LN(NO, NO, NO, HV),
+        LN(LT, HV, NO, NO), LN(NO, NO, LT, HV), LN(HV, LT, NO, NO), LN(NO, NO, HV, LT),
+};
+
+/* U+2596 to U+259F: upper left, upper right, lower left, lower right */
+static const uint8_t quadrants[] = { 4, 8, 1, 13, 9, 7, 11, 2, 6, 14 };
+
+static void
+fill(Canvas *c, int x0, int y0, int x1, int y1, uint8_t v)
+{
+        int y;
+
+        x0 = MAX(x0, 0);
+        y0 = MAX(y0, 0);
+        x1 = MIN(x1, c->w);
+        y1 = MIN(y1, c->h);
+        for (y = y0; y < y1 && x0 < x1; y++)
+                memset(c->buf + y*c->w + x0, v, x1 - x0);
+}
+
+/*
+ * Lines meeting in the middle. The arms reach over the lines across them
+ * so that they join without gaps. Double lines are drawn as one thick
+ * line with the middle cleared afterwards, which leaves the right
+ * corners where double lines meet.
+ */
+static void
+lines(Canvas *c, unsigned int v)
+{
+        int wt[4], t[4], i;     /* left, right, up, down */
+        int th, tv, sh, sv, sh3, sv3, l = c->l;
+        int hdb, vdb, htee, vtee;
+
+        for (i = 0; i < 4; i++) {
+                wt[i] = v >> 2*i & 3;
+                t[i] = wt[i] * l;
+        }
+        th = MAX(t[0], t[1]);
+        tv = MAX(t[2], t[3]);
+        sh = (c->h - th) / 2;
+        sv = (c->w - tv) / 2;
+        sh3 = (c->h - 3*l) / 2;
+        sv3 = (c->w - 3*l) / 2;
+        hdb = wt[0] == DB || wt[1] == DB;
+        vdb = wt[2] == DB || wt[3] == DB;
+
+        /* A single line ending at a straight double line only touches it */
+        htee = vdb && wt[2] && wt[3] && !hdb && !(wt[0] && wt[1]);
+        vtee = hdb && wt[0] && wt[1] && !vdb && !(wt[2] && wt[3]);
+
+        for (i = 0; i < 2; i++) {
+                int y0 = (c->h - t[i]) / 2;
+                if (!wt[i])
+                        continue;
+                if (!tv)
+                        fill(c, i ? (c->w - t[i])/2 : 0, y0, i ? c->w : (c->w - t[i])/2 + t[i], y0 + t[i], 255);
+                else if (htee)
+                        fill(c, i ? sv + 2*l : 0, y0, i ? c->w : sv + l, y0 + t[i], 255);
+                else
+                        fill(c, i ? sv : 0, y0, i ? c->w : sv + tv, y0 + t[i], 255);
+        }
+        for (i = 2; i < 4; i++) {
+                int x0 = (c->w - t[i]) / 2;
+                if (!wt[i])
+                        continue;
+                if (!th)
+                        fill(c, x0, i == 3 ? (c->h - t[i])/2 : 0, x0 + t[i], i == 3 ? c->h : (c->h - t[i])/2 + t[i], 255);
+                else if (vtee)
+                        fill(c, x0, i == 3 ? sh + 2*l : 0, x0 + t[i], i == 3 ? c->h : sh + l, 255);
+                else
+                        fill(c, x0, i == 3 ? sh : 0, x0 + t[i], i == 3 ? c->h : sh + th, 255);
+        }
+
+        /* The middle of the double lines, up to the lines across them */
+        for (i = 0; i < 2; i++) {
+                if (wt[i] != DB)
+                        continue;
+                if (!tv || vdb)
+                        fill(c, i ? sv3 + l : 0, sh3 + l, i ? c->w : sv3 + 2*l, sh3 + 2*l, 0);
+                else if (vtee)
+                        fill(c, i ? c->w/2 : 0, sh3 + l, i ? c->w : c->w/2, sh3 + 2*l, 0);
+                else
+                        fill(c, i ? sv + tv : 0, sh3 + l, i ? c->w : sv, sh3 + 2*l, 0);
+        }
+        for (i = 2; i < 4; i++) {
+                if (wt[i] != DB)
+                        continue;
+                if (!th || hdb)
+                        fill(c, sv3 + l, i == 3 ? sh3 + l : 0, sv3 + 2*l, i == 3 ? c->h : sh3 + 2*l, 0);
+                else if (htee)
+                        fill(c, sv3 + l, i == 3 ? c->h/2 : 0, sv3 + 2*l, i == 3 ? c->h : c->h/2, 0);
+                else
+                        fill(c, sv3 + l, i == 3 ? sh + th : 0, sv3 + 2*l, i == 3 ? c->h : sh, 0);
+        }
+}
+
+/* n dashes along the cell, each a third of its share shorter */
+static void
+dashes(Canvas *c, int n, int wt, int vert)
+{
+        int t = wt * c->l, len = vert ? c->h : c->w;
+        int i, a, b, gap;
+
+        for (i = 0; i < n; i++) {
+                a = i * len / n;
+                b = (i+1) * len / n;
+                gap = MAX(1, (b - a) / 3);
+                a += gap / 2;
+                b -= gap - gap/2;
+                if (vert)
+                        fill(c, (c->w - t)/2, a, (c->w - t)/2 + t, b, 255);
+                else
+                        fill(c, a, (c->h - t)/2, b, (c->h - t)/2 + t, 255);
+        }
+}
+
+/* Coverage of the pixel at x, y by the shape inside() tests points against */
+static uint8_t
+sample(Canvas *c, int x, int y, int (*inside)(Canvas *, float, float, int), int arg)
+{
+        int i, j, n = 0;
+
+        for (i = 0; i < SUBPX; i++) {
+                for (j = 0; j < SUBPX; j++) {
+                        n += inside(c, x + (j + 0.5f)/SUBPX,
+                                    y + (i + 0.5f)/SUBPX, arg);
+                }
+        }
+        return (uint8_t)(n * 255 / (SUBPX*SUBPX));
+}
+
+/* A rounded corner of light lines, arg is ARC() */
+static int
+onarc(Canvas *c, float x, float y, int arg)
+{
+        float cx = (c->w - c->l)/2 + c->l/2.0f, cy = (c->h - c->l)/2 + c->l/2.0f;
+        float dx = (arg & 1) ? -1 : 1, dy = (arg & 2) ? -1 : 1;
+        float r = MIN((arg & 1) ? cx : c->w - cx, (arg & 2) ? cy : c->h - cy);
+        float ox = cx + dx*r, oy = cy + dy*r;
+
+        /* The quarter circle facing the middle of the cell */
+        if ((x - ox)*dx > 0 || (y - oy)*dy > 0)
+                return 0;
+        return fabsf(hypotf(x - ox, y - oy) - r) <= c->l / 2.0f;
+}
+
+/* Light lines from corner to corner, arg is DIAG() */
+static int
+ondiag(Canvas *c, float x, float y, int arg)
+{
+        float n = hypotf(c->w, c->h);
+
+        if ((arg & 1) && fabsf(c->h*x + c->w*y - c->w*c->h) / n <= c->l / 2.0f)
+                return 1;
+        return (arg & 2) && fabsf(c->h*x - c->w*y) / n <= c->l / 2.0f;
+}
+
+static void
+shape(Canvas *c, int (*inside)(Canvas *, float, float, int), int arg)
+{
+        int x, y;
+
+        for (y = 0; y < c->h; y++) {
+                for (x = 0; x < c->w; x++)
+                        c->buf[y*c->w + x] = sample(c, x, y, inside, arg);
+        }
+}
+
+static void
+arc(Canvas *c, int arg)
+{
+        int l = c->l, sx = (c->w - l)/2, sy = (c->h - l)/2;
+        float cx = sx + l/2.0f, cy = sy + l/2.0f;
+        float r = MIN((arg & 1) ? cx : c->w - cx, (arg & 2) ? cy : c->h - cy);
+        int ox = (int)lroundf((arg & 1) ? cx - r : cx + r);
+        int oy = (int)lroundf((arg & 2) ? cy - r : cy + r);
+
+        shape(c, onarc, arg);
+        /* Straight on from the ends of the quarter circle to the edges */
+        fill(c, (arg & 1) ? 0 : ox, sy, (arg & 1) ? ox : c->w, sy + l, 255);
+        fill(c, sx, (arg & 2) ? 0 : oy, sx + l, (arg & 2) ? oy : c->h, 255);
+}
+
+static void
+block(Canvas *c, Rune u)
+{
+        int w = c->w, h = c->h, q;
+
+        if (u == 0x2580) {
+                fill(c, 0, 0, w, h/2, 255);
+        } else if (u <= 0x2588) {
+                /* Lower eighths */
+                fill(c, 0, h - (h*(int)(u - 0x2580) + 4)/8, w, h, 255);
+        } else if (u <= 0x258f) {
+                /* Left eighths */
+                fill(c, 0, 0, (w*(int)(0x2590 - u) + 4)/8, h, 255);
+        } else if (u == 0x2590) {
+                fill(c, w/2, 0, w, h, 255);
+        } else if (u <= 0x2593) {
+                /* Shades */
+                fill(c, 0, 0, w, h, (uint8_t)(64 * (u - 0x2590)));
+        } else if (u == 0x2594) {
+                fill(c, 0, 0, w, (h + 4)/8, 255);
+        } else if (u == 0x2595) {
+                fill(c, w - (w + 4)/8, 0, w, h, 255);
+        } else {
+                q = quadrants[u - 0x2596];
+                if (q & 1)
+                        fill(c, 0, 0, w/2, h/2, 255);
+                if (q & 2)
+                        fill(c, w/2, 0, w, h/2, 255);
+                if (q & 4)
+                        fill(c, 0, h/2, w/2, h, 255);
+                if (q & 8)
+                        fill(c, w/2, h/2, w, h, 255);
+        }
+}
+
+/* Dots 1 to 8 are the bits of u - U+2800, two columns of four */
+static void
+braille(Canvas *c, Rune u)
+{
+        static const uint8_t col[] = { 0, 0, 0, 1, 1, 1, 0, 1 };
+        static const uint8_t row[] = { 0, 1, 2, 0, 1, 2, 3, 3 };
+        int i, x, y, d = MAX(1, MIN(c->w/4, c->h/8));
+
+        for (i = 0; i < 8; i++) {
+                if (!((u - 0x2800) & 1 << i))
+                        continue;
+                x = col[i]*c->w/2 + (c->w/2 - d)/2;
+                y = row[i]*c->h/4 + (c->h/4 - d)/2;
+                fill(c, x, y, x + d, y + d, 255);
+        }
+}
+
+int
+isboxdraw(uint32_t u)
+{
+        return BETWEEN(u, 0x2500, 0x259f) || BETWEEN(u, 0x2800, 0x28ff);
+}
+
+/* Draws u into the w x h coverage bitmap buf, which has no padding */
+void
+drawbox(uint32_t u, uint8_t *buf, int w, int h)
+{
+        Canvas c = { buf, w, h, MAX(1, w/8) };
+        unsigned int v;
+
+        memset(buf, 0, (size_t)w * h);
+        if (u >= 0x2800) {
+                braille(&c, u);
+                return;
+        }
+        if (u >= 0x2580) {
+                block(&c, u);
+                return;
+        }
+
+        v = boxes[u - 0x2500];
+        switch (v >> 12) {
+        case 0:
+                lines(&c, v);
+                break;
+        case 1:
+                dashes(&c, v >> 4 & 0xff, v & 3, v >> 2 & 1);
+                break;
+        case 2:
+                arc(&c, v & 3);
+                break;
+        case 3:
+                shape(&c, ondiag, v & 3);
+                break;
+        }
+}
@@ -0,0 +1,10 @@
+#ifndef BOXDRAW_H
+#define BOXDRAW_H
+
+#include <stdint.h>
+
+/* Box drawing, block elements and braille, drawn to fill the cell exactly */
+int isboxdraw(uint32_t);
+void drawbox(uint32_t, uint8_t *, int, int);
+
+#endif
@@ -6,6 +6,20 @@
  * font: see http://freedesktop.org/software/fontconfig/fontconfig-user.html
  */
 static char *font = "Liberation Mono";
+
+/*
+ * font files of the normal, italic, bold and italic bold styles, loaded
+ * without fontconfig when the first one is set and -f is not given. Unset
+ * styles use the first one. Fallback fonts still come from fontconfig.
+ */
+static char *fontfiles[] = { NULL, NULL, NULL, NULL };
+
+/*
+ * remember which files fontconfig picked for a font string in
+ * $XDG_CACHE_HOME/stvk, until the fontconfig configuration or the font
+ * files change.
+ */
+static int fontcache = 1;
 static int font_size = 12;
 
 static int borderpx = 2;
@@ -58,6 +72,104 @@ int allowwindowops = 0;
 static double minlatency = 1;
 static double maxlatency = 2;
 
+/*
+ * measure the keypress-to-present and pty-to-present latency with
+ * VK_KHR_present_wait. The histograms are printed to stderr on exit, bind
+ * latencydump to a shortcut to print them on demand.
+ */
+static int latencystats = 0;
+
+/*
+ * draw with the CPU renderer and MIT-SHM instead of vulkan. It is also used
+ * when no vulkan device is available.
+ */
+static int softrender = 0;
+
+/*
+ * draw the cells with a compute shader walking screen tiles instead of one
+ * instanced quad per glyph, which writes every pixel once. togglegrid
+ * switches between the two while running.
+ */
+static int gridrender = 0;
+
+/*
+ * glyphs of runes below this are looked up by indexing a table instead of
+ * hashing, 0x100 covers ASCII and Latin-1.
+ */
+static unsigned int glyphtablesz = 0x100;
+
+/*
+ * number of font sizes besides the current one whose glyphs are kept, so
+ * that zooming back to them does not render anything again.
+ */
+static int zoomsizes = 2;
+
+/*
+ * keep signed distance fields of the glyphs, rendered once at sdfsize
+ * points, in the atlas and scale them on screen: zooming renders no glyph
+ * again and large sizes stay sharp, small sizes look softer.
+ */
+static int sdfatlas = 0;
+static float sdfsize = 24;
+
+/*
+ * rasterize glyph outlines with a compute shader right into the atlas
+ * instead of rendering them with FreeType. Only used by the vulkan renderer
+ * and without sdfatlas, bitmap fonts are still rendered by FreeType.
+ */
+static int gpuraster = 0;
+
+/*
+ * look up and load fallback fonts on a worker thread. Until a font is
+ * found, the cells needing it are drawn with their background only.
+ */
+static int asyncfallback = 1;
+
+/*
+ * threads rendering the glyphs missing from the atlas when a redraw needs
+ * many of them at once. 0 for one per core, -1 to render on the main
+ * thread only.
+ */
+static int rasterthreads = 0;
+
+/*
+ * draw box drawing (U+2500 to U+257F), block elements (U+2580 to U+259F)
+ * and braille (U+2800 to U+28FF) to fit the cell exactly instead of taking
+ * them from the fonts. Not with sdfatlas.
+ */
+static int boxdraw = 1;
+
+/*
+ * shape runs of cells with the same attributes as a whole, for the
+ * ligatures of programming fonts and complex scripts. Only in builds with
+ * HarfBuzz, see config.mk. The last shapecache distinct runs are kept, so
+ * lines that did not change are not shaped again.
+ */
+#ifdef HARFBUZZ
+static int shaping = 1;
+static unsigned int shapecache = 4096;
+#endif
+
+/*
+ * rune ranges rendered by the rasterizer threads in each style, the regular
+ * one right after the fonts are loaded or zoomed and the others after their
+ * first use: printable ASCII, Latin-1 and common punctuation. Add
+ * { 0x2500, 0x259f } for the box drawing and block elements if boxdraw is 0
+ * or sdfatlas is set, boxdraw draws them itself otherwise.
+ */
+static Rune prewarm[][2] = {
+	{ 0x0020, 0x007e },
+	{ 0x00a0, 0x00ff },
+	{ 0x2010, 0x2027 },
+};
+
+/*
+ * keep the rendered prewarm set in $XDG_CACHE_HOME/stvk, keyed by the font
+ * files, their size and the render flags, instead of rendering it at every
+ * start.
+ */
+static int glyphcache = 1;
+
 /*
  * blinking timeout (set to 0 to disable blinking) for the terminal blinking
  * attribute.
@@ -203,6 +315,7 @@ static Shortcut shortcuts[] = {
 	{ TERMMOD,              XK_Y,           selpaste,       {.i =  0} },
 	{ ShiftMask,            XK_Insert,      selpaste,       {.i =  0} },
 	{ TERMMOD,              XK_Num_Lock,    numlock,        {.i =  0} },
+	{ TERMMOD,              XK_G,           togglegrid,     {.i =  0} },
 };
 
 /*
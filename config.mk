@@ -12,13 +12,19 @@ X11LIB = /usr/X11R6/lib
 
 PKG_CONFIG = pkg-config
 
+# HarfBuzz text shaping, uncomment to build with it
+#HBINC = `$(PKG_CONFIG) --cflags harfbuzz` -DHARFBUZZ
+#HBLIBS = `$(PKG_CONFIG) --libs harfbuzz`
+
 # includes and libs
 INCS = -I$(X11INC) \
        `$(PKG_CONFIG) --cflags fontconfig` \
-       `$(PKG_CONFIG) --cflags freetype2`
-LIBS = -L$(X11LIB) -lm -lrt -lX11 -lutil -ldl \
+       `$(PKG_CONFIG) --cflags freetype2` \
+       $(HBINC)
+LIBS = -L$(X11LIB) -lm -lrt -lX11 -lutil -ldl -lpthread -lXext \
        `$(PKG_CONFIG) --libs fontconfig` \
-       `$(PKG_CONFIG) --libs freetype2`
+       `$(PKG_CONFIG) --libs freetype2` \
+       $(HBLIBS)
 
 # flags
 STCPPFLAGS = -DVERSION=\"$(VERSION)\" -D_XOPEN_SOURCE=600
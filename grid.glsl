@@ -0,0 +1,90 @@
+#version 450
+
+/*
+ * Alternative to the instanced quads of prog.glsl: one workgroup per screen
+ * tile walks the quads binned to it and writes every covered pixel of both
+ * render targets exactly once, see bingrid() in vk.c.
+ */
+
+/* Keep in sync with prog.glsl and TILESIZ in vk.c */
+#define QUAD_BLINK      1u
+#define QUAD_FILL       2u
+#define TILESIZ         16
+#define SDF_SPREAD      8.0
+#define SDF_EDGE        (128.0/255.0)
+
+layout(local_size_x = TILESIZ, local_size_y = TILESIZ) in;
+
+layout(push_constant) uniform u_constants {
+        uint tiles;     /* word offset of the tiles: xy, first, count */
+        uint index;     /* word offset of the quad indices */
+        uint view;      /* w | h << 16 */
+        uint texsize;
+        float scale;    /* of distance field glyphs, 0 for coverage */
+} pc;
+
+/* The quads, five words each, followed by the tiles and the indices */
+layout(set = 0, binding = 0) readonly buffer b_words {
+        uint words[];
+};
+
+layout(set = 0, binding = 1) uniform sampler2D u_atlas;
+layout(set = 0, binding = 2, rgba8) uniform writeonly image2D u_on;
+layout(set = 0, binding = 3, rgba8) uniform writeonly image2D u_off;
+
+vec4 unpack_rgba(uint c)
+{
+        float b = ((c >> 16) & 0xff) / 255.0;
+        float g = ((c >> 8) & 0xff) / 255.0;
+        float r = (c & 0xff) / 255.0;
+        return vec4(r, g, b, 1.0);
+}
+
+void main()
+{
+        uint tile = pc.tiles + 3u*gl_WorkGroupID.x;
+        uint xy = words[tile];
+        uint first = words[tile + 1u];
+        uint count = words[tile + 2u];
+        ivec2 p = ivec2(xy & 0xffffu, xy >> 16)*TILESIZ + ivec2(gl_LocalInvocationID.xy);
+        ivec2 view = ivec2(pc.view & 0xffffu, pc.view >> 16);
+
+        if (any(greaterThanEqual(p, view)))
+                return;
+
+        /* The bins keep the submission order, the last quad covering p wins */
+        uint q = 0xffffffffu;
+        ivec2 pos;
+        for (uint i = count; i > 0u && q == 0xffffffffu; i--) {
+                uint k = 5u*words[pc.index + first + i - 1u];
+                uint size = words[k + 2u];
+                pos = ivec2(words[k] & 0xffffu, words[k] >> 16);
+                if (all(greaterThanEqual(p, pos)) &&
+                    all(lessThan(p, pos + ivec2(size & 0xffffu, size >> 16))))
+                        q = k;
+        }
+        if (q == 0xffffffffu)
+                return;
+
+        uint uv = words[q + 1u];
+        uint flags = words[q + 4u] >> 24;
+        vec4 fg = unpack_rgba(words[q + 3u]);
+        vec4 bg = unpack_rgba(words[q + 4u]);
+        ivec2 tc = ivec2(uv & 0xffffu, uv >> 16) + p - pos;
+
+        float t = 0.0;
+        if ((flags & QUAD_FILL) != 0u) {
+                t = 1.0;
+        } else if (pc.scale > 0.0) {
+                vec2 at = vec2(uv & 0xffffu, uv >> 16) + (vec2(p - pos) + 0.5)/pc.scale;
+                float soft = 1.0/(4.0*SDF_SPREAD*pc.scale);
+                t = textureLod(u_atlas, at/float(pc.texsize), 0.0).r;
+                t = smoothstep(SDF_EDGE - soft, SDF_EDGE + soft, t);
+        } else if (all(lessThan(tc, ivec2(pc.texsize)))) {
+                t = texelFetch(u_atlas, tc, 0).r;
+        }
+
+        vec4 c = fg*t + bg*(1.0-t);
+        imageStore(u_on, p, c);
+        imageStore(u_off, p, (flags & QUAD_BLINK) != 0u ? bg : c);
+}
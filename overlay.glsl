@@ -0,0 +1,109 @@
+#version 450
+#extension GL_ARB_separate_shader_objects : enable
+
+/*
+ * Composes the render targets into the swapchain image: picks the blink
+ * phase from the time value and draws the cursor on top, so neither of
+ * them touches the retained render targets.
+ */
+
+/* Keep in sync with the cursor styles in vk.h */
+#define CUR_NONE        0u
+#define CUR_BLOCK       1u
+#define CUR_UNDERLINE   2u
+#define CUR_BAR         3u
+#define CUR_HOLLOW      4u
+#define CUR_SHAPE       7u
+#define CUR_BLINK       8u
+
+/* Keep in sync with prog.glsl */
+#define SDF_SPREAD      8.0
+#define SDF_EDGE        (128.0/255.0)
+
+#ifdef VERTEX_SHADER
+void main()
+{
+        /* A single triangle covering the viewport */
+        vec2 p = vec2(float((gl_VertexIndex << 1) & 2), float(gl_VertexIndex & 2));
+        gl_Position = vec4(2.0*p - 1.0, 0.0, 1.0);
+}
+#endif
+
+#ifdef FRAGMENT_SHADER
+layout(location = 0) out vec4 fragColor;
+
+layout(push_constant) uniform u_constants {
+        ivec4 cursor;   /* x, y, w, h */
+        ivec4 glyph;    /* x, y, w, h of the glyph, w == 0 for none */
+        ivec2 uv;       /* glyph position in the atlas */
+        uint fg;
+        uint bg;
+        uint style;
+        uint thick;
+        uint time;      /* ms */
+        uint period;    /* blink period in ms, 0 for no blinking */
+        float scale;    /* of distance field glyphs, 0 for coverage */
+} pc;
+
+layout(set = 0, binding = 0) uniform sampler2D u_on;
+layout(set = 0, binding = 1) uniform sampler2D u_off;
+layout(set = 0, binding = 2) uniform sampler2D u_atlas;
+
+vec4 unpack_rgba(uint c)
+{
+        float b = ((c >> 16) & 0xff) / 255.0;
+        float g = ((c >> 8) & 0xff) / 255.0;
+        float r = (c & 0xff) / 255.0;
+        return vec4(r, g, b, 1.0);
+}
+
+void main()
+{
+        ivec2 p = ivec2(gl_FragCoord.xy);
+        bool on = pc.period == 0 || ((pc.time / pc.period) & 1u) == 0u;
+        vec4 c = on ? texelFetch(u_on, p, 0) : texelFetch(u_off, p, 0);
+
+        uint shape = pc.style & CUR_SHAPE;
+        ivec2 q = p - pc.cursor.xy;
+        if (shape == CUR_NONE || ((pc.style & CUR_BLINK) != 0 && !on) ||
+            any(lessThan(q, ivec2(0))) || any(greaterThanEqual(q, pc.cursor.zw))) {
+                fragColor = c;
+                return;
+        }
+
+        vec4 fg = unpack_rgba(pc.fg);
+        vec4 bg = unpack_rgba(pc.bg);
+        switch (shape) {
+        case CUR_BLOCK: {
+                ivec2 g = p - pc.glyph.xy;
+                c = bg;
+                if (all(greaterThanEqual(g, ivec2(0))) && all(lessThan(g, pc.glyph.zw))) {
+                        float t;
+                        if (pc.scale > 0.0) {
+                                vec2 uv = vec2(pc.uv) + (vec2(g) + 0.5)/pc.scale;
+                                float soft = 1.0/(4.0*SDF_SPREAD*pc.scale);
+                                t = texture(u_atlas, uv/vec2(textureSize(u_atlas, 0))).r;
+                                t = smoothstep(SDF_EDGE - soft, SDF_EDGE + soft, t);
+                        } else {
+                                t = texelFetch(u_atlas, pc.uv + g, 0).r;
+                        }
+                        c = fg*t + bg*(1.0-t);
+                }
+                break;
+        }
+        case CUR_UNDERLINE:
+                if (q.y >= pc.cursor.w - int(pc.thick))
+                        c = fg;
+                break;
+        case CUR_BAR:
+                if (q.x < int(pc.thick))
+                        c = fg;
+                break;
+        case CUR_HOLLOW:
+                if (q.x == 0 || q.y == 0 || q.x == pc.cursor.z - 1 || q.y == pc.cursor.w - 1)
+                        c = fg;
+                break;
+        }
+        fragColor = c;
+}
+#endif
@@ -1,6 +1,14 @@
 #version 450
 #extension GL_ARB_separate_shader_objects : enable
 
+/* Quad flags, stored in the alpha byte of the background color */
+#define QUAD_BLINK      1u
+#define QUAD_FILL       2u
+
+/* Distance field glyphs, keep in sync with SDFSPREAD in vk.h */
+#define SDF_SPREAD      8.0
+#define SDF_EDGE        (128.0/255.0)
+
 #ifdef VERTEX_SHADER
 struct Rect {
         uint pos;
@@ -20,10 +28,13 @@ const vec2[4] lut = vec2[4](
 layout(location = 0) out vec2 fsUV;
 layout(location = 1) out vec4 fsFG;
 layout(location = 2) out vec4 fsBG;
+layout(location = 3) flat out uint fsFlags;
+layout(location = 4) flat out float fsSoft;
 
 layout(push_constant) uniform u_constants {
         vec2 view;
         vec2 texSize;
+        float scale;    /* of distance field glyphs, 0 for coverage */
 } pc;
 
 layout(set = 0, binding = 0) readonly buffer b_vertices {
@@ -53,7 +64,13 @@ void main()
 
         fsFG = unpack_rgba(r.fg);
         fsBG = unpack_rgba(r.bg);
-        fsUV = vec2(u + w*base.x, v + h*base.y) / pc.texSize;
+        fsFlags = r.bg >> 24;
+
+        /* The quad is scale times larger than the glyph in the atlas */
+        float s = pc.scale > 0.0 ? pc.scale : 1.0;
+        fsUV = (vec2(u, v) + vec2(w, h)*base/s) / pc.texSize;
+        /* Half a screen pixel in distance units */
+        fsSoft = pc.scale > 0.0 ? 1.0/(4.0*SDF_SPREAD*pc.scale) : 0.0;
 }
 #endif
 
@@ -61,14 +78,25 @@ void main()
 layout(location = 0) in vec2 fsUV;
 layout(location = 1) in vec4 fsFG;
 layout(location = 2) in vec4 fsBG;
+layout(location = 3) flat in uint fsFlags;
+layout(location = 4) flat in float fsSoft;
 
+/* The second target holds the frame as seen in the blink-off phase */
 layout(location = 0) out vec4 fragColor;
+layout(location = 1) out vec4 blinkColor;
 
 layout(binding = 1) uniform sampler2D u_sampler;
 
 void main()
 {
-        float t = texture(u_sampler, fsUV).r;
+        float t;
+        if ((fsFlags & QUAD_FILL) != 0)
+                t = 1.0;
+        else if (fsSoft > 0.0)
+                t = smoothstep(SDF_EDGE - fsSoft, SDF_EDGE + fsSoft, texture(u_sampler, fsUV).r);
+        else
+                t = texture(u_sampler, fsUV).r;
         fragColor = fsFG*t + fsBG*(1.0-t);
+        blinkColor = (fsFlags & QUAD_BLINK) != 0 ? fsBG : fragColor;
 }
 #endif
@@ -0,0 +1,85 @@
+#version 450
+
+/*
+ * Rasterizes glyph outlines flattened to line segments, one workgroup per
+ * glyph, see outlineatlas() in vk.c. Each invocation computes four pixels
+ * of a row and writes them as one word, the rows are copied into the atlas
+ * afterwards.
+ *
+ * The coverage of a pixel is the exact area of the outline inside of it:
+ * every segment crossing the row adds its height times the part of the
+ * pixel to its right, signed by direction, which sums up to the winding
+ * number integrated over the pixel.
+ */
+
+layout(local_size_x = 64) in;
+
+layout(push_constant) uniform u_constants {
+        uint segs;      /* word offset of the segments */
+        uint dst;       /* word offset of the coverage */
+} pc;
+
+/*
+ * Jobs of four words: coverage offset, w | h << 16, first segment, segment
+ * count. Segments of four floats: x0, y0, x1, y1 in pixels, y down.
+ */
+layout(set = 0, binding = 0) buffer b_words {
+        uint words[];
+};
+
+/* Integral of clamp(u, 0, 1) */
+float
+area(float u)
+{
+        float c = clamp(u, 0.0, 1.0);
+        return 0.5*c*c + max(u - 1.0, 0.0);
+}
+
+float
+coverage(vec2 p, uint first, uint n)
+{
+        float a = 0.0;
+
+        for (uint i = 0u; i < n; i++) {
+                uint k = pc.segs + 4u*(first + i);
+                vec4 s = vec4(uintBitsToFloat(words[k]), uintBitsToFloat(words[k + 1u]),
+                              uintBitsToFloat(words[k + 2u]), uintBitsToFloat(words[k + 3u]));
+                float y0 = clamp(s.y, p.y, p.y + 1.0);
+                float y1 = clamp(s.w, p.y, p.y + 1.0);
+                if (y0 == y1)
+                        continue;
+
+                /* Distance of the clipped ends to the right pixel edge */
+                float u0 = p.x + 1.0 - mix(s.x, s.z, (y0 - s.y)/(s.w - s.y));
+                float u1 = p.x + 1.0 - mix(s.x, s.z, (y1 - s.y)/(s.w - s.y));
+                if (abs(u1 - u0) < 1e-4)
+                        a += (y1 - y0) * clamp(0.5*(u0 + u1), 0.0, 1.0);
+                else
+                        a += (y1 - y0) * (area(u1) - area(u0)) / (u1 - u0);
+        }
+
+        return min(abs(a), 1.0);
+}
+
+void
+main()
+{
+        uint job = 4u*gl_WorkGroupID.x;
+        uint dst = pc.dst + words[job];
+        uint w = words[job + 1u] & 0xffffu;
+        uint h = words[job + 1u] >> 16;
+        uint first = words[job + 2u];
+        uint n = words[job + 3u];
+        uint pitch = (w + 3u) / 4u;
+
+        for (uint i = gl_LocalInvocationID.x; i < pitch*h; i += 64u) {
+                uint y = i / pitch;
+                uint x = 4u*(i % pitch);
+                uint c = 0u;
+                for (uint j = 0u; j < 4u && x + j < w; j++) {
+                        float t = coverage(vec2(x + j, y), first, n);
+                        c |= uint(t*255.0 + 0.5) << (8u*j);
+                }
+                words[dst + i] = c;
+        }
+}
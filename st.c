@@ -193,7 +193,6 @@ static void tsetscroll(int, int);
 static void tswapscreen(void);
 static void tsetmode(int, int, int *, int);
 static int twrite(const char *, int, int);
-static void tfulldirt(void);
 static void tcontrolcode(uchar );
 static void tdectest(char );
 static void tdefutf8(char);
@@ -224,7 +223,10 @@ static CSIEscape csiescseq;
 static STREscape strescseq;
 static int iofd = 1;
 static int cmdfd;
+static int replay; /* cmdfd is a recording, see ttyreplay() */
 static pid_t pid;
+static volatile sig_atomic_t childexited; /* see ttyexited() */
+static int hungup;
 
 static uchar utfbyte[UTF_SIZ + 1] = {0x80,    0, 0xC0, 0xE0, 0xF0};
 static uchar utfmask[UTF_SIZ + 1] = {0xC0, 0x80, 0xE0, 0xF0, 0xF8};
@@ -667,6 +669,7 @@ execsh(char *cmd, char **args)
 {
 	char *sh, *prog, *arg;
 	const struct passwd *pw;
+	sigset_t set;
 
 	errno = 0;
 	if ((pw = getpwuid(getuid())) == NULL) {
@@ -709,6 +712,8 @@ execsh(char *cmd, char **args)
 	signal(SIGQUIT, SIG_DFL);
 	signal(SIGTERM, SIG_DFL);
 	signal(SIGALRM, SIG_DFL);
+	sigemptyset(&set);
+	sigprocmask(SIG_SETMASK, &set, NULL);
 
 	execvp(prog, args);
 	_exit(1);
@@ -716,21 +721,40 @@ execsh(char *cmd, char **args)
 
 void
 sigchld(int a)
+{
+	childexited = 1;
+}
+
+/*
+ * Returns the exit status once the shell is gone and -1 while it runs. The
+ * shell is reaped here instead of in sigchld(), so the caller can exit
+ * outside of the signal handler.
+ */
+int
+ttyexited(void)
 {
 	int stat;
 	pid_t p;
 
+	if (!childexited && !hungup)
+		return -1;
+	childexited = 0;
+
+	if (!pid)
+		return 0;
 	if ((p = waitpid(pid, &stat, WNOHANG)) < 0)
 		die("waiting for pid %hd failed: %s\n", pid, strerror(errno));
-
 	if (pid != p)
-		return;
+		return hungup ? 0 : -1;
 
-	if (WIFEXITED(stat) && WEXITSTATUS(stat))
-		die("child exited with status %d\n", WEXITSTATUS(stat));
-	else if (WIFSIGNALED(stat))
-		die("child terminated due to signal %d\n", WTERMSIG(stat));
-	_exit(0);
+	if (WIFEXITED(stat) && WEXITSTATUS(stat)) {
+		fprintf(stderr, "child exited with status %d\n", WEXITSTATUS(stat));
+		return 1;
+	} else if (WIFSIGNALED(stat)) {
+		fprintf(stderr, "child terminated due to signal %d\n", WTERMSIG(stat));
+		return 1;
+	}
+	return 0;
 }
 
 void
@@ -818,6 +842,19 @@ ttynew(char *line, char *cmd, char *out, char **args)
 	return cmdfd;
 }
 
+/*
+ * Reads a recorded byte stream instead of a shell. Replies to the
+ * terminal queries are dropped and the end of the stream is not fatal.
+ */
+int
+ttyreplay(char *path)
+{
+	if ((cmdfd = open(path, O_RDONLY)) < 0)
+		die("open replay '%s' failed: %s\n", path, strerror(errno));
+	replay = 1;
+	return cmdfd;
+}
+
 size_t
 ttyread(void)
 {
@@ -830,8 +867,14 @@ ttyread(void)
 
 	switch (ret) {
 	case 0:
-		exit(0);
+		hungup = !replay;
+		return 0;
 	case -1:
+		/* the shell may be gone before its SIGCHLD arrives */
+		if (errno == EIO && pid) {
+			hungup = 1;
+			return 0;
+		}
 		die("couldn't read from shell: %s\n", strerror(errno));
 	default:
 		buflen += ret;
@@ -879,13 +922,16 @@ ttywriteraw(const char *s, size_t n)
 	ssize_t r;
 	size_t lim = 256;
 
+	if (replay)
+		return;
+
 	/*
 	 * Remember that we are using a pty, which might be a modem line.
 	 * Writing too much will clog the line. That's why we are doing this
 	 * dance.
 	 * FIXME: Migrate the world to Plan 9.
 	 */
-	while (n > 0) {
+	while (n > 0 && !hungup) {
 		FD_ZERO(&wfd);
 		FD_ZERO(&rfd);
 		FD_SET(cmdfd, &wfd);
@@ -938,6 +984,8 @@ ttyresize(int tw, int th)
 	w.ws_col = term.col;
 	w.ws_xpixel = tw;
 	w.ws_ypixel = th;
+	if (replay)
+		return;
 	if (ioctl(cmdfd, TIOCSWINSZ, &w) < 0)
 		fprintf(stderr, "Couldn't set window size: %s\n", strerror(errno));
 }
@@ -991,6 +1039,21 @@ tsetdirtattr(int attr)
 	}
 }
 
+void
+tsetdirtrune(Rune u)
+{
+	int i, j;
+
+	for (i = 0; i < term.row; i++) {
+		for (j = 0; j < term.col; j++) {
+			if (term.line[i][j].u == u) {
+				tsetdirt(i, i);
+				break;
+			}
+		}
+	}
+}
+
 void
 tfulldirt(void)
 {
@@ -1219,6 +1282,7 @@ tsetchar(Rune u, Glyph *attr, int x, int y)
 	term.dirty[y] = 1;
 	term.line[y][x] = *attr;
 	term.line[y][x].u = u;
+	term.line[y][x].gid = xglyphid(u, attr->mode);
 }
 
 void
@@ -2562,6 +2626,13 @@ drawregion(int x1, int y1, int x2, int y2)
 {
 	int y;
 
+	/* Render the glyphs the dirty lines are missing in one go */
+	for (y = y1; y < y2; y++) {
+		if (term.dirty[y])
+			xprepareline(term.line[y], x1, y, x2);
+	}
+	xpreparedraw();
+
 	for (y = y1; y < y2; y++) {
 		if (!term.dirty[y])
 			continue;
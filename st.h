@@ -63,6 +63,7 @@ typedef uint_least32_t Rune;
 typedef struct {
 	Rune u;           /* character code */
 	ushort mode;      /* attribute flags */
+	ushort gid;       /* resolved glyph, see xglyphid() */
 	uint32_t fg;      /* foreground  */
 	uint32_t bg;      /* background  */
 } Glyph;
@@ -80,6 +81,7 @@ typedef union {
 void die(const char *, ...);
 void redraw(void);
 void draw(void);
+void tfulldirt(void);
 
 void printscreen(const Arg *);
 void printsel(const Arg *);
@@ -90,9 +92,12 @@ int tattrset(int);
 void tnew(int, int);
 void tresize(int, int);
 void tsetdirtattr(int);
+void tsetdirtrune(Rune);
 void ttyhangup(void);
 int ttynew(char *, char *, char *, char **);
+int ttyreplay(char *);
 size_t ttyread(void);
+int ttyexited(void);
 void ttyresize(int, int);
 void ttywrite(const char *, size_t, int);
 
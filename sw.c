@@ -0,0 +1,556 @@
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define SWSIMD
+#endif
+#include "sw.h"
+
+/* For xmalloc */
+#include "st.h"
+
+#define makerect(x, y, w, h)            (Rect){(x), (y), (w), (h)}
+
+/* Canvas pixels are 0x00RRGGBB, the layout of 24-bit TrueColor ZPixmaps */
+typedef void (*Blendfn)(uint32_t *, const uint8_t *, uint32_t, uint32_t, uint32_t);
+
+typedef struct {
+        Display *dpy;
+        Window win;
+        GC gc;
+        XImage *img;
+        XShmSegmentInfo shminfo;
+        int shm;
+        uint32_t w, h;
+        uint32_t *rt[2];        /* blink-on and blink-off canvases */
+        Rect dirty;             /* drawn, but not yet presented */
+        Rect blinkrect;         /* union of the blinking quads */
+        int redrawn;            /* the next frame draws every cell */
+        Rect cursor;            /* cursor in the presented image */
+        int phase;              /* blink phase of the presented image */
+        Blendfn blend;
+} SWCTX;
+
+static SWCTX sw;
+static int shmfailed;
+static float atlasscale; /* see vkatlasscale() */
+
+static inline void addrect(Rect *, Rect);
+static inline void cliprect(Rect *, uint32_t, uint32_t);
+static inline uint32_t pack(Color);
+static inline uint32_t lerp(uint32_t, uint32_t, uint32_t);
+static void blendscalar(uint32_t *, const uint8_t *, uint32_t, uint32_t, uint32_t);
+static inline uint32_t sdftexel(const uint8_t *, uint32_t, int, int);
+static void sdfrow(uint32_t *, const uint8_t *, uint32_t, float, float, uint32_t,
+                   uint32_t, uint32_t);
+static Blendfn pickblend(void);
+static inline void fillrow(uint32_t *, uint32_t, uint32_t);
+static inline uint32_t *imgrow(uint32_t);
+static void fillrect(Rect, uint32_t);
+static void drawquad(const VKQUAD *, const uint8_t *, uint32_t);
+static void drawcursor(const CursorSpec *, int, const uint8_t *, uint32_t);
+static int shmerror(Display *, XErrorEvent *);
+static int initimg(uint32_t, uint32_t);
+static void freeimg(void);
+
+void
+addrect(Rect *a, Rect b)
+{
+        uint16_t x1 = b.x + b.w;
+        uint16_t y1 = b.y + b.h;
+
+        if (b.w == 0 || b.h == 0)
+                return;
+        if (a->w == 0 || a->h == 0) {
+                *a = b;
+                return;
+        }
+
+        if (b.x < a->x)
+                a->x = b.x;
+        if (x1 > a->x + a->w)
+                a->w = x1 - a->x;
+
+        if (b.y < a->y)
+                a->y = b.y;
+        if (y1 > a->y + a->h)
+                a->h = y1 - a->y;
+}
+
+void
+cliprect(Rect *r, uint32_t w, uint32_t h)
+{
+        if (r->x >= w || r->y >= h) {
+                *r = makerect(0, 0, 0, 0);
+                return;
+        }
+        if (r->x + r->w > w)
+                r->w = w - r->x;
+        if (r->y + r->h > h)
+                r->h = h - r->y;
+}
+
+uint32_t
+pack(Color c)
+{
+        return (uint32_t)c.r << 16 | (uint32_t)c.g << 8 | c.b;
+}
+
+/* fg*t + bg*(255-t), divided by 255 with rounding, two channels at a time */
+uint32_t
+lerp(uint32_t fg, uint32_t bg, uint32_t t)
+{
+        uint32_t rb, g;
+
+        rb = (fg & 0xff00ff) * t + (bg & 0xff00ff) * (255 - t) + 0x800080;
+        rb = ((rb + ((rb >> 8) & 0xff00ff)) >> 8) & 0xff00ff;
+        g = ((fg >> 8) & 0xff) * t + ((bg >> 8) & 0xff) * (255 - t) + 0x80;
+        g = ((g + (g >> 8)) >> 8) & 0xff;
+
+        return rb | g << 8;
+}
+
+void
+blendscalar(uint32_t *dst, const uint8_t *t, uint32_t n, uint32_t fg, uint32_t bg)
+{
+        uint32_t i;
+
+        for (i = 0; i < n; i++)
+                dst[i] = lerp(fg, bg, t[i]);
+}
+
+/* Outside of the atlas is far from any glyph, as with the border sampler */
+uint32_t
+sdftexel(const uint8_t *atlas, uint32_t atlassiz, int x, int y)
+{
+        if (x < 0 || y < 0 || (uint32_t)x >= atlassiz || (uint32_t)y >= atlassiz)
+                return 0;
+        return atlas[(size_t)y*atlassiz + x];
+}
+
+/*
+ * Same as the distance field path of prog.glsl: n pixels from the atlas
+ * position x, y onwards, 1/atlasscale apart, sampled bilinearly.
+ */
+void
+sdfrow(uint32_t *dst, const uint8_t *atlas, uint32_t atlassiz, float x, float y, uint32_t n,
+       uint32_t fg, uint32_t bg)
+{
+        float soft = 1.0f / (4.0f * SDFSPREAD * atlasscale);
+        float edge = 128.0f / 255.0f;
+        float fx, fy, d, t;
+        int x0, y0;
+        uint32_t i;
+
+        y -= 0.5f;
+        y0 = (int)floorf(y);
+        fy = y - y0;
+        for (i = 0; i < n; i++) {
+                fx = x + (i + 0.5f) / atlasscale - 0.5f;
+                x0 = (int)floorf(fx);
+                fx -= x0;
+                d = ((sdftexel(atlas, atlassiz, x0, y0) * (1 - fx) +
+                      sdftexel(atlas, atlassiz, x0 + 1, y0) * fx) * (1 - fy) +
+                     (sdftexel(atlas, atlassiz, x0, y0 + 1) * (1 - fx) +
+                      sdftexel(atlas, atlassiz, x0 + 1, y0 + 1) * fx) * fy) / 255.0f;
+                t = (d - edge + soft) / (2 * soft);
+                t = t < 0 ? 0 : t > 1 ? 1 : t;
+                dst[i] = lerp(fg, bg, (uint32_t)(t*t*(3 - 2*t) * 255 + 0.5f));
+        }
+}
+
+#ifdef SWSIMD
+/*
+ * The same blend on 16-bit lanes: the coverage is replicated over the
+ * channels of its pixel, and x/255 is (x + x/256) / 256 after the rounding
+ * bias, exactly as in lerp().
+ */
+__attribute__((target("sse2")))
+static inline __m128i
+lerpsse2(__m128i fg, __m128i bg, __m128i t)
+{
+        __m128i x;
+
+        x = _mm_add_epi16(_mm_mullo_epi16(fg, t),
+                          _mm_mullo_epi16(bg, _mm_sub_epi16(_mm_set1_epi16(255), t)));
+        x = _mm_add_epi16(x, _mm_set1_epi16(128));
+        return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+}
+
+__attribute__((target("sse2")))
+static void
+blendsse2(uint32_t *dst, const uint8_t *t, uint32_t n, uint32_t fg, uint32_t bg)
+{
+        __m128i zero = _mm_setzero_si128();
+        __m128i vfg = _mm_unpacklo_epi8(_mm_set1_epi32((int)fg), zero);
+        __m128i vbg = _mm_unpacklo_epi8(_mm_set1_epi32((int)bg), zero);
+        __m128i a, lo, hi;
+        uint32_t i, tt;
+
+        for (i = 0; i + 4 <= n; i += 4) {
+                memcpy(&tt, t + i, sizeof tt);
+                a = _mm_cvtsi32_si128((int)tt);
+                a = _mm_unpacklo_epi8(a, a);
+                a = _mm_unpacklo_epi16(a, a);
+                lo = lerpsse2(vfg, vbg, _mm_unpacklo_epi8(a, zero));
+                hi = lerpsse2(vfg, vbg, _mm_unpackhi_epi8(a, zero));
+                _mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(lo, hi));
+        }
+        blendscalar(dst + i, t + i, n - i, fg, bg);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i
+lerpavx2(__m256i fg, __m256i bg, __m256i t)
+{
+        __m256i x;
+
+        x = _mm256_add_epi16(_mm256_mullo_epi16(fg, t),
+                             _mm256_mullo_epi16(bg, _mm256_sub_epi16(_mm256_set1_epi16(255), t)));
+        x = _mm256_add_epi16(x, _mm256_set1_epi16(128));
+        return _mm256_srli_epi16(_mm256_add_epi16(x, _mm256_srli_epi16(x, 8)), 8);
+}
+
+__attribute__((target("avx2")))
+static void
+blendavx2(uint32_t *dst, const uint8_t *t, uint32_t n, uint32_t fg, uint32_t bg)
+{
+        __m256i zero = _mm256_setzero_si256();
+        __m256i vfg = _mm256_unpacklo_epi8(_mm256_set1_epi32((int)fg), zero);
+        __m256i vbg = _mm256_unpacklo_epi8(_mm256_set1_epi32((int)bg), zero);
+        __m256i rep = _mm256_set1_epi32(0x01010101);
+        __m256i a, lo, hi;
+        uint32_t i;
+
+        for (i = 0; i + 8 <= n; i += 8) {
+                a = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(t + i)));
+                a = _mm256_mullo_epi32(a, rep);
+                /* per 128-bit lane: pixels 0-1 and 2-3, packed back in order */
+                lo = lerpavx2(vfg, vbg, _mm256_unpacklo_epi8(a, zero));
+                hi = lerpavx2(vfg, vbg, _mm256_unpackhi_epi8(a, zero));
+                _mm256_storeu_si256((__m256i *)(dst + i), _mm256_packus_epi16(lo, hi));
+        }
+        blendscalar(dst + i, t + i, n - i, fg, bg);
+}
+#endif
+
+Blendfn
+pickblend(void)
+{
+#ifdef SWSIMD
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+                return blendavx2;
+        if (__builtin_cpu_supports("sse2"))
+                return blendsse2;
+#endif
+        return blendscalar;
+}
+
+void
+fillrow(uint32_t *dst, uint32_t n, uint32_t c)
+{
+        while (n--)
+                *dst++ = c;
+}
+
+uint32_t *
+imgrow(uint32_t y)
+{
+        return (uint32_t *)(sw.img->data + (size_t)y*sw.img->bytes_per_line);
+}
+
+/* Fills a rectangle of the presented image */
+void
+fillrect(Rect r, uint32_t c)
+{
+        uint32_t y;
+
+        cliprect(&r, sw.w, sw.h);
+        for (y = r.y; y < (uint32_t)r.y + r.h; y++)
+                fillrow(imgrow(y) + r.x, r.w, c);
+}
+
+/* Same as the fragment shader in prog.glsl, into both canvases */
+void
+drawquad(const VKQUAD *q, const uint8_t *atlas, uint32_t atlassiz)
+{
+        uint32_t fg = pack(q->fg), bg = pack(q->bg);
+        uint8_t flags = q->bg.a;
+        uint32_t y, n, *on, *off;
+        Rect r = makerect(q->x, q->y, q->uv.w, q->uv.h);
+
+        cliprect(&r, sw.w, sw.h);
+        for (y = 0; y < r.h; y++) {
+                on = sw.rt[0] + (size_t)(r.y + y)*sw.w + r.x;
+                off = sw.rt[1] + (size_t)(r.y + y)*sw.w + r.x;
+
+                if (flags & QUAD_FILL) {
+                        fillrow(on, r.w, fg);
+                } else if (atlasscale > 0) {
+                        sdfrow(on, atlas, atlassiz, q->uv.x, q->uv.y + (y + 0.5f) / atlasscale,
+                               r.w, fg, bg);
+                } else if (q->uv.x >= atlassiz || q->uv.y + y >= atlassiz) {
+                        /* NOUV, or outside of the atlas */
+                        fillrow(on, r.w, bg);
+                } else {
+                        n = MIN(r.w, atlassiz - q->uv.x);
+                        sw.blend(on, atlas + (size_t)(q->uv.y + y)*atlassiz + q->uv.x, n, fg, bg);
+                        fillrow(on + n, r.w - n, bg);
+                }
+
+                if (flags & QUAD_BLINK)
+                        fillrow(off, r.w, bg);
+                else
+                        memcpy(off, on, r.w * sizeof *on);
+        }
+
+        addrect(&sw.dirty, r);
+        if (flags & QUAD_BLINK)
+                addrect(&sw.blinkrect, r);
+}
+
+/* Same as the fragment shader in overlay.glsl */
+void
+drawcursor(const CursorSpec *c, int phase, const uint8_t *atlas, uint32_t atlassiz)
+{
+        uint32_t fg = pack(c->fg), bg = pack(c->bg);
+        int x0, x1, y0, y1, y;
+        Rect r = c->r;
+
+        if ((c->style & 7) == CUR_NONE || ((c->style & CUR_BLINK) && phase))
+                return;
+
+        switch (c->style & 7) {
+        case CUR_BLOCK:
+                fillrect(r, bg);
+                x0 = MAX(c->gx, r.x);
+                y0 = MAX(c->gy, r.y);
+                x1 = MIN(MIN(c->gx + c->uv.w, r.x + r.w), (int)sw.w);
+                y1 = MIN(MIN(c->gy + c->uv.h, r.y + r.h), (int)sw.h);
+                if (atlasscale > 0) {
+                        for (y = y0; y < y1 && x0 < x1; y++) {
+                                sdfrow(imgrow(y) + x0, atlas, atlassiz,
+                                       c->uv.x + (x0 - c->gx) / atlasscale,
+                                       c->uv.y + (y - c->gy + 0.5f) / atlasscale,
+                                       x1 - x0, fg, bg);
+                        }
+                        break;
+                }
+                if (c->uv.x + c->uv.w > atlassiz || c->uv.y + c->uv.h > atlassiz)
+                        break;
+                for (y = y0; y < y1 && x0 < x1; y++) {
+                        sw.blend(imgrow(y) + x0,
+                                 atlas + (size_t)(c->uv.y + y - c->gy)*atlassiz + c->uv.x + x0 - c->gx,
+                                 x1 - x0, fg, bg);
+                }
+                break;
+        case CUR_UNDERLINE:
+                fillrect(makerect(r.x, r.y + r.h - MIN(c->thick, r.h), r.w, MIN(c->thick, r.h)), fg);
+                break;
+        case CUR_BAR:
+                fillrect(makerect(r.x, r.y, MIN(c->thick, r.w), r.h), fg);
+                break;
+        case CUR_HOLLOW:
+                fillrect(makerect(r.x, r.y, r.w, 1), fg);
+                fillrect(makerect(r.x, r.y + r.h - 1, r.w, 1), fg);
+                fillrect(makerect(r.x, r.y, 1, r.h), fg);
+                fillrect(makerect(r.x + r.w - 1, r.y, 1, r.h), fg);
+                break;
+        }
+}
+
+int
+shmerror(Display *dpy, XErrorEvent *ev)
+{
+        shmfailed = 1;
+        return 0;
+}
+
+int
+initimg(uint32_t w, uint32_t h)
+{
+        XWindowAttributes attr;
+        XErrorHandler old;
+        Visual *vis;
+        char *data;
+
+        XGetWindowAttributes(sw.dpy, sw.win, &attr);
+        vis = attr.visual;
+        if (vis->red_mask != 0xff0000 || vis->green_mask != 0xff00 || vis->blue_mask != 0xff) {
+                fprintf(stderr, "FATAL: the software renderer needs a 24-bit TrueColor visual\n");
+                return 1;
+        }
+
+        /* MIT-SHM, unless the display is remote */
+        sw.shm = XShmQueryExtension(sw.dpy);
+        if (sw.shm) {
+                sw.img = XShmCreateImage(sw.dpy, vis, attr.depth, ZPixmap, NULL, &sw.shminfo, w, h);
+                sw.shm = sw.img != NULL;
+        }
+        if (sw.shm) {
+                sw.shminfo.shmid = shmget(IPC_PRIVATE, (size_t)sw.img->bytes_per_line*sw.img->height,
+                                          IPC_CREAT|0600);
+                if (sw.shminfo.shmid < 0) {
+                        XDestroyImage(sw.img);
+                        sw.shm = 0;
+                }
+        }
+        if (sw.shm) {
+                sw.shminfo.shmaddr = sw.img->data = shmat(sw.shminfo.shmid, NULL, 0);
+                sw.shminfo.readOnly = False;
+
+                /* Attaching fails on remote displays, only as an X error */
+                shmfailed = 0;
+                old = XSetErrorHandler(shmerror);
+                XShmAttach(sw.dpy, &sw.shminfo);
+                XSync(sw.dpy, False);
+                XSetErrorHandler(old);
+                shmctl(sw.shminfo.shmid, IPC_RMID, NULL);
+
+                if (shmfailed) {
+                        shmdt(sw.shminfo.shmaddr);
+                        sw.img->data = NULL;
+                        XDestroyImage(sw.img);
+                        sw.shm = 0;
+                }
+        }
+        if (!sw.shm) {
+                data = xmalloc((size_t)w*h*4);
+                sw.img = XCreateImage(sw.dpy, vis, attr.depth, ZPixmap, 0, data, w, h, 32, 0);
+                if (!sw.img) {
+                        fprintf(stderr, "FATAL: XCreateImage()\n");
+                        free(data);
+                        return 1;
+                }
+        }
+        if (sw.img->bits_per_pixel != 32) {
+                fprintf(stderr, "FATAL: the software renderer needs 32-bit pixels\n");
+                freeimg();
+                return 1;
+        }
+
+        sw.w = w;
+        sw.h = h;
+        sw.rt[0] = xmalloc((size_t)w*h*sizeof *sw.rt[0]);
+        sw.rt[1] = xmalloc((size_t)w*h*sizeof *sw.rt[1]);
+        memset(sw.rt[0], 0, (size_t)w*h*sizeof *sw.rt[0]);
+        memset(sw.rt[1], 0, (size_t)w*h*sizeof *sw.rt[1]);
+
+        sw.dirty = makerect(0, 0, (uint16_t)w, (uint16_t)h);
+        sw.blinkrect = makerect(0, 0, 0, 0);
+        sw.cursor = makerect(0, 0, 0, 0);
+
+        return 0;
+}
+
+void
+freeimg(void)
+{
+        if (!sw.img)
+                return;
+        if (sw.shm) {
+                XShmDetach(sw.dpy, &sw.shminfo);
+                XSync(sw.dpy, False);
+                shmdt(sw.shminfo.shmaddr);
+                sw.img->data = NULL;
+        }
+        XDestroyImage(sw.img);
+        sw.img = NULL;
+        free(sw.rt[0]);
+        free(sw.rt[1]);
+        sw.rt[0] = sw.rt[1] = NULL;
+}
+
+void
+swatlasscale(float scale)
+{
+        atlasscale = scale;
+}
+
+int
+swinit(Display *dpy, Window win, int w, int h)
+{
+        sw.dpy = dpy;
+        sw.win = win;
+        sw.gc = XCreateGC(dpy, win, 0, NULL);
+        sw.blend = pickblend();
+
+        return initimg((uint32_t)w, (uint32_t)h);
+}
+
+void
+swfree(void)
+{
+        freeimg();
+        XFreeGC(sw.dpy, sw.gc);
+}
+
+int
+swresize(int w, int h)
+{
+        freeimg();
+        return initimg((uint32_t)w, (uint32_t)h);
+}
+
+/*
+ * Draws the quads into the canvases, then composes the damaged rows, the
+ * old and new cursor and, on a blink phase flip, the blinking quads into
+ * the image and puts only that rectangle.
+ */
+void
+swredrawn(void)
+{
+        sw.redrawn = 1;
+}
+
+int
+swflush(const VKQUAD *quads, uint32_t nquad, const uint8_t *atlas, uint32_t atlassiz,
+        const CursorSpec *c, uint32_t time, uint32_t period)
+{
+        int phase = period ? (time / period) & 1 : 0;
+        uint32_t i, y;
+        Rect d;
+
+        /* The quads which still blink are all among these */
+        if (sw.redrawn)
+                sw.blinkrect = makerect(0, 0, 0, 0);
+        sw.redrawn = 0;
+        for (i = 0; i < nquad; i++)
+                drawquad(quads + i, atlas, atlassiz);
+
+        d = sw.dirty;
+        addrect(&d, sw.cursor);
+        addrect(&d, c->r);
+        if (phase != sw.phase)
+                addrect(&d, sw.blinkrect);
+        cliprect(&d, sw.w, sw.h);
+        sw.dirty = makerect(0, 0, 0, 0);
+        sw.cursor = c->r;
+        sw.phase = phase;
+        if (d.w == 0 || d.h == 0)
+                return 0;
+
+        for (y = d.y; y < (uint32_t)d.y + d.h; y++) {
+                memcpy(imgrow(y) + d.x, sw.rt[phase] + (size_t)y*sw.w + d.x,
+                       d.w * sizeof *sw.rt[phase]);
+        }
+        drawcursor(c, phase, atlas, atlassiz);
+
+        if (sw.shm) {
+                XShmPutImage(sw.dpy, sw.win, sw.gc, sw.img, d.x, d.y, d.x, d.y, d.w, d.h, False);
+                /* The segment must not change while the server reads it */
+                XSync(sw.dpy, False);
+        } else {
+                XPutImage(sw.dpy, sw.win, sw.gc, sw.img, d.x, d.y, d.x, d.y, d.w, d.h);
+        }
+
+        return 0;
+}
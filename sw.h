@@ -0,0 +1,15 @@
+#ifndef SW_H
+#define SW_H
+
+#include "vk.h"
+
+/* CPU renderer, vk.c falls back to it when vulkan is unavailable */
+int swinit(Display *, Window, int, int);
+void swfree(void);
+int swresize(int, int);
+void swredrawn(void);
+void swatlasscale(float);
+int swflush(const VKQUAD *, uint32_t, const uint8_t *, uint32_t,
+            const CursorSpec *, uint32_t, uint32_t);
+
+#endif
@@ -2,15 +2,20 @@
 #define VK_USE_PLATFORM_XLIB_KHR
 #include <vulkan/vulkan.h>
 #include <dlfcn.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "vk.h"
+#include "sw.h"
 
 #define EXPORTED_VK_FUNC(name)          static PFN_##name name;
 #define GLOBAL_VK_FUNC(name)            static PFN_##name name;
 #define INSTANCE_VK_FUNC(name)          static PFN_##name name;
 #define DEVICE_VK_FUNC(name)            static PFN_##name name;
+#define WSI_INSTANCE_VK_FUNC(name)      static PFN_##name name;
+#define WSI_DEVICE_VK_FUNC(name)        static PFN_##name name;
+#define OPTIONAL_DEVICE_VK_FUNC(name)   static PFN_##name name;
 
 #include "vkfuncs.h"
 
@@ -24,8 +29,29 @@
 #define APPVER                          VK_MAKE_VERSION(0, 1, 0)
 #define APIVER                          VK_MAKE_VERSION(1, 0, 0)
 
+/*
+ * The render target is also a storage image of the grid shader, which
+ * needs a format every device can store to.
+ */
+#define RTFMT                           VK_FORMAT_R8G8B8A8_UNORM
+
+/* Screen tile of the grid shader, see grid.glsl */
+#define TILESIZ                         (16)
+#define MAXTILES                        (65535)
+
 #define SSBUFSIZ                        (1024*1024*2)
-#define STGBUFSIZ                       (SSBUFSIZ + ATLASSIZ*ATLASSIZ)
+
+/*
+ * Buffer of the raster shader, see raster.glsl: jobs and segments in the
+ * first RSINSIZ bytes, the coverage copied to the atlas in the rest.
+ */
+#define RSBUFSIZ                        (1024*1024)
+#define RSINSIZ                         (RSBUFSIZ/2)
+
+#define STGBUFSIZ                       (SSBUFSIZ + ATLASSIZ*ATLASSIZ + RSINSIZ)
+
+/* How long the present waiter blocks on a single frame, in ns */
+#define PRESENTTIMEOUT                  (100*1000*1000)
 
 #define makerect(x, y, w, h)            (Rect){(x), (y), (w), (h)}
 #define makearr(s, n)                   (s) = xmalloc((n)*sizeof(*(s)))
@@ -33,39 +59,64 @@
 
 static const char *instext[] = { VK_KHR_SURFACE_EXTENSION_NAME, VK_KHR_XLIB_SURFACE_EXTENSION_NAME };
 static const char *devext[] = { VK_KHR_SWAPCHAIN_EXTENSION_NAME };
+static const char *presentext[] = { VK_KHR_PRESENT_ID_EXTENSION_NAME, VK_KHR_PRESENT_WAIT_EXTENSION_NAME };
 
 extern const char vssrc[];
 extern const char fssrc[];
 extern const int vssrc_size;
 extern const int fssrc_size;
+extern const char ovssrc[];
+extern const char ofssrc[];
+extern const int ovssrc_size;
+extern const int ofssrc_size;
+extern const char gcssrc[];
+extern const int gcssrc_size;
+extern const char rcssrc[];
+extern const int rcssrc_size;
 
 #pragma pack(push, 1)
 typedef struct {
         float vw, vh;
         float tw, th;
+        float scale;    /* see vkatlasscale() */
 } VKPC;
 
+/* Overlay push constants, see overlay.glsl */
 typedef struct {
-        uint16_t x, y;
-        Rect uv;
+        int32_t cursor[4];
+        int32_t glyph[4];
+        int32_t uv[2];
         Color fg;
         Color bg;
-} VKQUAD;
+        uint32_t style;
+        uint32_t thick;
+        uint32_t time;
+        uint32_t period;
+        float scale;
+} VKOPC;
 #pragma pack(pop)
 
 typedef struct {
         uint32_t w;
         uint32_t h;
         uint32_t nimg;
+        VkFormat fmt;
+        VkDeviceMemory mem;     /* headless only, the single owned image */
         VkImage *imgs;
+        VkImageView *views;
+        VkFramebuffer *fbs;
         Rect *dirty;
+        Rect *cursor;   /* cursor last composed into the image */
+        uint8_t *phase; /* blink phase last composed into the image */
+        uint8_t *init;  /* image has been presented before */
         VkSwapchainKHR handle;
 } VKSC;
 
+/* The blink-on and blink-off frames, rendered side by side */
 typedef struct {
-        VkImage img;
-        VkDeviceMemory mem;
-        VkImageView view;
+        VkImage img[2];
+        VkDeviceMemory mem[2];
+        VkImageView view[2];
         VkFramebuffer fb;
 } VKRT;
 
@@ -106,30 +157,120 @@ typedef struct {
         VkCommandBuffer cmdbuf;
         VkDescriptorPool descpool;
         VkDescriptorSet descset;
+        VkRenderPass overpass;
+        VKPIPE overlay;
+        VkDescriptorSet overset;
+        VkSampler rtsampler;
         VkSemaphore acquire, release;
         Rect dirty;
+        Rect blinkrect;  /* union of the blinking quads */
+        Rect frameblink; /* blinking quads of the frame being built */
+        int redrawn;     /* see vkredrawn() */
+        CursorSpec cursor;
+        uint32_t time;
+        uint32_t period;
+        int phase;
+        int overdirty;   /* cursor or blink phase changed */
+        int headless;    /* no surface, compose into an owned image */
+        int sw;          /* everything goes to the software renderer */
+        VkQueryPool query;
+        float tsperiod;  /* ns per timestamp tick */
+        VKPIPE grid;
+        VkDescriptorSet gridset;
+        int usegrid;     /* draw with the grid shader instead of quads */
+        VKPIPE raster;
+        VkDescriptorSet rasterset;
 } VKCTX;
 
+/* The atlas is taken up to y from x to x + w, see placeatlas() */
 typedef struct {
         uint16_t x;
         uint16_t y;
-        uint16_t maxy;
+        uint16_t w;
+} VKSKYLINE;
+
+typedef struct {
+        VKSKYLINE sky[ATLASSIZ];  /* left to right, covering the width */
+        uint16_t nsky;
         uint16_t dirty;
         uint8_t data[ATLASSIZ*ATLASSIZ];
 } VKATLAS;
 
+/* Glyphs waiting for the next atlas upload */
+typedef struct {
+        VkBufferImageCopy *blits;  /* regions of fontatlas.data */
+        uint32_t nblit;
+        uint32_t blitcap;
+        uint32_t *jobs;            /* outlines for raster.glsl */
+        VkBufferImageCopy *copies; /* coverage of each job to the atlas */
+        uint32_t njob;
+        uint32_t jobcap;
+        float *segs;
+        uint32_t nseg;
+        uint32_t segcap;
+        uint32_t out;              /* coverage words of the jobs */
+} VKPENDING;
+
 typedef struct {
         uint32_t sz;
         uint32_t cap;
         VKQUAD *data;
 } VKARR;
 
+/* Quads binned into screen tiles for the grid shader, see bingrid() */
+typedef struct {
+        uint32_t *bin;  /* per tile: quad count, then write position */
+        uint32_t nbin;
+        uint32_t *words;
+        uint32_t sz;
+        uint32_t cap;
+} VKGRID;
+
+/* VK_KHR_present_id/present_wait state, see presentwaiter() */
+typedef struct {
+        int enabled;
+        int running;
+        int paused;
+        int busy;
+        int quit;
+        uint64_t id;   /* id of the last queued present */
+        uint64_t done; /* last id the waiter is finished with */
+        pthread_t thread;
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+        void (*queuedcb)(uint64_t);
+        void (*cb)(uint64_t, const struct timespec *);
+} VKPRESENT;
+
+/* Device creation in the background, see vkprepare() */
+typedef struct {
+        int running;
+        int done;
+        int ret;
+        Display *dpy;
+        pthread_t thread;
+} VKPREP;
+
 static VKCTX ctx;
 static VKIMG fontimg;
 static VKBUF ssbuf;
 static VKBUF stgbuf;
-static VKATLAS fontatlas = { .x = ATLASPAD, .y = ATLASPAD };
+static VKBUF rsbuf;
+static VKBUF rbbuf;
+static void (*framecb)(const VKFrame *);
+static VKATLAS fontatlas = {
+        .sky = { { ATLASPAD, ATLASPAD, ATLASSIZ - ATLASPAD } },
+        .nsky = 1,
+};
+static float atlasscale; /* distance field glyphs drawn this much larger, or 0 */
+static VKPENDING pend;
 static VKARR quadarr;
+static VKGRID grid;
+static VKPRESENT pres = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .cond = PTHREAD_COND_INITIALIZER,
+};
+static VKPREP prep;
 
 static int load_exported_vk_func(void);
 static int load_global_vk_funcs(void);
@@ -137,15 +278,28 @@ static int load_instance_vk_funcs(void);
 static int load_device_vk_funcs(void);
 
 static inline void addrect(Rect *, Rect);
+static inline void cliprect(Rect *, uint32_t, uint32_t);
 static int initswapchain(VKSC *, uint32_t, uint32_t);
+static int initoffscreen(VKSC *, uint32_t, uint32_t);
+static int initscimgs(VKSC *);
+static int initscfbs(VKSC *);
 static void freeswapchain(VKSC *);
 static inline uint32_t getmemidx(uint32_t, VkMemoryPropertyFlags);
+static int initrtimg(VKRT *, int, uint32_t, uint32_t);
 static int initrt(VKRT *);
 static void freert(VKRT *);
 static int initpipe(VKPIPE *);
+static int initoverlay(VKPIPE *);
+static void updateoverlay(void);
+static int initgrid(VKPIPE *);
+static int initraster(VKPIPE *);
+static void updategrid(void);
+static uint32_t bingrid(const VKQUAD *, uint32_t, uint32_t, uint32_t);
 static void freepipe(VKPIPE *);
 static int initbuf(VKBUF *, VkDeviceSize, VkBufferUsageFlags, VkMemoryPropertyFlags);
+static void readback(void);
 static void freebuf(VKBUF *);
+static int placeatlas(uint16_t *, uint16_t *, uint16_t, uint16_t);
 static int initimg(VKIMG *, uint32_t, uint32_t, VkFormat);
 static void freeimg(VKIMG *);
 static void imgbarrier(VkImage, VkAccessFlags, VkAccessFlags, VkImageLayout, VkImageLayout,
@@ -153,6 +307,14 @@ static void imgbarrier(VkImage, VkAccessFlags, VkAccessFlags, VkImageLayout, VkI
 static void bufbarrier(VkBuffer, VkDeviceSize,
                 VkAccessFlags, VkAccessFlags,
                 VkPipelineStageFlags, VkPipelineStageFlags);
+static int hasinstext(const char *);
+static int hasdevext(const char *);
+static void *presentwaiter(void *);
+static void pausepresent(int);
+static int initdevice(Display *);
+static void *preparedevice(void *);
+static int initvk(Display *, Window, int, int);
+static void freevk(void);
 
 int
 load_exported_vk_func(void)
@@ -191,6 +353,14 @@ load_instance_vk_funcs(void)
             fprintf(stderr, "failed to load vk proc: " #name "\n");     \
             return 1;                                                   \
     }
+#define WSI_INSTANCE_VK_FUNC(name)                                      \
+    if (!ctx.headless) {                                                \
+            name = (PFN_##name)vkGetInstanceProcAddr(ctx.instance, #name); \
+            if (!name) {                                                \
+                    fprintf(stderr, "failed to load vk proc: " #name "\n"); \
+                    return 1;                                           \
+            }                                                           \
+    }
 #include "vkfuncs.h"
 
     return 0;
@@ -205,6 +375,16 @@ load_device_vk_funcs(void)
             fprintf(stderr, "failed to load vk proc: " #name "\n");     \
             return 1;                                                   \
     }
+#define WSI_DEVICE_VK_FUNC(name)                                        \
+    if (!ctx.headless) {                                                \
+            name = (PFN_##name)vkGetDeviceProcAddr(ctx.dev, #name);     \
+            if (!name) {                                                \
+                    fprintf(stderr, "failed to load vk proc: " #name "\n"); \
+                    return 1;                                           \
+            }                                                           \
+    }
+#define OPTIONAL_DEVICE_VK_FUNC(name)                                   \
+    name = (PFN_##name)vkGetDeviceProcAddr(ctx.dev, #name);
 #include "vkfuncs.h"
 
     return 0;
@@ -216,6 +396,13 @@ addrect(Rect *a, Rect b)
         uint16_t x1 = b.x + b.w;
         uint16_t y1 = b.y + b.h;
 
+        if (b.w == 0 || b.h == 0)
+                return;
+        if (a->w == 0 || a->h == 0) {
+                *a = b;
+                return;
+        }
+
         if (b.x < a->x)
                 a->x = b.x;
         if (x1 > a->x + a->w)
@@ -227,6 +414,19 @@ addrect(Rect *a, Rect b)
                 a->h = y1 - a->y;
 }
 
+void
+cliprect(Rect *r, uint32_t w, uint32_t h)
+{
+        if (r->x >= w || r->y >= h) {
+                *r = makerect(0, 0, 0, 0);
+                return;
+        }
+        if (r->x + r->w > w)
+                r->w = w - r->x;
+        if (r->y + r->h > h)
+                r->h = h - r->y;
+}
+
 int
 initswapchain(VKSC *sc, uint32_t w, uint32_t h)
 {
@@ -237,6 +437,9 @@ initswapchain(VKSC *sc, uint32_t w, uint32_t h)
         VkSurfaceFormatKHR fmt;
         VkPresentModeKHR mode;
 
+        if (ctx.headless)
+                return initoffscreen(sc, w, h);
+
         /* Pick a surface format */
         vkGetPhysicalDeviceSurfaceFormatsKHR(ctx.pdev, ctx.surface, &count, NULL);
         makearr(fmts, count);
@@ -285,7 +488,7 @@ initswapchain(VKSC *sc, uint32_t w, uint32_t h)
                 info.preTransform = caps.currentTransform;
                 info.compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR;
                 info.presentMode = mode;
-                info.imageUsage = VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+                info.imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
                 info.clipped = VK_TRUE;
                 info.oldSwapchain = VK_NULL_HANDLE;
                 info.queueFamilyIndexCount = ctx.nqidx;
@@ -297,29 +500,179 @@ initswapchain(VKSC *sc, uint32_t w, uint32_t h)
                 }
         }
 
+        sc->fmt = fmt.format;
+
         /* Get the swapchain images */
         vkGetSwapchainImagesKHR(ctx.dev, sc->handle, &sc->nimg, NULL);
         makearr(sc->imgs, sc->nimg);
         vkGetSwapchainImagesKHR(ctx.dev, sc->handle, &sc->nimg, sc->imgs);
 
-        /* Create the dirty rectangles */
+        return initscimgs(sc);
+}
+
+/*
+ * Without a surface the overlay pass composes into a single image owned
+ * by us, which can be read back after every frame.
+ */
+int
+initoffscreen(VKSC *sc, uint32_t w, uint32_t h)
+{
+        VkImageCreateInfo info = {0};
+        VkMemoryAllocateInfo allocinfo = {0};
+        VkMemoryRequirements memreq;
+        uint32_t memidx;
+
+        sc->w = w;
+        sc->h = h;
+        sc->nimg = 1;
+        sc->fmt = VK_FORMAT_B8G8R8A8_UNORM;
+        sc->handle = VK_NULL_HANDLE;
+        makearr(sc->imgs, 1);
+
+        info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+        info.imageType = VK_IMAGE_TYPE_2D;
+        info.extent.width = w;
+        info.extent.height = h;
+        info.extent.depth = 1;
+        info.mipLevels = 1;
+        info.arrayLayers = 1;
+        info.format = sc->fmt;
+        info.tiling = VK_IMAGE_TILING_OPTIMAL;
+        info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+        info.usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT|VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+        info.samples = VK_SAMPLE_COUNT_1_BIT;
+        info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+        if (vkCreateImage(ctx.dev, &info, NULL, &sc->imgs[0]) != VK_SUCCESS) {
+                fprintf(stderr, "FATAL: vkCreateImage()\n");
+                return 1;
+        }
+
+        vkGetImageMemoryRequirements(ctx.dev, sc->imgs[0], &memreq);
+        memidx = getmemidx(memreq.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+        if (memidx == UINT32_MAX) {
+                fprintf(stderr, "FATAL: Could not find a suitable memory type\n");
+                vkDestroyImage(ctx.dev, sc->imgs[0], NULL);
+                return 1;
+        }
+
+        allocinfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+        allocinfo.allocationSize = memreq.size;
+        allocinfo.memoryTypeIndex = memidx;
+        if (vkAllocateMemory(ctx.dev, &allocinfo, NULL, &sc->mem) != VK_SUCCESS) {
+                fprintf(stderr, "FATAL: vkAllocateMemory()\n");
+                vkDestroyImage(ctx.dev, sc->imgs[0], NULL);
+                return 1;
+        }
+        vkBindImageMemory(ctx.dev, sc->imgs[0], sc->mem, 0);
+
+        /* Tightly packed BGRA rows */
+        if (initbuf(&rbbuf, (VkDeviceSize)w*h*4, VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT|VK_MEMORY_PROPERTY_HOST_COHERENT_BIT))
+                return 1;
+
+        return initscimgs(sc);
+}
+
+int
+initscimgs(VKSC *sc)
+{
+        uint32_t i;
+
+        /* Create the image views, the framebuffers come with the overlay pass */
+        makearr(sc->views, sc->nimg);
+        makearr(sc->fbs, sc->nimg);
+        memset(sc->views, 0, sc->nimg * sizeof *sc->views);
+        memset(sc->fbs, 0, sc->nimg * sizeof *sc->fbs);
+        for (i = 0; i < sc->nimg; i++) {
+                VkImageViewCreateInfo info = {0};
+                info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+                info.image = sc->imgs[i];
+                info.viewType = VK_IMAGE_VIEW_TYPE_2D;
+                info.format = sc->fmt;
+                info.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+                info.subresourceRange.levelCount = 1;
+                info.subresourceRange.layerCount = 1;
+                if (vkCreateImageView(ctx.dev, &info, NULL, &sc->views[i]) != VK_SUCCESS) {
+                        fprintf(stderr, "FATAL: vkCreateImageView()\n");
+                        return 1;
+                }
+        }
+
+        /* Create the dirty rectangles, the whole image is composed on first use */
         makearr(sc->dirty, sc->nimg);
-        for (i = 0; i < sc->nimg; i++)
+        makearr(sc->cursor, sc->nimg);
+        makearr(sc->phase, sc->nimg);
+        makearr(sc->init, sc->nimg);
+        for (i = 0; i < sc->nimg; i++) {
                 sc->dirty[i] = makerect(0, 0, (uint16_t)sc->w, (uint16_t)sc->h);
+                sc->cursor[i] = makerect(0, 0, 0, 0);
+                sc->phase[i] = 0;
+                sc->init[i] = 0;
+        }
 
-        /* Zero out the frame dirty rect, to make sure the copy op
+        /* Zero out the frame dirty rect, to make sure the overlay pass
          * stays within the boundaries of the newly resized images */
         ctx.dirty = makerect(0, 0, 0, 0);
 
         return 0;
 }
 
+int
+initscfbs(VKSC *sc)
+{
+        uint32_t i;
+
+        for (i = 0; i < sc->nimg; i++) {
+                VkFramebufferCreateInfo info = {0};
+                info.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+                info.renderPass = ctx.overpass;
+                info.attachmentCount = 1;
+                info.pAttachments = &sc->views[i];
+                info.width = sc->w;
+                info.height = sc->h;
+                info.layers = 1;
+                if (vkCreateFramebuffer(ctx.dev, &info, NULL, &sc->fbs[i]) != VK_SUCCESS) {
+                        fprintf(stderr, "FATAL: vkCreateFramebuffer()\n");
+                        return 1;
+                }
+        }
+
+        return 0;
+}
+
 void
 freeswapchain(VKSC *sc)
 {
-        vkDestroySwapchainKHR(ctx.dev, sc->handle, NULL);
+        uint32_t i;
+
+        /* Also after a failed init, the arrays are NULL or zeroed */
+        for (i = 0; sc->views && i < sc->nimg; i++) {
+                vkDestroyFramebuffer(ctx.dev, sc->fbs[i], NULL);
+                vkDestroyImageView(ctx.dev, sc->views[i], NULL);
+        }
+        if (ctx.headless) {
+                freebuf(&rbbuf);
+                vkFreeMemory(ctx.dev, sc->mem, NULL);
+                if (sc->imgs)
+                        vkDestroyImage(ctx.dev, sc->imgs[0], NULL);
+        } else {
+                vkDestroySwapchainKHR(ctx.dev, sc->handle, NULL);
+        }
         free(sc->imgs);
+        free(sc->views);
+        free(sc->fbs);
         free(sc->dirty);
+        free(sc->cursor);
+        free(sc->phase);
+        free(sc->init);
+        sc->imgs = NULL;
+        sc->views = NULL;
+        sc->fbs = NULL;
+        sc->dirty = NULL;
+        sc->cursor = NULL;
+        sc->phase = NULL;
+        sc->init = NULL;
+        sc->nimg = 0;
 }
 
 uint32_t
@@ -335,15 +688,13 @@ getmemidx(uint32_t type, VkMemoryPropertyFlags flags)
 }
 
 int
-initrt(VKRT *rt)
+initrtimg(VKRT *rt, int i, uint32_t w, uint32_t h)
 {
         VkImageCreateInfo imginfo = {0};
         VkMemoryAllocateInfo allocinfo = {0};
         VkImageViewCreateInfo viewinfo = {0};
         VkMemoryRequirements memreq;
         uint32_t memidx;
-        uint32_t w = ctx.swapchain.w;
-        uint32_t h = ctx.swapchain.h;
 
         /* Create the image */
         imginfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
@@ -353,70 +704,82 @@ initrt(VKRT *rt)
         imginfo.extent.depth = 1;
         imginfo.mipLevels = 1;
         imginfo.arrayLayers = 1;
-        imginfo.format = VK_FORMAT_B8G8R8A8_UNORM;
+        imginfo.format = RTFMT;
         imginfo.tiling = VK_IMAGE_TILING_OPTIMAL;
         imginfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-        imginfo.usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT|VK_IMAGE_USAGE_TRANSFER_SRC_BIT|VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+        imginfo.usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT|VK_IMAGE_USAGE_SAMPLED_BIT|
+                VK_IMAGE_USAGE_STORAGE_BIT|VK_IMAGE_USAGE_TRANSFER_SRC_BIT|VK_IMAGE_USAGE_TRANSFER_DST_BIT;
         imginfo.samples = VK_SAMPLE_COUNT_1_BIT;
         imginfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-        if (vkCreateImage(ctx.dev, &imginfo, NULL, &rt->img) != VK_SUCCESS) {
+        if (vkCreateImage(ctx.dev, &imginfo, NULL, &rt->img[i]) != VK_SUCCESS) {
                 fprintf(stderr, "FATAL: vkCreateImage()\n");
                 return 1;
         }
 
         /* Allocate memory */
-        vkGetImageMemoryRequirements(ctx.dev, rt->img, &memreq);
+        vkGetImageMemoryRequirements(ctx.dev, rt->img[i], &memreq);
         memidx = getmemidx(memreq.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
         if (memidx == UINT32_MAX) {
                 fprintf(stderr, "FATAL: Could not find a suitable memory type\n");
-                vkDestroyImage(ctx.dev, rt->img, NULL);
+                vkDestroyImage(ctx.dev, rt->img[i], NULL);
                 return 1;
         }
 
         allocinfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
         allocinfo.allocationSize = memreq.size;
         allocinfo.memoryTypeIndex = memidx;
-        if (vkAllocateMemory(ctx.dev, &allocinfo, NULL, &rt->mem) != VK_SUCCESS) {
+        if (vkAllocateMemory(ctx.dev, &allocinfo, NULL, &rt->mem[i]) != VK_SUCCESS) {
                 fprintf(stderr, "FATAL: vkAllocateMemory()\n");
-                vkDestroyImage(ctx.dev, rt->img, NULL);
+                vkDestroyImage(ctx.dev, rt->img[i], NULL);
                 return 1;
         }
-        vkBindImageMemory(ctx.dev, rt->img, rt->mem, 0);
+        vkBindImageMemory(ctx.dev, rt->img[i], rt->mem[i], 0);
 
         /* Create the image view */
         viewinfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
-        viewinfo.image = rt->img;
+        viewinfo.image = rt->img[i];
         viewinfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
-        viewinfo.format = VK_FORMAT_B8G8R8A8_UNORM;
+        viewinfo.format = RTFMT;
         viewinfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
         viewinfo.subresourceRange.levelCount = 1;
         viewinfo.subresourceRange.layerCount = 1;
-        if (vkCreateImageView(ctx.dev, &viewinfo, NULL, &rt->view) != VK_SUCCESS) {
-                fprintf(stderr, "FATAL: vkAllocateMemory()\n");
-                vkFreeMemory(ctx.dev, rt->mem, NULL);
-                vkDestroyImage(ctx.dev, rt->img, NULL);
+        if (vkCreateImageView(ctx.dev, &viewinfo, NULL, &rt->view[i]) != VK_SUCCESS) {
+                fprintf(stderr, "FATAL: vkCreateImageView()\n");
+                vkFreeMemory(ctx.dev, rt->mem[i], NULL);
+                vkDestroyImage(ctx.dev, rt->img[i], NULL);
                 return 1;
         }
 
-        /* Create the framebuffer */
+        return 0;
+}
+
+int
+initrt(VKRT *rt)
+{
+        uint32_t w = ctx.swapchain.w;
+        uint32_t h = ctx.swapchain.h;
+        int i;
+
+        for (i = 0; i < 2; i++) {
+                if (initrtimg(rt, i, w, h))
+                        return 1;
+        }
+
+        /* Create the framebuffer, both frames are written in the same pass */
         VkFramebufferCreateInfo fbinfo = {0};
         fbinfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
         fbinfo.renderPass = ctx.pass;
-        fbinfo.attachmentCount = 1;
-        fbinfo.pAttachments = &rt->view;
+        fbinfo.attachmentCount = 2;
+        fbinfo.pAttachments = rt->view;
         fbinfo.width = w;
         fbinfo.height = h;
         fbinfo.layers = 1;
         if (vkCreateFramebuffer(ctx.dev, &fbinfo, NULL, &rt->fb) != VK_SUCCESS) {
                 fprintf(stderr, "FATAL: vkCreateFramebuffer()\n");
-                vkDestroyImageView(ctx.dev, rt->view, NULL);
-                vkFreeMemory(ctx.dev, rt->mem, NULL);
-                vkDestroyImage(ctx.dev, rt->img, NULL);
                 return 1;
         }
 
         /* Perform the initial clear and layout transition */
-        /* TODO: Is the clear really necessary? */
         vkResetCommandPool(ctx.dev, ctx.cmdpool, 0);
         VkCommandBufferBeginInfo begininfo = {0};
         begininfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
@@ -432,13 +795,16 @@ initrt(VKRT *rt)
         range.levelCount = 1;
         range.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
 
-        imgbarrier(rt->img, 0, VK_ACCESS_TRANSFER_WRITE_BIT,
-                        VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-                        VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT);
-        vkCmdClearColorImage(ctx.cmdbuf, rt->img, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, &color, 1, &range);
-        imgbarrier(rt->img, VK_ACCESS_TRANSFER_WRITE_BIT, 0,
-                   VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
-                   VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT);
+        for (i = 0; i < 2; i++) {
+                imgbarrier(rt->img[i], 0, VK_ACCESS_TRANSFER_WRITE_BIT,
+                           VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                           VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT);
+                vkCmdClearColorImage(ctx.cmdbuf, rt->img[i], VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                                     &color, 1, &range);
+                imgbarrier(rt->img[i], VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT,
+                           VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+                           VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT);
+        }
 
         vkEndCommandBuffer(ctx.cmdbuf);
         VkSubmitInfo info = {0};
@@ -448,16 +814,23 @@ initrt(VKRT *rt)
         vkQueueSubmit(ctx.gfxq, 1, &info, VK_NULL_HANDLE);
         vkQueueWaitIdle(ctx.gfxq);
 
+        /* Nothing blinks on a cleared target */
+        ctx.blinkrect = makerect(0, 0, 0, 0);
+
         return 0;
 }
 
 void
 freert(VKRT *rt)
 {
-        vkFreeMemory(ctx.dev, rt->mem, NULL);
+        int i;
+
         vkDestroyFramebuffer(ctx.dev, rt->fb, NULL);
-        vkDestroyImageView(ctx.dev, rt->view, NULL);
-        vkDestroyImage(ctx.dev, rt->img, NULL);
+        for (i = 0; i < 2; i++) {
+                vkDestroyImageView(ctx.dev, rt->view[i], NULL);
+                vkFreeMemory(ctx.dev, rt->mem[i], NULL);
+                vkDestroyImage(ctx.dev, rt->img[i], NULL);
+        }
 }
 
 int
@@ -508,15 +881,17 @@ initpipe(VKPIPE *pipe)
         ms.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
         ms.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
 
-        VkPipelineColorBlendAttachmentState blendatt = {0};
-        blendatt.colorWriteMask = VK_COLOR_COMPONENT_R_BIT|VK_COLOR_COMPONENT_G_BIT|
+        /* One per frame of the render target */
+        VkPipelineColorBlendAttachmentState blendatt[2] = {0};
+        blendatt[0].colorWriteMask = VK_COLOR_COMPONENT_R_BIT|VK_COLOR_COMPONENT_G_BIT|
                 VK_COLOR_COMPONENT_B_BIT|VK_COLOR_COMPONENT_A_BIT;
-        blendatt.blendEnable = VK_FALSE;
+        blendatt[0].blendEnable = VK_FALSE;
+        blendatt[1] = blendatt[0];
 
         VkPipelineColorBlendStateCreateInfo blend = {0};
         blend.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
-        blend.attachmentCount = 1;
-        blend.pAttachments = &blendatt;
+        blend.attachmentCount = 2;
+        blend.pAttachments = blendatt;
 
         VkPipelineViewportStateCreateInfo viewport = {0};
         viewport.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
@@ -607,50 +982,475 @@ freepipe(VKPIPE *pipe)
         vkDestroyPipeline(ctx.dev, pipe->handle, NULL);
 }
 
+/*
+ * The overlay pass composes the render target into the swapchain image,
+ * picking the blink phase and drawing the cursor on the way.
+ */
 int
-initbuf(VKBUF *buf, VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags flags)
+initoverlay(VKPIPE *pipe)
 {
-        VkBufferCreateInfo info = {0};
-        VkMemoryAllocateInfo allocinfo = {0};
-        VkMemoryRequirements memreq;
-        uint32_t memidx;
+        VkShaderModule vs, fs;
 
-        info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-        info.size = size;
-        info.usage = usage;
-        info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-        if(vkCreateBuffer(ctx.dev, &info, NULL, &buf->handle) != VK_SUCCESS) {
-                fprintf(stderr, "FATAL: vkCreateBuffer()\n");
+        VkShaderModuleCreateInfo shaderinfo = {0};
+        shaderinfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+        shaderinfo.codeSize = (size_t)ovssrc_size;
+        shaderinfo.pCode = (const void *)ovssrc;
+        if (vkCreateShaderModule(ctx.dev, &shaderinfo, NULL, &vs) != VK_SUCCESS) {
+                fprintf(stderr, "FATAL: vkCreateShaderModule()\n");
+                return 1;
+        }
+        shaderinfo.codeSize = (size_t)ofssrc_size;
+        shaderinfo.pCode = (const void *)ofssrc;
+        if (vkCreateShaderModule(ctx.dev, &shaderinfo, NULL, &fs) != VK_SUCCESS) {
+                fprintf(stderr, "FATAL: vkCreateShaderModule()\n");
+                vkDestroyShaderModule(ctx.dev, vs, NULL);
                 return 1;
         }
 
-        vkGetBufferMemoryRequirements(ctx.dev, buf->handle, &memreq);
-        memidx = getmemidx(memreq.memoryTypeBits, flags);
-        if (memidx == UINT32_MAX) {
-                fprintf(stderr, "FATAL: Could not find a suitable memory type\n");
-                vkDestroyBuffer(ctx.dev, buf->handle, NULL);
+        VkPipelineShaderStageCreateInfo stages[2] = {0};
+        stages[0].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+        stages[0].stage = VK_SHADER_STAGE_VERTEX_BIT;
+        stages[0].module = vs;
+        stages[0].pName = "main";
+        stages[1].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+        stages[1].stage = VK_SHADER_STAGE_FRAGMENT_BIT;
+        stages[1].module = fs;
+        stages[1].pName = "main";
+
+        VkPipelineVertexInputStateCreateInfo inputstate = {0};
+        inputstate.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+
+        VkPipelineInputAssemblyStateCreateInfo inputassy = {0};
+        inputassy.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
+        inputassy.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+
+        VkPipelineRasterizationStateCreateInfo rasterizer = {0};
+        rasterizer.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
+        rasterizer.polygonMode = VK_POLYGON_MODE_FILL;
+        rasterizer.lineWidth = 1.0f;
+        rasterizer.cullMode = VK_CULL_MODE_NONE;
+
+        VkPipelineMultisampleStateCreateInfo ms = {0};
+        ms.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
+        ms.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+
+        VkPipelineColorBlendAttachmentState blendatt = {0};
+        blendatt.colorWriteMask = VK_COLOR_COMPONENT_R_BIT|VK_COLOR_COMPONENT_G_BIT|
+                VK_COLOR_COMPONENT_B_BIT|VK_COLOR_COMPONENT_A_BIT;
+        blendatt.blendEnable = VK_FALSE;
+
+        VkPipelineColorBlendStateCreateInfo blend = {0};
+        blend.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
+        blend.attachmentCount = 1;
+        blend.pAttachments = &blendatt;
+
+        VkPipelineViewportStateCreateInfo viewport = {0};
+        viewport.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
+        viewport.viewportCount = 1;
+        viewport.scissorCount = 1;
+
+        VkDynamicState ds[] = { VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR };
+        VkPipelineDynamicStateCreateInfo dynstate = {0};
+        dynstate.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+        dynstate.dynamicStateCount = 2;
+        dynstate.pDynamicStates = ds;
+
+        /* Descriptor set layout: blink-on frame, blink-off frame, atlas */
+        VkPushConstantRange range = {0};
+        range.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+        range.size = sizeof(VKOPC);
+
+        VkDescriptorSetLayoutBinding bindings[3] = {0};
+        for (uint32_t i = 0; i < 3; i++) {
+                bindings[i].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+                bindings[i].binding = i;
+                bindings[i].descriptorCount = 1;
+                bindings[i].stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+        }
+
+        VkDescriptorSetLayoutCreateInfo descinfo = {0};
+        descinfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+        descinfo.bindingCount = 3;
+        descinfo.pBindings = bindings;
+        if (vkCreateDescriptorSetLayout(ctx.dev, &descinfo, NULL, &pipe->desc) != VK_SUCCESS) {
+                fprintf(stderr, "FATAL: vkCreateDescriptorSetLayout()\n");
+                vkDestroyShaderModule(ctx.dev, vs, NULL);
+                vkDestroyShaderModule(ctx.dev, fs, NULL);
                 return 1;
         }
 
-        allocinfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-        allocinfo.allocationSize = memreq.size;
-        allocinfo.memoryTypeIndex = memidx;
-        if (vkAllocateMemory(ctx.dev, &allocinfo, NULL, &buf->mem) != VK_SUCCESS) {
-                fprintf(stderr, "FATAL: vkAllocateMemory()\n");
-                vkDestroyBuffer(ctx.dev, buf->handle, NULL);
+        /* Pipeline layout */
+        VkPipelineLayoutCreateInfo layoutinfo = {0};
+        layoutinfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+        layoutinfo.pushConstantRangeCount = 1;
+        layoutinfo.pPushConstantRanges = &range;
+        layoutinfo.setLayoutCount = 1;
+        layoutinfo.pSetLayouts = &pipe->desc;
+        if (vkCreatePipelineLayout(ctx.dev, &layoutinfo, NULL, &pipe->layout) != VK_SUCCESS) {
+                fprintf(stderr, "FATAL: vkCreatePipelineLayout()\n");
+                vkDestroyDescriptorSetLayout(ctx.dev, pipe->desc, NULL);
+                vkDestroyShaderModule(ctx.dev, vs, NULL);
+                vkDestroyShaderModule(ctx.dev, fs, NULL);
+                return 1;
+        }
+
+        /* Graphics pipeline */
+        VkGraphicsPipelineCreateInfo gfxinfo = {0};
+        gfxinfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+        gfxinfo.stageCount = 2;
+        gfxinfo.pStages = stages;
+        gfxinfo.pVertexInputState = &inputstate;
+        gfxinfo.pInputAssemblyState = &inputassy;
+        gfxinfo.pRasterizationState = &rasterizer;
+        gfxinfo.pMultisampleState = &ms;
+        gfxinfo.pColorBlendState = &blend;
+        gfxinfo.pViewportState = &viewport;
+        gfxinfo.pDynamicState = &dynstate;
+        gfxinfo.layout = pipe->layout;
+        gfxinfo.renderPass = ctx.overpass;
+        if (vkCreateGraphicsPipelines(ctx.dev, VK_NULL_HANDLE, 1, &gfxinfo, NULL, &pipe->handle) != VK_SUCCESS) {
+                fprintf(stderr, "FATAL: vkCreateGraphicsPipelines()\n");
+                vkDestroyDescriptorSetLayout(ctx.dev, pipe->desc, NULL);
+                vkDestroyPipelineLayout(ctx.dev, pipe->layout, NULL);
+                vkDestroyShaderModule(ctx.dev, vs, NULL);
+                vkDestroyShaderModule(ctx.dev, fs, NULL);
                 return 1;
         }
-        vkBindBufferMemory(ctx.dev, buf->handle, buf->mem, 0);
-        buf->size = memreq.size;
+
+        vkDestroyShaderModule(ctx.dev, vs, NULL);
+        vkDestroyShaderModule(ctx.dev, fs, NULL);
 
         return 0;
 }
 
+/* Points the overlay descriptors at the (re)created render target */
 void
-freebuf(VKBUF *buf)
+updateoverlay(void)
 {
-        vkFreeMemory(ctx.dev, buf->mem, NULL);
-        vkDestroyBuffer(ctx.dev, buf->handle, NULL);
+        VkDescriptorImageInfo imginfo[3] = {0};
+        VkWriteDescriptorSet writes[3] = {0};
+        uint32_t i;
+
+        for (i = 0; i < 2; i++) {
+                imginfo[i].imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+                imginfo[i].imageView = ctx.rt.view[i];
+                imginfo[i].sampler = ctx.rtsampler;
+        }
+        imginfo[2].imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+        imginfo[2].imageView = fontimg.view;
+        imginfo[2].sampler = fontimg.sampler;
+
+        for (i = 0; i < 3; i++) {
+                writes[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+                writes[i].dstSet = ctx.overset;
+                writes[i].dstBinding = i;
+                writes[i].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+                writes[i].descriptorCount = 1;
+                writes[i].pImageInfo = &imginfo[i];
+        }
+        vkUpdateDescriptorSets(ctx.dev, 3, writes, 0, NULL);
+}
+
+/*
+ * The grid pipeline draws the quads with a compute shader instead, writing
+ * each pixel of a tile once regardless of how many quads overlap it.
+ */
+int
+initgrid(VKPIPE *pipe)
+{
+        VkShaderModule cs;
+
+        VkShaderModuleCreateInfo shaderinfo = {0};
+        shaderinfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+        shaderinfo.codeSize = (size_t)gcssrc_size;
+        shaderinfo.pCode = (const void *)gcssrc;
+        if (vkCreateShaderModule(ctx.dev, &shaderinfo, NULL, &cs) != VK_SUCCESS) {
+                fprintf(stderr, "FATAL: vkCreateShaderModule()\n");
+                return 1;
+        }
+
+        /* Descriptor set layout: quads and bins, atlas, blink-on and blink-off frames */
+        VkPushConstantRange range = {0};
+        range.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+        range.size = 5 * sizeof(uint32_t);
+
+        VkDescriptorSetLayoutBinding bindings[4] = {0};
+        for (uint32_t i = 0; i < 4; i++) {
+                bindings[i].binding = i;
+                bindings[i].descriptorCount = 1;
+                bindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+        }
+        bindings[0].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        bindings[1].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+        bindings[2].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+        bindings[3].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+
+        VkDescriptorSetLayoutCreateInfo descinfo = {0};
+        descinfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+        descinfo.bindingCount = 4;
+        descinfo.pBindings = bindings;
+        if (vkCreateDescriptorSetLayout(ctx.dev, &descinfo, NULL, &pipe->desc) != VK_SUCCESS) {
+                fprintf(stderr, "FATAL: vkCreateDescriptorSetLayout()\n");
+                vkDestroyShaderModule(ctx.dev, cs, NULL);
+                return 1;
+        }
+
+        /* Pipeline layout */
+        VkPipelineLayoutCreateInfo layoutinfo = {0};
+        layoutinfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+        layoutinfo.pushConstantRangeCount = 1;
+        layoutinfo.pPushConstantRanges = &range;
+        layoutinfo.setLayoutCount = 1;
+        layoutinfo.pSetLayouts = &pipe->desc;
+        if (vkCreatePipelineLayout(ctx.dev, &layoutinfo, NULL, &pipe->layout) != VK_SUCCESS) {
+                fprintf(stderr, "FATAL: vkCreatePipelineLayout()\n");
+                vkDestroyDescriptorSetLayout(ctx.dev, pipe->desc, NULL);
+                vkDestroyShaderModule(ctx.dev, cs, NULL);
+                return 1;
+        }
+
+        /* Compute pipeline */
+        VkComputePipelineCreateInfo info = {0};
+        info.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+        info.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+        info.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+        info.stage.module = cs;
+        info.stage.pName = "main";
+        info.layout = pipe->layout;
+        if (vkCreateComputePipelines(ctx.dev, VK_NULL_HANDLE, 1, &info, NULL, &pipe->handle) != VK_SUCCESS) {
+                fprintf(stderr, "FATAL: vkCreateComputePipelines()\n");
+                vkDestroyDescriptorSetLayout(ctx.dev, pipe->desc, NULL);
+                vkDestroyPipelineLayout(ctx.dev, pipe->layout, NULL);
+                vkDestroyShaderModule(ctx.dev, cs, NULL);
+                return 1;
+        }
+
+        vkDestroyShaderModule(ctx.dev, cs, NULL);
+
+        return 0;
+}
+
+/* Points the grid descriptors at the (re)created render target */
+void
+updategrid(void)
+{
+        VkDescriptorBufferInfo bufinfo = {0};
+        VkDescriptorImageInfo imginfo[3] = {0};
+        VkWriteDescriptorSet writes[4] = {0};
+        uint32_t i;
+
+        bufinfo.buffer = ssbuf.handle;
+        bufinfo.range = VK_WHOLE_SIZE;
+        imginfo[0].imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+        imginfo[0].imageView = fontimg.view;
+        imginfo[0].sampler = fontimg.sampler;
+        for (i = 0; i < 2; i++) {
+                imginfo[i+1].imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+                imginfo[i+1].imageView = ctx.rt.view[i];
+        }
+
+        for (i = 0; i < 4; i++) {
+                writes[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+                writes[i].dstSet = ctx.gridset;
+                writes[i].dstBinding = i;
+                writes[i].descriptorCount = 1;
+                writes[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+                if (i)
+                        writes[i].pImageInfo = &imginfo[i-1];
+        }
+        writes[0].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        writes[0].pBufferInfo = &bufinfo;
+        writes[1].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+        vkUpdateDescriptorSets(ctx.dev, 4, writes, 0, NULL);
+}
+
+/* The raster pipeline turns glyph outlines into coverage, see outlineatlas() */
+int
+initraster(VKPIPE *pipe)
+{
+        VkShaderModule cs;
+
+        VkShaderModuleCreateInfo shaderinfo = {0};
+        shaderinfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+        shaderinfo.codeSize = (size_t)rcssrc_size;
+        shaderinfo.pCode = (const void *)rcssrc;
+        if (vkCreateShaderModule(ctx.dev, &shaderinfo, NULL, &cs) != VK_SUCCESS) {
+                fprintf(stderr, "FATAL: vkCreateShaderModule()\n");
+                return 1;
+        }
+
+        /* Descriptor set layout: jobs, segments and coverage in one buffer */
+        VkPushConstantRange range = {0};
+        range.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+        range.size = 2 * sizeof(uint32_t);
+
+        VkDescriptorSetLayoutBinding binding = {0};
+        binding.binding = 0;
+        binding.descriptorCount = 1;
+        binding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        binding.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+
+        VkDescriptorSetLayoutCreateInfo descinfo = {0};
+        descinfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+        descinfo.bindingCount = 1;
+        descinfo.pBindings = &binding;
+        if (vkCreateDescriptorSetLayout(ctx.dev, &descinfo, NULL, &pipe->desc) != VK_SUCCESS) {
+                fprintf(stderr, "FATAL: vkCreateDescriptorSetLayout()\n");
+                vkDestroyShaderModule(ctx.dev, cs, NULL);
+                return 1;
+        }
+
+        /* Pipeline layout */
+        VkPipelineLayoutCreateInfo layoutinfo = {0};
+        layoutinfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+        layoutinfo.pushConstantRangeCount = 1;
+        layoutinfo.pPushConstantRanges = &range;
+        layoutinfo.setLayoutCount = 1;
+        layoutinfo.pSetLayouts = &pipe->desc;
+        if (vkCreatePipelineLayout(ctx.dev, &layoutinfo, NULL, &pipe->layout) != VK_SUCCESS) {
+                fprintf(stderr, "FATAL: vkCreatePipelineLayout()\n");
+                vkDestroyDescriptorSetLayout(ctx.dev, pipe->desc, NULL);
+                vkDestroyShaderModule(ctx.dev, cs, NULL);
+                return 1;
+        }
+
+        /* Compute pipeline */
+        VkComputePipelineCreateInfo info = {0};
+        info.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+        info.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+        info.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+        info.stage.module = cs;
+        info.stage.pName = "main";
+        info.layout = pipe->layout;
+        if (vkCreateComputePipelines(ctx.dev, VK_NULL_HANDLE, 1, &info, NULL, &pipe->handle) != VK_SUCCESS) {
+                fprintf(stderr, "FATAL: vkCreateComputePipelines()\n");
+                vkDestroyDescriptorSetLayout(ctx.dev, pipe->desc, NULL);
+                vkDestroyPipelineLayout(ctx.dev, pipe->layout, NULL);
+                vkDestroyShaderModule(ctx.dev, cs, NULL);
+                return 1;
+        }
+
+        vkDestroyShaderModule(ctx.dev, cs, NULL);
+
+        return 0;
+}
+
+/*
+ * Bins the quads into TILESIZ squares for the grid shader. grid.words gets
+ * the touched tiles (x | y << 16, first, count), followed by the quad
+ * indices of each tile in submission order. Returns the number of tiles.
+ */
+uint32_t
+bingrid(const VKQUAD *q, uint32_t n, uint32_t w, uint32_t h)
+{
+        uint32_t ntx = (w + TILESIZ - 1) / TILESIZ;
+        uint32_t nty = (h + TILESIZ - 1) / TILESIZ;
+        uint32_t i, tx, ty, tx0, tx1, ty0, ty1, t, ntile = 0, nidx = 0;
+        uint32_t *idx;
+
+        if (grid.nbin < ntx*nty) {
+                grid.nbin = ntx*nty;
+                grid.bin = xrealloc(grid.bin, grid.nbin * sizeof *grid.bin);
+        }
+        memset(grid.bin, 0, ntx*nty * sizeof *grid.bin);
+
+#define TILERANGE(q)                                                    \
+        tx0 = (q)->x / TILESIZ;                                         \
+        ty0 = (q)->y / TILESIZ;                                         \
+        tx1 = MIN((uint32_t)((q)->x + (q)->uv.w - 1) / TILESIZ, ntx - 1); \
+        ty1 = MIN((uint32_t)((q)->y + (q)->uv.h - 1) / TILESIZ, nty - 1);
+
+        /* Count the quads of each tile */
+        for (i = 0; i < n; i++) {
+                if (q[i].x >= w || q[i].y >= h || !q[i].uv.w || !q[i].uv.h)
+                        continue;
+                TILERANGE(q + i);
+                for (ty = ty0; ty <= ty1; ty++) {
+                        for (tx = tx0; tx <= tx1; tx++) {
+                                t = ty*ntx + tx;
+                                ntile += grid.bin[t] == 0;
+                                grid.bin[t]++;
+                                nidx++;
+                        }
+                }
+        }
+
+        grid.sz = 3*ntile + nidx;
+        if (grid.cap < grid.sz) {
+                grid.cap = grid.sz;
+                grid.words = xrealloc(grid.words, grid.cap * sizeof *grid.words);
+        }
+
+        /* List the touched tiles, turn the counts into write positions */
+        for (t = 0, i = 0, nidx = 0; t < ntx*nty; t++) {
+                if (!grid.bin[t])
+                        continue;
+                grid.words[i++] = (t % ntx) | (t / ntx) << 16;
+                grid.words[i++] = nidx;
+                grid.words[i++] = grid.bin[t];
+                nidx += grid.bin[t];
+                grid.bin[t] = nidx - grid.bin[t];
+        }
+
+        idx = grid.words + 3*ntile;
+        for (i = 0; i < n; i++) {
+                if (q[i].x >= w || q[i].y >= h || !q[i].uv.w || !q[i].uv.h)
+                        continue;
+                TILERANGE(q + i);
+                for (ty = ty0; ty <= ty1; ty++) {
+                        for (tx = tx0; tx <= tx1; tx++)
+                                idx[grid.bin[ty*ntx + tx]++] = i;
+                }
+        }
+#undef TILERANGE
+
+        return ntile;
+}
+
+int
+initbuf(VKBUF *buf, VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags flags)
+{
+        VkBufferCreateInfo info = {0};
+        VkMemoryAllocateInfo allocinfo = {0};
+        VkMemoryRequirements memreq;
+        uint32_t memidx;
+
+        info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+        info.size = size;
+        info.usage = usage;
+        info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+        if(vkCreateBuffer(ctx.dev, &info, NULL, &buf->handle) != VK_SUCCESS) {
+                fprintf(stderr, "FATAL: vkCreateBuffer()\n");
+                return 1;
+        }
+
+        vkGetBufferMemoryRequirements(ctx.dev, buf->handle, &memreq);
+        memidx = getmemidx(memreq.memoryTypeBits, flags);
+        if (memidx == UINT32_MAX) {
+                fprintf(stderr, "FATAL: Could not find a suitable memory type\n");
+                vkDestroyBuffer(ctx.dev, buf->handle, NULL);
+                return 1;
+        }
+
+        allocinfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+        allocinfo.allocationSize = memreq.size;
+        allocinfo.memoryTypeIndex = memidx;
+        if (vkAllocateMemory(ctx.dev, &allocinfo, NULL, &buf->mem) != VK_SUCCESS) {
+                fprintf(stderr, "FATAL: vkAllocateMemory()\n");
+                vkDestroyBuffer(ctx.dev, buf->handle, NULL);
+                return 1;
+        }
+        vkBindBufferMemory(ctx.dev, buf->handle, buf->mem, 0);
+        buf->size = memreq.size;
+
+        return 0;
+}
+
+void
+freebuf(VKBUF *buf)
+{
+        vkFreeMemory(ctx.dev, buf->mem, NULL);
+        vkDestroyBuffer(ctx.dev, buf->handle, NULL);
 }
 
 int
@@ -777,46 +1577,402 @@ bufbarrier(VkBuffer buf, VkDeviceSize size,
                         0, NULL, 1, &barrier, 0, NULL);
 }
 
+/*
+ * Finds room for a w x h glyph in the atlas, 1 if it is full. Glyphs are
+ * packed on a skyline: each one goes where its top ends up lowest, on the
+ * narrowest run of the skyline on a tie, and raises the runs it covers.
+ */
 int
-blitatlas(uint16_t *x, uint16_t *y, uint16_t w, uint16_t h, uint16_t cw, uint16_t ch,
-                uint16_t ox, uint16_t oy, uint16_t pitch, const uint8_t *data)
+placeatlas(uint16_t *x, uint16_t *y, uint16_t w, uint16_t h)
 {
-        uint8_t *dst;
-        uint16_t i;
+        VKSKYLINE *s = fontatlas.sky;
+        uint32_t bw = w + ATLASPAD, bh = h + ATLASPAD;
+        uint32_t top, end, bottom = UINT32_MAX, runw = UINT32_MAX;
+        int i, j, at = -1;
+
+        /* Empty glyphs take no room */
+        if (!w || !h) {
+                *x = *y = 0;
+                return 0;
+        }
 
-        if (fontatlas.x + cw + ATLASPAD > ATLASSIZ) {
-                if (fontatlas.y + ch + ATLASPAD > ATLASSIZ) {
-                        /* Atlas is full. TODO: Resize? */
-                        return 1;
+        for (i = 0; i < fontatlas.nsky && s[i].x + bw <= ATLASSIZ; i++) {
+                top = 0;
+                for (j = i, end = s[i].x; end < s[i].x + bw; end += s[j++].w)
+                        top = MAX(top, s[j].y);
+                if (top + bh > ATLASSIZ)
+                        continue;
+                if (top + bh < bottom || (top + bh == bottom && s[i].w < runw)) {
+                        bottom = top + bh;
+                        runw = s[i].w;
+                        at = i;
                 }
+        }
+        if (at < 0) {
+                /* Atlas is full, see resetatlas() */
+                return 1;
+        }
 
-                fontatlas.x = ATLASPAD;
-                fontatlas.y += fontatlas.maxy + ATLASPAD;
-                fontatlas.maxy = 0;
+        *x = s[at].x;
+        *y = (uint16_t)(bottom - bh);
+
+        /* The new run, then the ones under it shrink or go */
+        memmove(s + at + 1, s + at, (fontatlas.nsky - at) * sizeof *s);
+        fontatlas.nsky++;
+        s[at].y = (uint16_t)bottom;
+        s[at].w = (uint16_t)bw;
+        end = s[at].x + bw;
+        for (i = at + 1; i < fontatlas.nsky && s[i].x < end; ) {
+                if (s[i].x + s[i].w <= end) {
+                        memmove(s + i, s + i + 1, (fontatlas.nsky - i - 1) * sizeof *s);
+                        fontatlas.nsky--;
+                        continue;
+                }
+                s[i].w -= end - s[i].x;
+                s[i].x = end;
+                break;
         }
 
-        if (ch > fontatlas.maxy)
-                fontatlas.maxy = ch;
+        /* Runs of the same height are one */
+        for (i = 1; i < fontatlas.nsky; ) {
+                if (s[i-1].y == s[i].y) {
+                        s[i-1].w += s[i].w;
+                        memmove(s + i, s + i + 1, (fontatlas.nsky - i - 1) * sizeof *s);
+                        fontatlas.nsky--;
+                } else {
+                        i++;
+                }
+        }
+
+        return 0;
+}
+
+int
+blitatlas(uint16_t *x, uint16_t *y, uint16_t w, uint16_t h,
+                uint16_t pitch, const uint8_t *data)
+{
+        VkBufferImageCopy *region;
+        uint8_t *dst;
+        uint16_t i;
 
-        *x = fontatlas.x;
-        *y = fontatlas.y;
+        if (placeatlas(x, y, w, h))
+                return 1;
 
-        dst = fontatlas.data + (fontatlas.y+oy)*ATLASSIZ + fontatlas.x+ox;
+        dst = fontatlas.data + *y*ATLASSIZ + *x;
         for (i = 0; i < h; i++) {
                 memcpy(dst, data, (size_t)w);
                 dst += ATLASSIZ;
                 data += pitch;
         }
 
-        fontatlas.x += cw + ATLASPAD;
-        fontatlas.dirty = 1;
+        /*
+         * Only the blitted glyphs are uploaded, the rest of the atlas may
+         * hold outlines the raster shader wrote.
+         */
+        if (fontatlas.dirty || !w || !h)
+                return 0;
+        if (pend.nblit == pend.blitcap) {
+                pend.blitcap = pend.blitcap ? pend.blitcap*2 : 64;
+                pend.blits = xrealloc(pend.blits, pend.blitcap * sizeof *pend.blits);
+        }
+        /* The buffer offset is given when vkflush() stages the blits */
+        region = pend.blits + pend.nblit++;
+        memset(region, 0, sizeof *region);
+        region->imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        region->imageSubresource.layerCount = 1;
+        region->imageOffset.x = *x;
+        region->imageOffset.y = *y;
+        region->imageExtent.width = w;
+        region->imageExtent.height = h;
+        region->imageExtent.depth = 1;
+
+        return 0;
+}
+
+/* Whether outlineatlas() can take glyphs */
+int
+vkoutlines(void)
+{
+        return !ctx.sw && !prep.running && ctx.raster.handle != VK_NULL_HANDLE;
+}
+
+/*
+ * Like blitatlas(), but the w x h glyph is given as nseg line segments
+ * (x0, y0, x1, y1 in pixels from its top left, y down) and rasterized by
+ * the raster shader on the next flush. It never reaches fontatlas.data.
+ * Returns 1 if the atlas is full, -1 if the glyph has to be blitted
+ * instead because there is no raster shader or this frame has too many.
+ */
+int
+outlineatlas(uint16_t *x, uint16_t *y, uint16_t w, uint16_t h,
+                const float *seg, uint32_t nseg)
+{
+        VkBufferImageCopy *region;
+        uint32_t *job;
+        uint32_t words = (w+3)/4 * h;
+
+        if (!vkoutlines())
+                return -1;
+        if ((pend.njob+1) * 4*sizeof(uint32_t) + (pend.nseg+nseg) * 4*sizeof(float) > RSINSIZ ||
+            (pend.out+words) * sizeof(uint32_t) > RSBUFSIZ - RSINSIZ)
+                return -1;
+
+        if (placeatlas(x, y, w, h))
+                return 1;
+        if (!w || !h || !nseg)
+                return 0;
+
+        if (pend.njob == pend.jobcap) {
+                pend.jobcap = pend.jobcap ? pend.jobcap*2 : 64;
+                pend.jobs = xrealloc(pend.jobs, pend.jobcap * 4*sizeof *pend.jobs);
+                pend.copies = xrealloc(pend.copies, pend.jobcap * sizeof *pend.copies);
+        }
+        if (pend.nseg + nseg > pend.segcap) {
+                pend.segcap = MAX(pend.segcap*2, pend.nseg + nseg);
+                pend.segs = xrealloc(pend.segs, pend.segcap * 4*sizeof *pend.segs);
+        }
+
+        job = pend.jobs + 4*pend.njob;
+        job[0] = pend.out;
+        job[1] = w | (uint32_t)h << 16;
+        job[2] = pend.nseg;
+        job[3] = nseg;
+        memcpy(pend.segs + 4*pend.nseg, seg, nseg * 4*sizeof *seg);
+
+        region = pend.copies + pend.njob;
+        memset(region, 0, sizeof *region);
+        region->bufferOffset = RSINSIZ + pend.out*sizeof(uint32_t);
+        region->bufferRowLength = (w+3) & ~3u;
+        region->imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        region->imageSubresource.layerCount = 1;
+        region->imageOffset.x = *x;
+        region->imageOffset.y = *y;
+        region->imageExtent.width = w;
+        region->imageExtent.height = h;
+        region->imageExtent.depth = 1;
+
+        pend.njob++;
+        pend.nseg += nseg;
+        pend.out += words;
 
         return 0;
 }
 
+/* Drops every glyph, the caller forgets the positions handed out so far */
+void
+resetatlas(void)
+{
+        memset(fontatlas.data, 0, sizeof fontatlas.data);
+        fontatlas.sky[0] = (VKSKYLINE){ ATLASPAD, ATLASPAD, ATLASSIZ - ATLASPAD };
+        fontatlas.nsky = 1;
+        fontatlas.dirty = 1;
+        pend.nblit = pend.njob = pend.nseg = pend.out = 0;
+}
+
+/*
+ * The atlas holds distance fields of SDFSPREAD, drawn scale times their
+ * size, or plain coverage drawn 1:1 with scale 0.
+ */
+void
+vkatlasscale(float scale)
+{
+        atlasscale = scale;
+        swatlasscale(scale);
+}
+
+int
+hasinstext(const char *name)
+{
+        uint32_t count, i;
+        VkExtensionProperties *props;
+        int found = 0;
+
+        vkEnumerateInstanceExtensionProperties(NULL, &count, NULL);
+        makearr(props, count);
+        vkEnumerateInstanceExtensionProperties(NULL, &count, props);
+        for (i = 0; i < count && !found; i++)
+                found = !strcmp(props[i].extensionName, name);
+        free(props);
+
+        return found;
+}
+
+int
+hasdevext(const char *name)
+{
+        uint32_t count, i;
+        VkExtensionProperties *props;
+        int found = 0;
+
+        vkEnumerateDeviceExtensionProperties(ctx.pdev, NULL, &count, NULL);
+        makearr(props, count);
+        vkEnumerateDeviceExtensionProperties(ctx.pdev, NULL, &count, props);
+        for (i = 0; i < count && !found; i++)
+                found = !strcmp(props[i].extensionName, name);
+        free(props);
+
+        return found;
+}
+
+/*
+ * Waits for the queued presents one by one and reports the time at which
+ * each of them became visible. Runs on its own thread, since
+ * vkWaitForPresentKHR blocks until the next vblank or longer.
+ */
+void *
+presentwaiter(void *arg)
+{
+        uint64_t id;
+        VkResult ret;
+        struct timespec ts;
+
+        pthread_mutex_lock(&pres.lock);
+        for (;;) {
+                while (!pres.quit && (pres.paused || pres.done == pres.id))
+                        pthread_cond_wait(&pres.cond, &pres.lock);
+                if (pres.quit)
+                        break;
+
+                id = pres.done + 1;
+                pres.busy = 1;
+                pthread_mutex_unlock(&pres.lock);
+
+                ret = vkWaitForPresentKHR(ctx.dev, ctx.swapchain.handle, id, PRESENTTIMEOUT);
+                clock_gettime(CLOCK_MONOTONIC, &ts);
+
+                pthread_mutex_lock(&pres.lock);
+                pres.busy = 0;
+                /* Frames which time out (e.g. unmapped window) are dropped */
+                if (pres.done < id)
+                        pres.done = id;
+                if (ret == VK_SUCCESS && pres.cb)
+                        pres.cb(id, &ts);
+                pthread_cond_broadcast(&pres.cond);
+        }
+        pthread_mutex_unlock(&pres.lock);
+
+        return NULL;
+}
+
+/*
+ * The swapchain must not be destroyed while the waiter is blocked on it.
+ * Pausing also drops the frames that are still pending.
+ */
+void
+pausepresent(int pause)
+{
+        if (!pres.running)
+                return;
+
+        pthread_mutex_lock(&pres.lock);
+        pres.paused = pause;
+        while (pause && pres.busy)
+                pthread_cond_wait(&pres.cond, &pres.lock);
+        pres.done = pres.id;
+        pthread_cond_broadcast(&pres.cond);
+        pthread_mutex_unlock(&pres.lock);
+}
+
+void
+readback(void)
+{
+        VKSC *sc = &ctx.swapchain;
+        VKFrame f;
+        uint64_t ts[2];
+        void *p;
+
+        f.gpums = -1;
+        if (ctx.query && vkGetQueryPoolResults(ctx.dev, ctx.query, 0, 2, sizeof ts, ts, sizeof *ts,
+                                VK_QUERY_RESULT_64_BIT) == VK_SUCCESS)
+                f.gpums = (double)(ts[1] - ts[0]) * ctx.tsperiod / 1E6;
+
+        vkMapMemory(ctx.dev, rbbuf.mem, 0, VK_WHOLE_SIZE, 0, &p);
+        f.data = p;
+        f.w = sc->w;
+        f.h = sc->h;
+        f.stride = sc->w * 4;
+        framecb(&f);
+        vkUnmapMemory(ctx.dev, rbbuf.mem);
+}
+
+void
+vkframecb(void (*cb)(const VKFrame *))
+{
+        framecb = cb;
+}
+
+/*
+ * queued gets the id of every present before it is queued, presented the
+ * ids which became visible. Both are called with the present lock held.
+ */
+void
+vkpresentcb(void (*queued)(uint64_t), void (*presented)(uint64_t, const struct timespec *))
+{
+        pres.queuedcb = queued;
+        pres.cb = presented;
+}
+
+/* Selects the grid shader over instanced quads, may change at any time */
+void
+vkgrid(int on)
+{
+        ctx.usegrid = on;
+}
+
+void
+vksoftware(int on)
+{
+        ctx.sw = on;
+}
+
+/*
+ * Without a display (dpy == NULL) no surface or swapchain is created, the
+ * frames are composed into an offscreen image instead, see vkframecb().
+ * Without a usable vulkan device the software renderer in sw.c takes over.
+ */
+/*
+ * Starts creating the device and the pipelines on a thread while the
+ * fonts load and the window is made, vkinit() waits for it. Without the
+ * thread vkinit() does it all.
+ */
+void
+vkprepare(Display *dpy)
+{
+        if (ctx.sw || prep.running || prep.done)
+                return;
+
+        prep.dpy = dpy;
+        if (!pthread_create(&prep.thread, NULL, preparedevice, NULL))
+                prep.running = 1;
+}
+
 int
 vkinit(Display *dpy, Window win, int w, int h)
 {
+        if (!ctx.sw) {
+                if (!initvk(dpy, win, w, h))
+                        return 0;
+                if (!dpy)
+                        return 1;
+                fputs("warning: vulkan unavailable, falling back to the software renderer\n", stderr);
+                freevk();
+                ctx.sw = 1;
+        }
+
+        return swinit(dpy, win, w, h);
+}
+
+/*
+ * Creates everything that needs no window: the device, the render pass of
+ * the render target, the pipelines other than the overlay and the atlas
+ * and buffers. Runs on its own thread from vkprepare().
+ */
+int
+initdevice(Display *dpy)
+{
+        uint32_t tsbits = 0;
+
+        ctx.headless = dpy == NULL;
         ctx.lib = dlopen("libvulkan.so.1", RTLD_NOW);
         if (!ctx.lib) {
                 perror("dlopen");
@@ -834,35 +1990,35 @@ vkinit(Display *dpy, Window win, int w, int h)
                 appinfo.pApplicationName = APPNAME;
                 appinfo.applicationVersion = APPVER;
                 appinfo.apiVersion = APIVER;
+                /* VK_KHR_present_id depends on get_physical_device_properties2 */
+                const char *exts[LEN(instext) + 1];
+                uint32_t next = ctx.headless ? 0 : LEN(instext);
+                memcpy(exts, instext, sizeof instext);
+                if (pres.cb && hasinstext(VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME))
+                        exts[next++] = VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME;
+
                 VkInstanceCreateInfo info = {0};
                 info.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
                 info.pApplicationInfo = &appinfo;
-                info.enabledExtensionCount = LEN(instext);
-                info.ppEnabledExtensionNames = instext;
+                info.enabledExtensionCount = next;
+                info.ppEnabledExtensionNames = exts;
 #ifdef DEBUG
                 const char *layers[] = { "VK_LAYER_KHRONOS_validation" };
                 info.enabledLayerCount = 1;
                 info.ppEnabledLayerNames = layers;
 #endif
                 if (vkCreateInstance(&info, NULL, &ctx.instance) != VK_SUCCESS) {
+                        ctx.instance = VK_NULL_HANDLE;
                         fprintf(stderr, "FATAL: vkCreateInstance()\n");
                         return 1;
                 }
         }
 
-        if (load_instance_vk_funcs())
+        if (load_instance_vk_funcs()) {
+                /* Loaded last, for freevk() */
+                vkDestroyInstance = (PFN_vkDestroyInstance)vkGetInstanceProcAddr(ctx.instance,
+                                                                                "vkDestroyInstance");
                 return 1;
-
-        /* Create the surface, WSI */
-        {
-                VkXlibSurfaceCreateInfoKHR info = {0};
-                info.sType = VK_STRUCTURE_TYPE_XLIB_SURFACE_CREATE_INFO_KHR;
-                info.dpy = dpy;
-                info.window = win;
-                if (vkCreateXlibSurfaceKHR(ctx.instance, &info, NULL, &ctx.surface) != VK_SUCCESS) {
-                        fprintf(stderr, "FATAL: vkCreateXlibSurfaceKHR()\n");
-                        return 1;
-                }
         }
 
         /* Choose a physical device */
@@ -884,20 +2040,26 @@ vkinit(Display *dpy, Window win, int w, int h)
         {
                 uint32_t count;
                 VkQueueFamilyProperties *props;
-                VkBool32 ret;
 
                 vkGetPhysicalDeviceQueueFamilyProperties(ctx.pdev, &count, NULL);
                 makearr(props, count);
                 vkGetPhysicalDeviceQueueFamilyProperties(ctx.pdev, &count, props);
                 for (uint32_t i = 0; i < count; i++) {
-                        if (props[i].queueFlags & VK_QUEUE_GRAPHICS_BIT)
+                        if (props[i].queueFlags & VK_QUEUE_GRAPHICS_BIT) {
                                 ctx.qidx[0] = i;
-
-                        vkGetPhysicalDeviceSurfaceSupportKHR(ctx.pdev, i, ctx.surface, &ret);
-                        if (ret)
+                                tsbits = props[i].timestampValidBits;
+                        }
+
+                        /* There is no window yet, the visual tells */
+                        if (ctx.headless)
+                                continue;
+                        if (vkGetPhysicalDeviceXlibPresentationSupportKHR(ctx.pdev, i, dpy,
+                                        XVisualIDFromVisual(DefaultVisual(dpy, DefaultScreen(dpy)))))
                                 ctx.qidx[1] = i;
                 }
                 free(props);
+                if (ctx.headless)
+                        ctx.qidx[1] = ctx.qidx[0];
                 if (ctx.qidx[0] == UINT32_MAX || ctx.qidx[1] == UINT32_MAX) {
                         fprintf(stderr, "FATAL: Insufficient queue support\n");
                         return 1;
@@ -915,54 +2077,102 @@ vkinit(Display *dpy, Window win, int w, int h)
                         qinfo[i].pQueuePriorities = &(float){1.0f};
                 }
 
+                const char *exts[LEN(devext) + LEN(presentext)];
+                memcpy(exts, devext, sizeof devext);
+                memcpy(exts + LEN(devext), presentext, sizeof presentext);
+
+                VkPhysicalDevicePresentWaitFeaturesKHR waitfeat = {0};
+                waitfeat.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_WAIT_FEATURES_KHR;
+                waitfeat.presentWait = VK_TRUE;
+                VkPhysicalDevicePresentIdFeaturesKHR idfeat = {0};
+                idfeat.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_ID_FEATURES_KHR;
+                idfeat.pNext = &waitfeat;
+                idfeat.presentId = VK_TRUE;
+
+                pres.enabled = pres.cb && hasdevext(VK_KHR_PRESENT_ID_EXTENSION_NAME) &&
+                        hasdevext(VK_KHR_PRESENT_WAIT_EXTENSION_NAME);
+
                 VkDeviceCreateInfo info = {0};
                 info.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
                 info.pQueueCreateInfos = qinfo;
                 info.queueCreateInfoCount = ctx.nqidx;
                 info.pEnabledFeatures = &(VkPhysicalDeviceFeatures){0};
-                info.ppEnabledExtensionNames = devext;
-                info.enabledExtensionCount = 1;
-                if (vkCreateDevice(ctx.pdev, &info, NULL, &ctx.dev) != VK_SUCCESS) {
+                info.ppEnabledExtensionNames = exts;
+                info.enabledExtensionCount = ctx.headless ? 0 : LEN(devext);
+                if (pres.enabled) {
+                        info.pNext = &idfeat;
+                        info.enabledExtensionCount += LEN(presentext);
+                        if (vkCreateDevice(ctx.pdev, &info, NULL, &ctx.dev) != VK_SUCCESS) {
+                                /* Advertised, but the features are missing */
+                                pres.enabled = 0;
+                                info.pNext = NULL;
+                                info.enabledExtensionCount = ctx.headless ? 0 : LEN(devext);
+                        }
+                }
+                if (!pres.enabled && vkCreateDevice(ctx.pdev, &info, NULL, &ctx.dev) != VK_SUCCESS) {
+                        ctx.dev = VK_NULL_HANDLE;
                         fprintf(stderr, "FATAL: vkCreateDevice()\n");
                         return 1;
                 }
+                if (pres.cb && !pres.enabled)
+                        fputs("warning: VK_KHR_present_wait unavailable, no present timing\n", stderr);
         }
 
-        if (load_device_vk_funcs())
+        if (load_device_vk_funcs()) {
+                /* freevk() needs all of them, only the device goes */
+                vkDestroyDevice = (PFN_vkDestroyDevice)vkGetDeviceProcAddr(ctx.dev, "vkDestroyDevice");
+                if (vkDestroyDevice)
+                        vkDestroyDevice(ctx.dev, NULL);
+                ctx.dev = VK_NULL_HANDLE;
                 return 1;
+        }
 
         /* Get the device queues */
         vkGetDeviceQueue(ctx.dev, ctx.qidx[0], 0, &ctx.gfxq);
         vkGetDeviceQueue(ctx.dev, ctx.qidx[1], 0, &ctx.presq);
 
-        /* Create the swapchain */
-        if (initswapchain(&ctx.swapchain, (uint32_t)w, (uint32_t)h))
-                return 1;
+        /* Headless frames report their GPU time, if the queue can tell */
+        if (ctx.headless && tsbits) {
+                VkPhysicalDeviceProperties props;
+                vkGetPhysicalDeviceProperties(ctx.pdev, &props);
+                ctx.tsperiod = props.limits.timestampPeriod;
+
+                VkQueryPoolCreateInfo info = {0};
+                info.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+                info.queryType = VK_QUERY_TYPE_TIMESTAMP;
+                info.queryCount = 2;
+                if (vkCreateQueryPool(ctx.dev, &info, NULL, &ctx.query) != VK_SUCCESS)
+                        ctx.query = VK_NULL_HANDLE;
+        }
 
-         /* Create the render pass */
+        /* Create the render pass, writing the blink-on and blink-off frames */
         {
-                VkAttachmentDescription att = {0};
-                att.format = VK_FORMAT_B8G8R8A8_UNORM;
-                att.samples = VK_SAMPLE_COUNT_1_BIT;
-                att.loadOp = VK_ATTACHMENT_LOAD_OP_LOAD;
-                att.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
-                att.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
-                att.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-                att.initialLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
-                att.finalLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
-
-                VkAttachmentReference ref = {0};
-                ref.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+                VkAttachmentDescription att[2] = {0};
+                att[0].format = RTFMT;
+                att[0].samples = VK_SAMPLE_COUNT_1_BIT;
+                att[0].loadOp = VK_ATTACHMENT_LOAD_OP_LOAD;
+                att[0].storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+                att[0].stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+                att[0].stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+                att[0].initialLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+                att[0].finalLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+                att[1] = att[0];
+
+                VkAttachmentReference ref[2] = {0};
+                ref[0].attachment = 0;
+                ref[0].layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+                ref[1].attachment = 1;
+                ref[1].layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
 
                 VkSubpassDescription subpass = {0};
                 subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
-                subpass.colorAttachmentCount = 1;
-                subpass.pColorAttachments = &ref;
+                subpass.colorAttachmentCount = 2;
+                subpass.pColorAttachments = ref;
 
                 VkRenderPassCreateInfo info = {0};
                 info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
-                info.attachmentCount = 1;
-                info.pAttachments = &att;
+                info.attachmentCount = 2;
+                info.pAttachments = att;
                 info.subpassCount = 1;
                 info.pSubpasses = &subpass;
                 if (vkCreateRenderPass(ctx.dev, &info, NULL, &ctx.pass) != VK_SUCCESS) {
@@ -993,13 +2203,28 @@ vkinit(Display *dpy, Window win, int w, int h)
                 }
         }
 
-        /* Create the render target */
-        if (initrt(&ctx.rt))
-                return 1;
-
-        /* Create the graphics pipeline */
+        /* Create the graphics pipelines */
         if (initpipe(&ctx.pipeline))
                 return 1;
+        if (initgrid(&ctx.grid))
+                return 1;
+        if (initraster(&ctx.raster))
+                return 1;
+
+        /* The render target is read with texelFetch, the filter is irrelevant */
+        {
+                VkSamplerCreateInfo info = {0};
+                info.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+                info.magFilter = VK_FILTER_NEAREST;
+                info.minFilter = VK_FILTER_NEAREST;
+                info.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+                info.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+                info.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+                if (vkCreateSampler(ctx.dev, &info, NULL, &ctx.rtsampler) != VK_SUCCESS) {
+                        fprintf(stderr, "FATAL: vkCreateSampler()\n");
+                        return 1;
+                }
+        }
 
         /* Font texture, buffers */
         if (initimg(&fontimg, ATLASSIZ, ATLASSIZ, VK_FORMAT_R8_UNORM))
@@ -1010,20 +2235,116 @@ vkinit(Display *dpy, Window win, int w, int h)
         if (initbuf(&ssbuf, SSBUFSIZ, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT|VK_BUFFER_USAGE_TRANSFER_DST_BIT,
                         VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT))
                 return 1;
+        if (initbuf(&rsbuf, RSBUFSIZ, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT|
+                        VK_BUFFER_USAGE_TRANSFER_SRC_BIT|VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT))
+                return 1;
+
+        return 0;
+}
+
+void *
+preparedevice(void *arg)
+{
+        prep.ret = initdevice(prep.dpy);
+
+        return NULL;
+}
+
+int
+initvk(Display *dpy, Window win, int w, int h)
+{
+        VkBool32 ret;
+
+        if (prep.running) {
+                pthread_join(prep.thread, NULL);
+                prep.running = 0;
+        } else if (!prep.done) {
+                prep.ret = initdevice(dpy);
+        }
+        prep.done = 1;
+        if (prep.ret)
+                return 1;
 
-        /* Create the descriptor pool, allocate a descriptor set */
+        /* Create the surface, WSI */
+        if (!ctx.headless) {
+                VkXlibSurfaceCreateInfoKHR info = {0};
+                info.sType = VK_STRUCTURE_TYPE_XLIB_SURFACE_CREATE_INFO_KHR;
+                info.dpy = dpy;
+                info.window = win;
+                if (vkCreateXlibSurfaceKHR(ctx.instance, &info, NULL, &ctx.surface) != VK_SUCCESS) {
+                        fprintf(stderr, "FATAL: vkCreateXlibSurfaceKHR()\n");
+                        return 1;
+                }
+                vkGetPhysicalDeviceSurfaceSupportKHR(ctx.pdev, ctx.qidx[1], ctx.surface, &ret);
+                if (!ret) {
+                        fprintf(stderr, "FATAL: Insufficient queue support\n");
+                        return 1;
+                }
+        }
+
+        /* Create the swapchain */
+        if (initswapchain(&ctx.swapchain, (uint32_t)w, (uint32_t)h))
+                return 1;
+
+        /* Create the overlay render pass, writing the swapchain image */
         {
-                VkDescriptorPoolSize sizes[2] = {0};
+                VkAttachmentDescription att = {0};
+                att.format = ctx.swapchain.fmt;
+                att.samples = VK_SAMPLE_COUNT_1_BIT;
+                att.loadOp = VK_ATTACHMENT_LOAD_OP_LOAD;
+                att.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+                att.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+                att.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+                att.initialLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+                att.finalLayout = ctx.headless ? VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL :
+                        VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+
+                VkAttachmentReference ref = {0};
+                ref.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+
+                VkSubpassDescription subpass = {0};
+                subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+                subpass.colorAttachmentCount = 1;
+                subpass.pColorAttachments = &ref;
+
+                VkRenderPassCreateInfo info = {0};
+                info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+                info.attachmentCount = 1;
+                info.pAttachments = &att;
+                info.subpassCount = 1;
+                info.pSubpasses = &subpass;
+                if (vkCreateRenderPass(ctx.dev, &info, NULL, &ctx.overpass) != VK_SUCCESS) {
+                        fprintf(stderr, "FATAL: vkCreateRenderPass()\n");
+                        return 1;
+                }
+        }
+
+        if (initscfbs(&ctx.swapchain))
+                return 1;
+
+        /* Create the render target */
+        if (initrt(&ctx.rt))
+                return 1;
+
+        if (initoverlay(&ctx.overlay))
+                return 1;
+
+        /* Create the descriptor pool, allocate the descriptor sets */
+        {
+                VkDescriptorPoolSize sizes[3] = {0};
                 sizes[0].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-                sizes[0].descriptorCount = 1;
+                sizes[0].descriptorCount = 3;
                 sizes[1].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-                sizes[1].descriptorCount = 1;
+                sizes[1].descriptorCount = 5;
+                sizes[2].type = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+                sizes[2].descriptorCount = 2;
 
                 VkDescriptorPoolCreateInfo info = {0};
                 info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
-                info.poolSizeCount = 2;
+                info.poolSizeCount = 3;
                 info.pPoolSizes = sizes;
-                info.maxSets = 1;
+                info.maxSets = 4;
                 if (vkCreateDescriptorPool(ctx.dev, &info, NULL, &ctx.descpool) != VK_SUCCESS) {
                         fprintf(stderr, "FATAL: vkCreateDescriptorPool()\n");
                         return 1;
@@ -1063,6 +2384,29 @@ vkinit(Display *dpy, Window win, int w, int h)
                 writes[1].descriptorCount = 1;
                 writes[1].pImageInfo = &imginfo;
                 vkUpdateDescriptorSets(ctx.dev, 2, writes, 0, NULL);
+
+                alloc.pSetLayouts = &ctx.overlay.desc;
+                if (vkAllocateDescriptorSets(ctx.dev, &alloc, &ctx.overset) != VK_SUCCESS) {
+                        fprintf(stderr, "FATAL: vkAllocateDescriptorSets()\n");
+                        return 1;
+                }
+                updateoverlay();
+
+                alloc.pSetLayouts = &ctx.grid.desc;
+                if (vkAllocateDescriptorSets(ctx.dev, &alloc, &ctx.gridset) != VK_SUCCESS) {
+                        fprintf(stderr, "FATAL: vkAllocateDescriptorSets()\n");
+                        return 1;
+                }
+                updategrid();
+
+                alloc.pSetLayouts = &ctx.raster.desc;
+                if (vkAllocateDescriptorSets(ctx.dev, &alloc, &ctx.rasterset) != VK_SUCCESS) {
+                        fprintf(stderr, "FATAL: vkAllocateDescriptorSets()\n");
+                        return 1;
+                }
+                bufinfo.buffer = rsbuf.handle;
+                writes[0].dstSet = ctx.rasterset;
+                vkUpdateDescriptorSets(ctx.dev, 1, writes, 0, NULL);
         }
 
 
@@ -1078,6 +2422,13 @@ vkinit(Display *dpy, Window win, int w, int h)
         /* Update the fontatlas on the first render regardless of its actual state */
         fontatlas.dirty = 1;
 
+        if (pres.enabled && vkWaitForPresentKHR) {
+                if (pthread_create(&pres.thread, NULL, presentwaiter, NULL))
+                        fputs("warning: could not start the present waiter\n", stderr);
+                else
+                        pres.running = 1;
+        }
+
         return 0;
 }
 
@@ -1085,23 +2436,69 @@ void
 vkfree(void)
 {
         free(quadarr.data);
+        free(grid.bin);
+        free(grid.words);
+        free(pend.blits);
+        free(pend.jobs);
+        free(pend.copies);
+        free(pend.segs);
+
+        if (ctx.sw)
+                swfree();
+        else
+                freevk();
+}
 
+/*
+ * Destroys what initdevice() and initvk() created. After a failure half
+ * way, the rest is still VK_NULL_HANDLE, which every vkDestroy* ignores.
+ */
+void
+freevk(void)
+{
+        if (pres.running) {
+                pthread_mutex_lock(&pres.lock);
+                pres.quit = 1;
+                pthread_cond_broadcast(&pres.cond);
+                pthread_mutex_unlock(&pres.lock);
+                pthread_join(pres.thread, NULL);
+                pres.running = 0;
+        }
+
+        if (!ctx.dev)
+                goto instance;
         vkDeviceWaitIdle(ctx.dev);
         vkDestroySemaphore(ctx.dev, ctx.acquire, NULL);
         vkDestroySemaphore(ctx.dev, ctx.release, NULL);
         freebuf(&ssbuf);
         freebuf(&stgbuf);
+        freebuf(&rsbuf);
         freeimg(&fontimg);
         vkDestroyDescriptorPool(ctx.dev, ctx.descpool, NULL);
+        if (ctx.query)
+                vkDestroyQueryPool(ctx.dev, ctx.query, NULL);
         vkDestroyCommandPool(ctx.dev, ctx.cmdpool, NULL);
+        vkDestroySampler(ctx.dev, ctx.rtsampler, NULL);
+        freepipe(&ctx.raster);
+        freepipe(&ctx.grid);
+        freepipe(&ctx.overlay);
         freepipe(&ctx.pipeline);
+        vkDestroyRenderPass(ctx.dev, ctx.overpass, NULL);
         vkDestroyRenderPass(ctx.dev, ctx.pass, NULL);
         freert(&ctx.rt);
         freeswapchain(&ctx.swapchain);
         vkDestroyDevice(ctx.dev, NULL);
-        vkDestroySurfaceKHR(ctx.instance, ctx.surface, NULL);
-        vkDestroyInstance(ctx.instance, NULL);
-        dlclose(ctx.lib);
+        ctx.dev = VK_NULL_HANDLE;
+instance:
+        if (ctx.instance && ctx.surface)
+                vkDestroySurfaceKHR(ctx.instance, ctx.surface, NULL);
+        if (ctx.instance && vkDestroyInstance)
+                vkDestroyInstance(ctx.instance, NULL);
+        ctx.surface = VK_NULL_HANDLE;
+        ctx.instance = VK_NULL_HANDLE;
+        if (ctx.lib)
+                dlclose(ctx.lib);
+        ctx.lib = NULL;
 }
 
 int
@@ -1109,21 +2506,31 @@ vkresize(int w, int h)
 {
         VKSC *sc = &ctx.swapchain;
         VKRT *rt = &ctx.rt;
+        int ret = 1;
+
+        if (ctx.sw)
+                return swresize(w, h);
 
+        pausepresent(1);
         vkDeviceWaitIdle(ctx.dev);
         freeswapchain(sc);
         freert(rt);
 
-        if (initswapchain(sc, (uint32_t)w, (uint32_t)h))
-                return 1;
-        if (initrt(rt))
-                return 1;
+        if (initswapchain(sc, (uint32_t)w, (uint32_t)h) || initscfbs(sc) || initrt(rt))
+                goto out;
+        updateoverlay();
+        updategrid();
+        ret = 0;
+out:
+        /* The waiter must not stay paused, whatever failed */
+        pausepresent(0);
 
-        return 0;
+        return ret;
 }
 
 void
-vkpushquad(uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint16_t uvx, uint16_t uvy, Color fg, Color bg)
+vkpushquad(uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint16_t uvx, uint16_t uvy,
+           Color fg, Color bg, uint8_t flags)
 {
         uint32_t cap;
 
@@ -1132,8 +2539,81 @@ vkpushquad(uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint16_t uvx, uint16_
                 quadarr.data = xrealloc(quadarr.data, sizeof *quadarr.data * cap);
                 quadarr.cap = cap;
         }
+        /* The shader takes the flags from the unused background alpha */
+        bg.a = flags;
         quadarr.data[quadarr.sz++] = makequad(x, y, makerect(uvx, uvy, w, h), fg, bg);
         addrect(&ctx.dirty, makerect(x, y, w, h));
+        if (flags & QUAD_BLINK)
+                addrect(&ctx.frameblink, makerect(x, y, w, h));
+}
+
+/*
+ * Room for n more quads, filled in place by the caller. vkcommitquads()
+ * then adds the m it filled, which cover r.
+ */
+VKQUAD *
+vkreservequads(uint32_t n)
+{
+        uint32_t cap;
+
+        if (quadarr.sz + n > quadarr.cap) {
+                cap = MAX(quadarr.cap ? quadarr.cap*2 : 1024, quadarr.sz + n);
+                quadarr.data = xrealloc(quadarr.data, sizeof *quadarr.data * cap);
+                quadarr.cap = cap;
+        }
+
+        return quadarr.data + quadarr.sz;
+}
+
+void
+vkcommitquads(uint32_t m, Rect r, uint8_t flags)
+{
+        if (!m)
+                return;
+        quadarr.sz += m;
+        addrect(&ctx.dirty, r);
+        if (flags & QUAD_BLINK)
+                addrect(&ctx.frameblink, r);
+}
+
+void
+vkcursor(const CursorSpec *c)
+{
+        CursorSpec *o = &ctx.cursor;
+
+        if (c->style == o->style && c->thick == o->thick &&
+            !memcmp(&c->r, &o->r, sizeof c->r) && !memcmp(&c->uv, &o->uv, sizeof c->uv) &&
+            c->gx == o->gx && c->gy == o->gy &&
+            !memcmp(&c->fg, &o->fg, sizeof c->fg) && !memcmp(&c->bg, &o->bg, sizeof c->bg))
+                return;
+        *o = *c;
+        ctx.overdirty = 1;
+}
+
+/*
+ * Sets the blink clock, in ms. Only a change of the phase needs a new frame,
+ * which then only composes the blinking quads and the cursor.
+ */
+void
+vkblink(uint32_t time, uint32_t period)
+{
+        int phase = period ? (time / period) & 1 : 0;
+
+        if (phase != ctx.phase)
+                ctx.overdirty = 1;
+        ctx.time = time;
+        ctx.period = period;
+        ctx.phase = phase;
+}
+
+/* The next vkflush() has quads for every cell, older blinking ones are gone */
+void
+vkredrawn(void)
+{
+        if (ctx.sw)
+                swredrawn();
+        else
+                ctx.redrawn = 1;
 }
 
 int
@@ -1141,17 +2621,48 @@ vkflush(void)
 {
         VKSC *sc;
         void *stgp;
-        uint32_t nquad, imgidx, i;
-        size_t datasz;
+        VkBufferImageCopy *blit;
+        const uint8_t *src;
+        uint32_t nquad, imgidx, i, y, ntile = 0;
+        size_t datasz, off;
+        int usegrid;
+        Rect dirty;
 
         sc = &ctx.swapchain;
         nquad = quadarr.sz;
-        if (nquad == 0)
+        if (nquad == 0 && !ctx.overdirty)
                 return 0;
+        ctx.overdirty = 0;
+
+        if (ctx.sw) {
+                quadarr.sz = 0;
+                return swflush(quadarr.data, nquad, fontatlas.data, ATLASSIZ,
+                               &ctx.cursor, ctx.time, ctx.period);
+        }
 
-        vkAcquireNextImageKHR(ctx.dev, sc->handle, UINT64_MAX, ctx.acquire, VK_NULL_HANDLE, &imgidx);
+        /* After a full redraw, what still blinks is among its quads */
+        if (ctx.redrawn)
+                ctx.blinkrect = ctx.frameblink;
+        else
+                addrect(&ctx.blinkrect, ctx.frameblink);
+        ctx.frameblink = makerect(0, 0, 0, 0);
+        ctx.redrawn = 0;
+
+        if (ctx.headless)
+                imgidx = 0;
+        else
+                vkAcquireNextImageKHR(ctx.dev, sc->handle, UINT64_MAX, ctx.acquire, VK_NULL_HANDLE, &imgidx);
 
         datasz = nquad * sizeof(VKQUAD);
+        usegrid = ctx.usegrid && nquad;
+        if (usegrid) {
+                ntile = bingrid(quadarr.data, nquad, sc->w, sc->h);
+                /* Too much for a single dispatch, this frame takes the quad path */
+                if (ntile > MAXTILES || datasz + grid.sz*sizeof *grid.words > SSBUFSIZ)
+                        usegrid = 0;
+                else
+                        datasz += grid.sz * sizeof *grid.words;
+        }
         if (datasz > SSBUFSIZ) {
                 /* TODO: Resize the shader storage buffer */
                 fputs("warning: shader storage buffer overflow.", stderr);
@@ -1167,12 +2678,20 @@ vkflush(void)
                         fprintf(stderr, "FATAL: vkBeginCommandBuffer()\n");
                         return 1;
                 }
+                if (ctx.query) {
+                        vkCmdResetQueryPool(ctx.cmdbuf, ctx.query, 0, 2);
+                        vkCmdWriteTimestamp(ctx.cmdbuf, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, ctx.query, 0);
+                }
         }
 
         /* SSBO upload, TODO: benchmark against not using the staging buffer for simplicity */
-        {
+        if (nquad) {
                 vkMapMemory(ctx.dev, stgbuf.mem, 0, datasz, 0, &stgp);
-                memcpy(stgp, quadarr.data, datasz);
+                memcpy(stgp, quadarr.data, nquad * sizeof(VKQUAD));
+                if (usegrid) {
+                        memcpy((char *)stgp + nquad*sizeof(VKQUAD), grid.words,
+                               grid.sz * sizeof *grid.words);
+                }
                 vkUnmapMemory(ctx.dev, stgbuf.mem);
                 quadarr.sz = 0;
 
@@ -1181,38 +2700,114 @@ vkflush(void)
                 vkCmdCopyBuffer(ctx.cmdbuf, stgbuf.handle, ssbuf.handle, 1, &region);
                 bufbarrier(ssbuf.handle, datasz,
                                 VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT,
-                                VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_VERTEX_SHADER_BIT);
+                                VK_PIPELINE_STAGE_TRANSFER_BIT,
+                                usegrid ? VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT : VK_PIPELINE_STAGE_VERTEX_SHADER_BIT);
         }
 
-        /* Texture atlas upload */
-        if (fontatlas.dirty) {
+        /* Texture atlas upload, all of it after a reset or the glyphs blitted since */
+        if (fontatlas.dirty || pend.nblit) {
                 vkMapMemory(ctx.dev, stgbuf.mem, datasz, ATLASSIZ*ATLASSIZ, 0, &stgp);
-                memcpy(stgp, fontatlas.data, ATLASSIZ*ATLASSIZ);
+                if (fontatlas.dirty) {
+                        memcpy(stgp, fontatlas.data, ATLASSIZ*ATLASSIZ);
+                } else {
+                        /*
+                         * Only the blitted glyphs, packed one after the other.
+                         * Each took (w+ATLASPAD)*(h+ATLASPAD) of the atlas, so
+                         * they fit in its size even at 4 byte offsets.
+                         */
+                        for (off = i = 0; i < pend.nblit; i++) {
+                                blit = pend.blits + i;
+                                src = fontatlas.data + blit->imageOffset.y*ATLASSIZ + blit->imageOffset.x;
+                                for (y = 0; y < blit->imageExtent.height; y++) {
+                                        memcpy((uint8_t *)stgp + off + y*blit->imageExtent.width,
+                                               src + y*ATLASSIZ, blit->imageExtent.width);
+                                }
+                                blit->bufferOffset = datasz + off;
+                                off += (blit->imageExtent.width*blit->imageExtent.height + 3) & ~(size_t)3;
+                        }
+                }
                 vkUnmapMemory(ctx.dev, stgbuf.mem);
 
-                imgbarrier(fontimg.handle, 0, VK_ACCESS_TRANSFER_WRITE_BIT,
-                           VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-                           VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT);
-
-                VkBufferImageCopy region = {0};
-                region.bufferOffset = datasz;
-                region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-                region.imageSubresource.layerCount = 1;
-                region.imageExtent.width = ATLASSIZ;
-                region.imageExtent.height = ATLASSIZ;
-                region.imageExtent.depth = 1;
-                vkCmdCopyBufferToImage(ctx.cmdbuf, stgbuf.handle, fontimg.handle,
-                        VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+                if (fontatlas.dirty) {
+                        imgbarrier(fontimg.handle, 0, VK_ACCESS_TRANSFER_WRITE_BIT,
+                                   VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                                   VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT);
+
+                        VkBufferImageCopy region = {0};
+                        region.bufferOffset = datasz;
+                        region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+                        region.imageSubresource.layerCount = 1;
+                        region.imageExtent.width = ATLASSIZ;
+                        region.imageExtent.height = ATLASSIZ;
+                        region.imageExtent.depth = 1;
+                        vkCmdCopyBufferToImage(ctx.cmdbuf, stgbuf.handle, fontimg.handle,
+                                VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+                } else {
+                        imgbarrier(fontimg.handle, VK_ACCESS_SHADER_READ_BIT, VK_ACCESS_TRANSFER_WRITE_BIT,
+                                   VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                                   VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT|VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                                   VK_PIPELINE_STAGE_TRANSFER_BIT);
+
+                        vkCmdCopyBufferToImage(ctx.cmdbuf, stgbuf.handle, fontimg.handle,
+                                VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, pend.nblit, pend.blits);
+                }
 
                 imgbarrier(fontimg.handle, VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT,
                            VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
-                           VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT);
+                           VK_PIPELINE_STAGE_TRANSFER_BIT,
+                           VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT|VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
 
                 fontatlas.dirty = 0;
+                pend.nblit = 0;
+        }
+
+        /* Glyph outlines, rasterized by the raster shader and copied into the atlas */
+        if (pend.njob) {
+                VkDeviceSize jobsz = pend.njob * 4*sizeof(uint32_t);
+                VkDeviceSize insz = jobsz + pend.nseg * 4*sizeof(float);
+
+                vkMapMemory(ctx.dev, stgbuf.mem, SSBUFSIZ + ATLASSIZ*ATLASSIZ, insz, 0, &stgp);
+                memcpy(stgp, pend.jobs, jobsz);
+                memcpy((char *)stgp + jobsz, pend.segs, insz - jobsz);
+                vkUnmapMemory(ctx.dev, stgbuf.mem);
+
+                VkBufferCopy region = {0};
+                region.srcOffset = SSBUFSIZ + ATLASSIZ*ATLASSIZ;
+                region.size = insz;
+                vkCmdCopyBuffer(ctx.cmdbuf, stgbuf.handle, rsbuf.handle, 1, &region);
+                bufbarrier(rsbuf.handle, insz,
+                           VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT,
+                           VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+
+                vkCmdBindPipeline(ctx.cmdbuf, VK_PIPELINE_BIND_POINT_COMPUTE, ctx.raster.handle);
+                vkCmdBindDescriptorSets(ctx.cmdbuf, VK_PIPELINE_BIND_POINT_COMPUTE,
+                                        ctx.raster.layout, 0, 1, &ctx.rasterset, 0, 0);
+                uint32_t pc[2];
+                pc[0] = (uint32_t)(jobsz / sizeof(uint32_t));
+                pc[1] = RSINSIZ / sizeof(uint32_t);
+                vkCmdPushConstants(ctx.cmdbuf, ctx.raster.layout, VK_SHADER_STAGE_COMPUTE_BIT, 0,
+                                   sizeof pc, pc);
+                vkCmdDispatch(ctx.cmdbuf, pend.njob, 1, 1);
+
+                bufbarrier(rsbuf.handle, VK_WHOLE_SIZE,
+                           VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_TRANSFER_READ_BIT,
+                           VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT);
+                imgbarrier(fontimg.handle, VK_ACCESS_SHADER_READ_BIT, VK_ACCESS_TRANSFER_WRITE_BIT,
+                           VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                           VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT|VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                           VK_PIPELINE_STAGE_TRANSFER_BIT);
+                vkCmdCopyBufferToImage(ctx.cmdbuf, rsbuf.handle, fontimg.handle,
+                        VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, pend.njob, pend.copies);
+                imgbarrier(fontimg.handle, VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT,
+                           VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+                           VK_PIPELINE_STAGE_TRANSFER_BIT,
+                           VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT|VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+
+                pend.njob = pend.nseg = pend.out = 0;
         }
 
         /* Render pass */
-        {
+        if (nquad && !usegrid) {
                 VkRenderPassBeginInfo begininfo = {0};
                 begininfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
                 begininfo.renderPass = ctx.pass;
@@ -1233,47 +2828,157 @@ vkflush(void)
                 pc.vw = (float)sc->w;
                 pc.vh = (float)sc->h;
                 pc.tw = pc.th = ATLASSIZ;
+                pc.scale = atlasscale;
                 vkCmdPushConstants(ctx.cmdbuf, ctx.pipeline.layout, VK_SHADER_STAGE_VERTEX_BIT, 0,
                                    sizeof pc, &pc);
                 vkCmdDraw(ctx.cmdbuf, 4, nquad, 0, 0);
                 vkCmdEndRenderPass(ctx.cmdbuf);
+
+                for (i = 0; i < 2; i++) {
+                        imgbarrier(ctx.rt.img[i], VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT,
+                                   VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+                                   VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT);
+                }
         }
 
-        Rect dirty = ctx.dirty;
+        /* Or the grid shader, one workgroup per touched tile */
+        if (usegrid && ntile) {
+                for (i = 0; i < 2; i++) {
+                        imgbarrier(ctx.rt.img[i], VK_ACCESS_SHADER_READ_BIT, VK_ACCESS_SHADER_WRITE_BIT,
+                                   VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_IMAGE_LAYOUT_GENERAL,
+                                   VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+                }
+
+                vkCmdBindPipeline(ctx.cmdbuf, VK_PIPELINE_BIND_POINT_COMPUTE, ctx.grid.handle);
+                vkCmdBindDescriptorSets(ctx.cmdbuf, VK_PIPELINE_BIND_POINT_COMPUTE,
+                                        ctx.grid.layout, 0, 1, &ctx.gridset, 0, 0);
+
+                uint32_t pc[5];
+                pc[0] = nquad * sizeof(VKQUAD) / sizeof(uint32_t);
+                pc[1] = pc[0] + 3*ntile;
+                pc[2] = sc->w | sc->h << 16;
+                pc[3] = ATLASSIZ;
+                memcpy(pc + 4, &atlasscale, sizeof atlasscale);
+                vkCmdPushConstants(ctx.cmdbuf, ctx.grid.layout, VK_SHADER_STAGE_COMPUTE_BIT, 0,
+                                   sizeof pc, pc);
+                vkCmdDispatch(ctx.cmdbuf, ntile, 1, 1);
+
+                for (i = 0; i < 2; i++) {
+                        imgbarrier(ctx.rt.img[i], VK_ACCESS_SHADER_WRITE_BIT,
+                                   VK_ACCESS_SHADER_READ_BIT|VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+                                   VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+                                   VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                                   VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT|VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT);
+                }
+        }
+
+        /*
+         * Compose what changed since this image was last presented, plus
+         * the old and new cursor, plus the blinking quads on a phase flip.
+         */
+        dirty = ctx.dirty;
         addrect(&dirty, sc->dirty[imgidx]);
         for (i = 0; i < sc->nimg; i++)
                 addrect(sc->dirty + i, ctx.dirty);
+        addrect(&dirty, sc->cursor[imgidx]);
+        addrect(&dirty, ctx.cursor.r);
+        if (sc->phase[imgidx] != ctx.phase)
+                addrect(&dirty, ctx.blinkrect);
+        cliprect(&dirty, sc->w, sc->h);
+        if (dirty.w == 0 || dirty.h == 0)
+                dirty = makerect(0, 0, 1, 1);
+        sc->cursor[imgidx] = ctx.cursor.r;
+        sc->phase[imgidx] = (uint8_t)ctx.phase;
+
+        imgbarrier(sc->imgs[imgidx], 0, VK_ACCESS_COLOR_ATTACHMENT_READ_BIT|VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+                   !sc->init[imgidx] ? VK_IMAGE_LAYOUT_UNDEFINED :
+                   ctx.headless ? VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL : VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
+                   VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+                   VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT);
+        sc->init[imgidx] = 1;
+
+        /* Overlay pass */
+        {
+                VkRenderPassBeginInfo begininfo = {0};
+                begininfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+                begininfo.renderPass = ctx.overpass;
+                begininfo.framebuffer = sc->fbs[imgidx];
+                begininfo.renderArea.offset.x = dirty.x;
+                begininfo.renderArea.offset.y = dirty.y;
+                begininfo.renderArea.extent.width = dirty.w;
+                begininfo.renderArea.extent.height = dirty.h;
+                vkCmdBeginRenderPass(ctx.cmdbuf, &begininfo, VK_SUBPASS_CONTENTS_INLINE);
 
-        imgbarrier(sc->imgs[imgidx], VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT, VK_ACCESS_TRANSFER_WRITE_BIT,
-                   VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-                   VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT);
-
-        VkImageCopy region = {0};
-        region.srcOffset.x = dirty.x;
-        region.srcOffset.y = dirty.y;
-        region.dstOffset = region.srcOffset;
-        region.extent.width = dirty.w;
-        region.extent.height = dirty.h;
-        region.extent.depth = 1;
-        region.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-        region.srcSubresource.layerCount = 1;
-        region.dstSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-        region.dstSubresource.layerCount = 1;
-
-        vkCmdCopyImage(ctx.cmdbuf, ctx.rt.img, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
-                       sc->imgs[imgidx], VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
-
-        imgbarrier(sc->imgs[imgidx], VK_ACCESS_TRANSFER_WRITE_BIT, 0,
-                   VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
-                   VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT);
+                VkViewport vp = {0, 0, (float)sc->w, (float)sc->h, 0, 1};
+                vkCmdSetViewport(ctx.cmdbuf, 0, 1, &vp);
+                vkCmdSetScissor(ctx.cmdbuf, 0, 1, &begininfo.renderArea);
+                vkCmdBindPipeline(ctx.cmdbuf, VK_PIPELINE_BIND_POINT_GRAPHICS, ctx.overlay.handle);
+                vkCmdBindDescriptorSets(ctx.cmdbuf, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                                        ctx.overlay.layout, 0, 1, &ctx.overset, 0, 0);
+
+                CursorSpec *c = &ctx.cursor;
+                VKOPC pc;
+                pc.cursor[0] = c->r.x;
+                pc.cursor[1] = c->r.y;
+                pc.cursor[2] = c->r.w;
+                pc.cursor[3] = c->r.h;
+                pc.glyph[0] = c->gx;
+                pc.glyph[1] = c->gy;
+                pc.glyph[2] = c->uv.w;
+                pc.glyph[3] = c->uv.h;
+                pc.uv[0] = c->uv.x;
+                pc.uv[1] = c->uv.y;
+                pc.fg = c->fg;
+                pc.bg = c->bg;
+                pc.style = (uint32_t)c->style;
+                pc.thick = c->thick;
+                pc.time = ctx.time;
+                pc.period = ctx.period;
+                pc.scale = atlasscale;
+                vkCmdPushConstants(ctx.cmdbuf, ctx.overlay.layout, VK_SHADER_STAGE_FRAGMENT_BIT, 0,
+                                   sizeof pc, &pc);
+                vkCmdDraw(ctx.cmdbuf, 3, 1, 0, 0);
+                vkCmdEndRenderPass(ctx.cmdbuf);
+        }
+
+        if (ctx.query)
+                vkCmdWriteTimestamp(ctx.cmdbuf, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, ctx.query, 1);
+
+        /* Read back the composed frame */
+        if (ctx.headless && framecb) {
+                imgbarrier(sc->imgs[0], VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT, VK_ACCESS_TRANSFER_READ_BIT,
+                           VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                           VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT);
+
+                VkBufferImageCopy region = {0};
+                region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+                region.imageSubresource.layerCount = 1;
+                region.imageExtent.width = sc->w;
+                region.imageExtent.height = sc->h;
+                region.imageExtent.depth = 1;
+                vkCmdCopyImageToBuffer(ctx.cmdbuf, sc->imgs[0], VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                                       rbbuf.handle, 1, &region);
+        }
 
         vkEndCommandBuffer(ctx.cmdbuf);
 
         ctx.dirty = sc->dirty[imgidx] = makerect(0, 0, 0, 0);
 
+        if (ctx.headless) {
+                VkSubmitInfo info = {0};
+                info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+                info.commandBufferCount = 1;
+                info.pCommandBuffers = &ctx.cmdbuf;
+                vkQueueSubmit(ctx.gfxq, 1, &info, VK_NULL_HANDLE);
+                vkQueueWaitIdle(ctx.gfxq);
+                if (framecb)
+                        readback();
+                return 0;
+        }
+
         /* Submit command buffer */
         {
-                VkPipelineStageFlags mask = VK_PIPELINE_STAGE_TRANSFER_BIT;
+                VkPipelineStageFlags mask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
                 VkSubmitInfo info = {0};
                 info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
                 info.waitSemaphoreCount = 1;
@@ -1288,6 +2993,13 @@ vkflush(void)
 
         /* Present */
         {
+                uint64_t id;
+
+                VkPresentIdKHR presid = {0};
+                presid.sType = VK_STRUCTURE_TYPE_PRESENT_ID_KHR;
+                presid.swapchainCount = 1;
+                presid.pPresentIds = &id;
+
                 VkPresentInfoKHR info = {0};
                 info.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
                 info.waitSemaphoreCount = 1;
@@ -1295,7 +3007,20 @@ vkflush(void)
                 info.swapchainCount = 1;
                 info.pSwapchains = &sc->handle;
                 info.pImageIndices = &imgidx;
-                vkQueuePresentKHR(ctx.presq, &info);
+                if (pres.running) {
+                        pthread_mutex_lock(&pres.lock);
+                        id = pres.id + 1;
+                        info.pNext = &presid;
+                        /* Before the waiter can see it */
+                        if (pres.queuedcb)
+                                pres.queuedcb(id);
+                        vkQueuePresentKHR(ctx.presq, &info);
+                        pres.id = id;
+                        pthread_cond_broadcast(&pres.cond);
+                        pthread_mutex_unlock(&pres.lock);
+                } else {
+                        vkQueuePresentKHR(ctx.presq, &info);
+                }
         }
 
         vkQueueWaitIdle(ctx.presq);
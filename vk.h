@@ -2,6 +2,7 @@
 #define VK_H
 
 #include <stdint.h>
+#include <time.h>
 #include <X11/Xlib.h>
 
 #define COLOREQ(ca, cb)         ((ca).r == (cb).r && \
@@ -24,15 +25,71 @@ typedef struct {
         uint8_t b;
         uint8_t a;
 } Color;
+
+/* A quad as consumed by the shaders and the software renderer */
+typedef struct {
+        uint16_t x, y;
+        Rect uv;        /* atlas position and quad size */
+        Color fg;
+        Color bg;       /* alpha holds the quad flags */
+} VKQUAD;
 #pragma pack(pop)
 
-int blitatlas(uint16_t *, uint16_t *, uint16_t, uint16_t, uint16_t, uint16_t,
-                uint16_t, uint16_t, uint16_t, const uint8_t *);
+/* Quad flags */
+#define QUAD_BLINK              (1 << 0) /* background only in the blink-off phase */
+#define QUAD_FILL               (1 << 1) /* solid foreground, no atlas lookup */
+
+/* Cursor styles, CUR_BLINK can be or'ed to any of them */
+enum {
+        CUR_NONE,
+        CUR_BLOCK,
+        CUR_UNDERLINE,
+        CUR_BAR,
+        CUR_HOLLOW,
+};
+#define CUR_BLINK               (1 << 3)
+
+typedef struct {
+        int style;
+        uint16_t thick;         /* underline and bar thickness */
+        Rect r;                 /* the cursor cell(s) */
+        int16_t gx, gy;         /* glyph position, block cursor only */
+        Rect uv;                /* glyph in the atlas, uv.w == 0 for none */
+        Color fg;
+        Color bg;
+} CursorSpec;
+
+/* A headless frame, see vkframecb() */
+typedef struct {
+        const uint8_t *data;    /* BGRA rows */
+        uint32_t w, h;
+        uint32_t stride;
+        double gpums;           /* < 0 if the queue has no timestamps */
+} VKFrame;
+
+int blitatlas(uint16_t *, uint16_t *, uint16_t, uint16_t, uint16_t, const uint8_t *);
+int outlineatlas(uint16_t *, uint16_t *, uint16_t, uint16_t, const float *, uint32_t);
+int vkoutlines(void);
+void resetatlas(void);
+
+/* Distance range of distance field glyphs in atlas pixels, see vkatlasscale() */
+#define SDFSPREAD               8
 
+void vkatlasscale(float);
+void vkgrid(int);
+void vksoftware(int);
+void vkprepare(Display *);
 int vkinit(Display *, Window, int, int);
 void vkfree(void);
 int vkresize(int, int);
-void vkpushquad(uint16_t, uint16_t, uint16_t, uint16_t, uint16_t, uint16_t, Color, Color);
+void vkpushquad(uint16_t, uint16_t, uint16_t, uint16_t, uint16_t, uint16_t, Color, Color, uint8_t);
+VKQUAD *vkreservequads(uint32_t);
+void vkcommitquads(uint32_t, Rect, uint8_t);
+void vkcursor(const CursorSpec *);
+void vkblink(uint32_t, uint32_t);
+void vkredrawn(void);
 int vkflush(void);
+void vkpresentcb(void (*)(uint64_t), void (*)(uint64_t, const struct timespec *));
+void vkframecb(void (*)(const VKFrame *));
 
 #endif
@@ -21,20 +21,28 @@ INSTANCE_VK_FUNC(vkEnumeratePhysicalDevices)
 INSTANCE_VK_FUNC(vkEnumerateDeviceExtensionProperties)
 INSTANCE_VK_FUNC(vkGetPhysicalDeviceQueueFamilyProperties)
 INSTANCE_VK_FUNC(vkGetPhysicalDeviceMemoryProperties)
+INSTANCE_VK_FUNC(vkGetPhysicalDeviceProperties)
 INSTANCE_VK_FUNC(vkCreateDevice)
 INSTANCE_VK_FUNC(vkGetDeviceProcAddr)
 INSTANCE_VK_FUNC(vkDestroyInstance)
+#undef INSTANCE_VK_FUNC
+
+/* Window system functions, not loaded headless where their extensions are off */
+#ifndef WSI_INSTANCE_VK_FUNC
+#define WSI_INSTANCE_VK_FUNC(name)
+#endif
 
 // VK_KHR_surface
-INSTANCE_VK_FUNC(vkGetPhysicalDeviceSurfaceSupportKHR)
-INSTANCE_VK_FUNC(vkGetPhysicalDeviceSurfaceCapabilitiesKHR)
-INSTANCE_VK_FUNC(vkGetPhysicalDeviceSurfaceFormatsKHR)
-INSTANCE_VK_FUNC(vkGetPhysicalDeviceSurfacePresentModesKHR)
-INSTANCE_VK_FUNC(vkDestroySurfaceKHR)
+WSI_INSTANCE_VK_FUNC(vkGetPhysicalDeviceSurfaceSupportKHR)
+WSI_INSTANCE_VK_FUNC(vkGetPhysicalDeviceSurfaceCapabilitiesKHR)
+WSI_INSTANCE_VK_FUNC(vkGetPhysicalDeviceSurfaceFormatsKHR)
+WSI_INSTANCE_VK_FUNC(vkGetPhysicalDeviceSurfacePresentModesKHR)
+WSI_INSTANCE_VK_FUNC(vkDestroySurfaceKHR)
 
 // VK_KHR_xlib_surface
-INSTANCE_VK_FUNC(vkCreateXlibSurfaceKHR)
-#undef INSTANCE_VK_FUNC
+WSI_INSTANCE_VK_FUNC(vkCreateXlibSurfaceKHR)
+WSI_INSTANCE_VK_FUNC(vkGetPhysicalDeviceXlibPresentationSupportKHR)
+#undef WSI_INSTANCE_VK_FUNC
 
 #ifndef DEVICE_VK_FUNC
 #define DEVICE_VK_FUNC(name)
@@ -93,20 +101,41 @@ DEVICE_VK_FUNC(vkCreateGraphicsPipelines)
 DEVICE_VK_FUNC(vkDestroyPipeline)
 DEVICE_VK_FUNC(vkCreateShaderModule)
 DEVICE_VK_FUNC(vkDestroyShaderModule)
+DEVICE_VK_FUNC(vkCreateComputePipelines)
 DEVICE_VK_FUNC(vkCreatePipelineLayout)
 DEVICE_VK_FUNC(vkDestroyPipelineLayout)
 DEVICE_VK_FUNC(vkCmdBindPipeline)
 DEVICE_VK_FUNC(vkCmdSetViewport)
 DEVICE_VK_FUNC(vkCmdSetScissor)
 DEVICE_VK_FUNC(vkCmdDraw)
+DEVICE_VK_FUNC(vkCmdDispatch)
 DEVICE_VK_FUNC(vkCmdCopyImage)
 DEVICE_VK_FUNC(vkCmdPushConstants)
 DEVICE_VK_FUNC(vkCmdClearColorImage)
+DEVICE_VK_FUNC(vkCmdCopyImageToBuffer)
+DEVICE_VK_FUNC(vkCreateQueryPool)
+DEVICE_VK_FUNC(vkDestroyQueryPool)
+DEVICE_VK_FUNC(vkCmdResetQueryPool)
+DEVICE_VK_FUNC(vkCmdWriteTimestamp)
+DEVICE_VK_FUNC(vkGetQueryPoolResults)
+#undef DEVICE_VK_FUNC
+
+#ifndef WSI_DEVICE_VK_FUNC
+#define WSI_DEVICE_VK_FUNC(name)
+#endif
 
 // VK_KHR_swapchain
-DEVICE_VK_FUNC(vkCreateSwapchainKHR)
-DEVICE_VK_FUNC(vkGetSwapchainImagesKHR)
-DEVICE_VK_FUNC(vkAcquireNextImageKHR)
-DEVICE_VK_FUNC(vkQueuePresentKHR)
-DEVICE_VK_FUNC(vkDestroySwapchainKHR)
-#undef DEVICE_VK_FUNC
+WSI_DEVICE_VK_FUNC(vkCreateSwapchainKHR)
+WSI_DEVICE_VK_FUNC(vkGetSwapchainImagesKHR)
+WSI_DEVICE_VK_FUNC(vkAcquireNextImageKHR)
+WSI_DEVICE_VK_FUNC(vkQueuePresentKHR)
+WSI_DEVICE_VK_FUNC(vkDestroySwapchainKHR)
+#undef WSI_DEVICE_VK_FUNC
+
+#ifndef OPTIONAL_DEVICE_VK_FUNC
+#define OPTIONAL_DEVICE_VK_FUNC(name)
+#endif
+
+// VK_KHR_present_wait
+OPTIONAL_DEVICE_VK_FUNC(vkWaitForPresentKHR)
+#undef OPTIONAL_DEVICE_VK_FUNC
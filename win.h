@@ -27,7 +27,10 @@ void xbell(void);
 void xclipcopy(void);
 void xdrawcursor(int, int, Glyph, int, int, Glyph);
 void xdrawline(Line, int, int, int);
+void xprepareline(Line, int, int, int);
+void xpreparedraw(void);
 void xfinishdraw(void);
+ushort xglyphid(Rune, ushort);
 void xloadcols(void);
 int xsetcolorname(int, const char *);
 void xseticontitle(char *);
@@ -1,10 +1,14 @@
 /* See LICENSE for license details. */
 #include <errno.h>
+#include <fcntl.h>
 #include <math.h>
 #include <limits.h>
 #include <locale.h>
+#include <pthread.h>
 #include <signal.h>
+#include <sys/mman.h>
 #include <sys/select.h>
+#include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 #include <libgen.h>
@@ -14,14 +18,25 @@
 #include <X11/cursorfont.h>
 #include <X11/keysym.h>
 #include <X11/XKBlib.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define XSIMD
+#endif
 #include <fontconfig/fontconfig.h>
 #include <fontconfig/fcfreetype.h>
+#include FT_MODULE_H
+#include FT_OUTLINE_H
+#ifdef HARFBUZZ
+#include <hb.h>
+#include <hb-ft.h>
+#endif
 
 char *argv0;
 #include "arg.h"
 #include "st.h"
 #include "win.h"
 #include "vk.h"
+#include "boxdraw.h"
 
 /* types used in config.h */
 typedef struct {
@@ -62,6 +77,8 @@ static void zoom(const Arg *);
 static void zoomabs(const Arg *);
 static void zoomreset(const Arg *);
 static void ttysend(const Arg *);
+static void latencydump(const Arg *);
+static void togglegrid(const Arg *);
 
 /* config.h for applying patches and the configuration. */
 #include "config.h"
@@ -93,6 +110,7 @@ typedef struct {
         int cw; /* char width  */
         int mode; /* window state/mode flags */
         int cursor; /* cursor style */
+        struct timespec blinkepoch; /* start of the blink cycle */
 } TermWindow;
 
 typedef struct {
@@ -121,42 +139,323 @@ typedef struct {
         struct timespec tclick2;
 } XSelection;
 
+/* Input to present latency, log2 buckets: [0, 1), [1, 2), [2, 4) ... ms */
+#define LATBUCKETS      12
+#define LATFRAMES       32
+
+typedef struct {
+        const char *name;
+        unsigned long n[LATBUCKETS];
+        unsigned long count;
+        double sum, max;
+} Histogram;
+
+typedef struct {
+        uint64_t id; /* present id */
+        int haskey, haspty;
+        struct timespec key, pty;
+} LatFrame;
+
+typedef struct {
+        pthread_mutex_t lock;
+        int haskey, haspty; /* input which has not been drawn yet */
+        struct timespec key, pty;
+        LatFrame frames[LATFRAMES]; /* presented, but not yet visible */
+        int head, len;
+        uint64_t lastid; /* last id the present waiter reported */
+        Histogram keyhist, ptyhist;
+} Latency;
+
 #define FONTDPI         96
 #define NOKEY           0xffffffff
 #define MAPINITSZ       256
 
+/* The glyph cache of a font at a size it is not set to, see xresizefont() */
+typedef struct {
+        FT_F26Dot6 size; /* 26.6 points */
+        GlyphSpec *table;
+        Rune *keys;
+        GlyphSpec *vals;
+        size_t nb, ng;
+} Fontsize;
+
+#define FONTSIZE26(pt)  ((FT_F26Dot6)((pt) * 64 + 0.5))
+
+/* Pixels kept around the glyphs of a distance field atlas */
+#define SDFMARGIN       2
+
+/* Atlas to screen pixels, 1 unless the atlas holds distance fields */
+#define GLYPHPX(v)      ((int)lroundf((v) * glyphscale))
+
 /* Font structure */
 #define Font Font_
-typedef struct {
+typedef struct Font_ {
         int height;
         int width;
         int ascent;
         int descent;
+        int refascent; /* in atlas pixels, see glyphscale */
         int badslant;
         int badweight;
         FcPattern *pattern;
-        FcPattern *match;
+        int configured; /* pattern went through FcConfigSubstitute */
+        FcPattern *match; /* only FC_FILE and FC_INDEX without fontconfig */
+        FcCharSet *charset; /* coverage, owned by match */
         FcFontSet *set;
         FT_Face face;
-
-        /* Glyph cache */
-        size_t nb; /* num buckets */
+        FT_F26Dot6 size; /* of face, see xresizefont() */
+        struct Font *owner; /* of face and glyphs if shared, see xsharefont() */
+        Fontsize *sizes; /* glyph caches of other sizes, most recent first */
+        int nsizes;
+
+        /* Glyph cache, runes below glyphtablesz index table directly */
+        GlyphSpec *table; /* uvx == NOUV for glyphs not loaded yet */
+        size_t nb; /* num buckets, a power of two */
         size_t ng; /* num glyphs */
         Rune *keys;
         GlyphSpec *vals;
+#ifdef HARFBUZZ
+        hb_font_t *hb; /* on face, created by the first shaperun() */
+#endif
 } Font;
 
+/* A style font resolved by fontconfig, see fontcacheload() */
+typedef struct {
+        char file[PATH_MAX];
+        int index;
+        int badslant, badweight;
+} Fontfile;
+
 /* Drawing Context */
 typedef struct {
         Color *col;
         size_t collen;
         FT_Library ft;
-        Font font, bfont, ifont, ibfont;
+        Font font, bfont, ifont, ibfont; /* face is NULL until xstyleload() */
 } DC;
 
+static inline size_t runehash(Rune, size_t);
+/*
+ * A glyph missing from the atlas, rendered by one of the rasterizer threads
+ * before the lines are drawn, see xprepareline().
+ */
+typedef struct {
+        Rune u;
+        int style; /* FRC_ flags of the style font */
+        int frcidx; /* fallback font in frc, or -1 for the style font */
+        const char *file; /* of the font, owned by its match pattern */
+        int index;
+        FT_F26Dot6 size;
+        int ok;
+        FT_Bitmap bitmap; /* own copy of the rendered glyph */
+        int left, top;
+} RasterJob;
+
+/* One per thread, FreeType objects can't be shared */
+typedef struct {
+        pthread_t thread;
+        FT_Library ft;
+        unsigned int batch;
+        struct {
+                const char *file; /* owned by the Font it was opened for */
+                int index;
+                FT_Face face;
+                FT_F26Dot6 size; /* face is set to */
+        } faces[8];
+        int nfaces;
+} Rasterizer;
+
+static struct {
+        int nthreads;
+        Rasterizer *threads;
+        RasterJob *jobs;
+        size_t n, cap;
+        size_t next; /* first job not taken yet */
+        int busy; /* threads still working on the batch */
+        int inflight; /* batch not collected yet, see rastercollect() */
+        int prewarm; /* styles whose prewarm set is in the batch, for the glyph cache */
+        unsigned int batch;
+        pthread_mutex_t lock;
+        pthread_cond_t cond, done;
+} raster = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .cond = PTHREAD_COND_INITIALIZER,
+        .done = PTHREAD_COND_INITIALIZER,
+};
+
+/* Fewer misses than this are rendered in xdrawglyphs() as they come */
+#define RASTERBATCH     32
+
+/* Render flags of every glyph, part of the glyph cache key */
+#define LOADFLAGS       (FT_LOAD_RENDER|FT_LOAD_TARGET_LIGHT)
+
+/*
+ * A glyph outline flattened to line segments for outlineatlas(), in
+ * pixels from the top left of its box, y down.
+ */
+typedef struct {
+        float *seg;     /* x0, y0, x1, y1 */
+        uint32_t n, cap;
+        float x, y;     /* pen */
+        int left, top;  /* of the box, from the origin */
+} Outline;
+
+/* Curves are split until a segment is this close to them, in pixels */
+#define CURVETOL        0.1f
+#define CURVESTEPS      16
+
+/*
+ * Glyphs resolved for the cells: Glyph.gid is the generation in the top
+ * 4 bits and the index + 1 of the entry below, see xcellglyph(). It fills
+ * the padding after Glyph.mode. The generation moves on when the atlas or
+ * the fonts change, or when the entries run out.
+ */
+#define GIDBITS         12
+#define GIDMASK         ((1u << GIDBITS) - 1)
+#define GIDGENMASK      ((1u << (16 - GIDBITS)) - 1)
+#define CELLSTYLE(m)    ((((m) & ATTR_ITALIC) ? FRC_ITALIC : 0) | \
+                         (((m) & ATTR_BOLD) ? FRC_BOLD : 0))
+
+/* The quad fields come first, laid out as in VKQUAD, see encodesse4() */
+typedef struct {
+        int16_t dx, dy; /* glyph quad from the cell origin, in screen pixels */
+        uint16_t uvx, uvy;
+        uint16_t w, h;  /* 0 for none */
+        Rune u;
+        int style;      /* FRC_ flags */
+} Glyphid;
+
+/*
+ * Writes the glyph quads of n cells cw apart from xp, yp into q, skipping
+ * the empty ones, and grows the bounds b (x0, y0, x1, y1) over them.
+ * Returns the number of quads written, q must have room for n.
+ */
+typedef uint32_t (*Encodefn)(VKQUAD *, const Glyphid **, uint32_t, uint16_t,
+                             uint16_t, uint16_t, Color, Color, uint16_t *);
+
+#ifdef HARFBUZZ
+/*
+ * Glyph cache keys past the runes: a glyph by its index in the face, and
+ * a composed cluster, see clusterglyph().
+ */
+#define GLYPHKEY(i)     ((Rune)0x80000000 | (i))
+#define CLUSTERKEY(n)   ((Rune)0x40000000 | (n))
+
+/* A glyph of a shaped run, see shaperun() */
+typedef struct {
+        FT_UInt idx;    /* in the face */
+        uint16_t cell;  /* of its cluster, from the start of the run */
+        int16_t dx, dy; /* from the cell origin in atlas pixels, y down */
+} ShapedGlyph;
+
+typedef struct {
+        uint64_t hash;
+        Font *font;
+        Rune *runes;
+        int nrune;
+        ShapedGlyph *glyphs; /* in cluster order */
+        int nglyph;
+        int prev, next; /* recently used list */
+        int chain;      /* next run in the bucket */
+} ShapedRun;
+#endif
+
+/*
+ * A glyph cache file holds the rendered prewarm set of one style: a
+ * header, the entries, then the bitmaps they point into. It is only ever
+ * read by the same build on the same machine.
+ */
+#define GCMAGIC         "stvkgc1"
+
+/* Whether a job of the prewarm batch goes to the glyph cache file of style */
+#define GCJOB(j, s)     ((j)->ok && (j)->style == (s) && (j)->frcidx < 0)
+
+typedef struct {
+        char magic[8];
+        uint32_t keylen; /* followed by the key */
+        uint32_t n;
+} GCHeader;
+
+typedef struct {
+        uint32_t u;
+        int32_t style;
+        int32_t left, top;
+        uint32_t w, rows;
+        uint32_t off; /* of the bitmap, from the start of the file */
+} GCEntry;
+
 static inline void rehash(Font *);
+static int *fallbackslot(uint32_t);
+static int xfallback(Font *, int, Rune);
+static int xloadfallback(Font *, int, Rune);
+static FcPattern *fcfallback(Font *, Rune);
+static int samefile(FcPattern *, FcPattern *);
+static int frcfind(FcPattern *);
+static Font *frcnew(int);
+static void *fallbackworker(void *);
+static int fallbackqueued(FcPattern *);
+static void fallbackcovered(int);
+static void *fontsort(void *);
+static void fontsortwait(void);
+static void fcconfigure(Font *);
+static void fallbackstart(void);
+static void fallbackflush(void);
+static void fallbackdone(void);
+static inline GlyphSpec *lookupglyph(Font *, Rune);
+static GlyphSpec *storeglyph(Font *, Rune, const FT_Bitmap *, int, int, const Outline *);
 static inline GlyphSpec *getglyphspec(Font *, Rune);
+static GlyphSpec *loadglyph(Font *, Rune, FT_UInt);
+static int gpuoutlines(void);
+static void outlinept(Outline *, const FT_Vector *, float *, float *);
+static void outlineseg(Outline *, float, float);
+static int outlinemove(const FT_Vector *, void *);
+static int outlineline(const FT_Vector *, void *);
+static int outlineconic(const FT_Vector *, const FT_Vector *, void *);
+static int outlinecubic(const FT_Vector *, const FT_Vector *, const FT_Vector *, void *);
+static GlyphSpec *outlineglyph(Font *, Rune, FT_UInt);
+static int useboxdraw(Rune);
+static GlyphSpec *boxglyph(Rune);
+static void xglyphcolors(Glyph *, Color *, Color *);
+static void xcellcolors(const Glyph *, int, Color *, Color *);
+static Glyphid *xcellglyph(Glyph *);
+static uint32_t encodescalar(VKQUAD *, const Glyphid **, uint32_t, uint16_t,
+                             uint16_t, uint16_t, Color, Color, uint16_t *);
+static Encodefn pickencode(void);
+static uint32_t *gidslot(uint32_t);
+static uint32_t *gidfind(uint32_t);
+static void gidflush(void);
+static Font *xstylefont(Glyph *, int *);
+static GlyphSpec *xglyphspec(Glyph *, Font **);
+static Font *rasterfont(const RasterJob *);
+static int rastercmp(const void *, const void *);
+static FT_Face rasterface(Rasterizer *, const RasterJob *);
+static void *rasterworker(void *);
+static void rasterstart(void);
+static void rasterjob(Font *, int, int, Rune);
+static void rastersubmit(void);
+static void rastercollect(int);
+static void rasterprewarm(void);
+static int cachepath(char *, size_t, const char *, const char *, size_t);
+static void cachemkdir(char *);
+static long long fcstamp(void);
+static int fontcacheload(const char *, Fontfile *);
+static int fontfile(Fontfile *, FcPattern *, int, int);
+static void fontcachesave(const char *, const Fontfile *);
+static int glyphcachekey(Font *, int, char *, size_t, char *, size_t);
+static int glyphcacheload(Font *, int);
+static void glyphcachesave(int);
 static void xdrawglyphs(Glyph *, int, int, int);
+static void xdrawcells(Glyph *, int, int, int);
+#ifdef HARFBUZZ
+static void xdrawshaped(Glyph *, int, int, int);
+static void xdrawrun(Glyph *, int, int, int, Font *);
+static ShapedRun *shaperun(Font *, const Rune *, int);
+static void shapeunlink(int);
+static void shapeflush(void);
+static Rune clusterkey(const ShapedGlyph *, int);
+static GlyphSpec *clusterglyph(Font *, const ShapedGlyph *, int);
+#endif
+static int cursorblinks(void);
 static void xclear(int, int, int, int);
 static int xgeommasktogravity(int);
 static int ximopen(Display *);
@@ -169,10 +468,24 @@ static void xresize(int, int);
 static void xhints(void);
 static inline Color rgb16_to_8(XColor *);
 static void xloadcolor(int, const char *, Color *);
+static FcPattern *fcmatch(FcPattern *, FcPattern **, int *, int *);
 static int xloadfont(Font *, FcPattern *);
+static Font *xstyleload(Font *, int);
+static int xloadfile(Font *, FcPattern *, const Fontfile *);
+static int xopenfont(Font *, const char *, int);
+static int xfontmetrics(Font *);
+static int renderglyph(FT_Face, FT_UInt);
+static void glyphbitmap(FT_GlyphSlot, FT_Bitmap *, int *, int *);
+static void sdfspread(FT_Library);
+static void xfontglyphs(Font *);
+static void xsharefont(Font *, Font *);
+static void xresizefont(Font *, FT_F26Dot6);
+static void xfreeglyphs(Fontsize *);
+static void xforgetglyphs(Font *);
+static void xresetatlas(void);
 static void xloadfonts(char *, double);
 static void xunloadfont(Font *);
-static void xunloadfonts(void);
+static void xzoomfonts(double);
 static void xsetenv(void);
 static void xseturgency(int);
 static int evcol(XEvent *);
@@ -200,6 +513,15 @@ static void mousereport(XEvent *);
 static char *kmap(KeySym, uint);
 static int match(uint, uint);
 
+static void latinput(int);
+static void latframe(uint64_t);
+static void latpresented(uint64_t, const struct timespec *);
+static void histadd(Histogram *, double);
+static void histprint(Histogram *);
+static void latexit(void);
+
+static void headlessframe(const VKFrame *);
+static void headless(void);
 static void run(void);
 static void usage(void);
 
@@ -234,6 +556,11 @@ static DC dc;
 static XWindow xw;
 static XSelection xsel;
 static TermWindow win;
+static Latency lat = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .keyhist = { .name = "keypress-to-present" },
+        .ptyhist = { .name = "pty-to-present" },
+};
 
 /* Font Ring Cache */
 enum {
@@ -252,20 +579,147 @@ typedef struct {
 static Fontcache *frc = NULL;
 static int frclen = 0;
 static int frccap = 0;
+
+/* A glyph did not fit, see xfinishdraw() */
+static int atlasfull = 0;
+/* The next frame redraws the screen into an emptied atlas */
+static int atlasredraw = 0;
+/* Lines drawn since xstartdraw(), all of them on a full redraw */
+static int drawnrows = 0;
+
+/* Screen size of the atlas glyphs, usedfontsize / sdfsize with sdfatlas */
+static float glyphscale = 1;
+
+/* Segments of the last glyph outline, see outlineglyph() */
+static Outline outline;
+
+/* Glyph cache of the procedural glyphs, it has no face, see boxglyph() */
+static Font boxfont;
+
+#ifdef HARFBUZZ
+/* Shaped runs, the least recently used one goes first, see shaperun() */
+static struct {
+        ShapedRun *runs;
+        int n, cap;
+        int *buckets;   /* first run of each, -1 for none */
+        int nb;
+        int head, tail; /* most and least recently used */
+        hb_buffer_t *buf;
+} shaped;
+
+/* Keys of the composed clusters by the hash of their glyphs */
+static struct {
+        uint64_t *hashes; /* 0 for an empty slot */
+        Rune *keys;
+        size_t nb, n;
+} clusters;
+#endif
+
+/*
+ * Fallback decisions: rune | style << 21 to the index of the font in frc,
+ * or -1 for runes no font covers.
+ */
+typedef struct {
+        size_t nb; /* num buckets, a power of two */
+        size_t n;
+        uint32_t *keys;
+        int *vals;
+} Fallbackmap;
+
+static Fallbackmap fbmap;
+
+/* Resolved glyphs, see Glyphid */
+static struct {
+        Glyphid *ids;
+        uint32_t n, cap;
+        uint32_t *keys; /* rune | style << 21 */
+        uint32_t *vals; /* index in ids */
+        size_t nb, nkeys;
+        uint32_t gen;
+} gids;
+
+/* The resolved glyphs of the run being drawn, see xdrawcells() */
+static struct {
+        const Glyphid **ids;
+        uint32_t cap;
+        Encodefn encode;
+} cellrun;
+static const Glyphid nogid;
+
+#define FBPENDING       -2
+
+/* Fallback lookups handed to fallbackworker(), see xfallback() */
+typedef struct {
+        Rune u;
+        int flags;
+        Font *font; /* of the style, only its pattern and set are used */
+        unsigned int gen;
+        Font fallback; /* face is NULL if no font covers u */
+        FcPattern *match; /* instead of a face if the file was loaded already */
+} Fbjob;
+
+typedef struct {
+        int running, quit, busy;
+        unsigned int gen; /* bumped by fallbackflush() */
+        Fbjob *todo, *done;
+        size_t ntodo, todocap, ndone, donecap;
+        int pipe[2]; /* wakes up run() */
+        pthread_t thread;
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+} Fbqueue;
+
+static Fbqueue fbq = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .cond = PTHREAD_COND_INITIALIZER,
+};
+
+/*
+ * FcFontSort takes hundreds of ms with many fonts installed. The one of the
+ * regular font runs in the background after xloadfonts(), see fontsort().
+ * The other styles sort theirs on their first fallback lookup, on the
+ * fallback worker when it runs, see fcfallback().
+ */
+static struct {
+        int running;
+        pthread_t thread;
+        pthread_mutex_t lock;
+        const char *fontstr; /* to resolve the styles for the font cache */
+        FcPattern *patterns[4]; /* of the styles, the regular one is loaded */
+} sorter = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* The style fonts when known without fontconfig, see xstyleload() */
+static Fontfile stylefiles[4];
+static int stylesresolved;
+static int prewarmed; /* styles done by rasterprewarm() at this size */
+
+/* FT_New_Face and FT_Done_Face may run on the worker */
+static pthread_mutex_t ftlock = PTHREAD_MUTEX_INITIALIZER;
 static char *usedfont = NULL;
 static double usedfontsize = 0;
 static double defaultfontsize = 0;
 
 static char *opt_class = NULL;
 static char **opt_cmd  = NULL;
+static char *opt_dump  = NULL;
 static char *opt_embed = NULL;
 static char *opt_font  = NULL;
 static char *opt_io    = NULL;
 static char *opt_line  = NULL;
 static char *opt_name  = NULL;
+static char *opt_replay = NULL;
 static char *opt_title = NULL;
 
+/* Last frame reported by the headless backend */
+static struct {
+        int got;
+        unsigned int n;
+        uint64_t hash;
+        double gpums;
+} hlframe;
+
 static int oldbutton = 3; /* button event on startup: 3 = release */
+static int ttyfd; /* spawned by xinit() as soon as the window exists */
 
 void
 clipcopy(const Arg *dummy)
@@ -317,8 +771,7 @@ zoom(const Arg *arg)
 void
 zoomabs(const Arg *arg)
 {
-        xunloadfonts();
-        xloadfonts(usedfont, arg->f);
+        xzoomfonts(arg->f);
         cresize(0, 0);
         redraw();
         xhints();
@@ -341,6 +794,141 @@ ttysend(const Arg *arg)
         ttywrite(arg->s, strlen(arg->s), 1);
 }
 
+void
+latencydump(const Arg *dummy)
+{
+        pthread_mutex_lock(&lat.lock);
+        histprint(&lat.keyhist);
+        histprint(&lat.ptyhist);
+        pthread_mutex_unlock(&lat.lock);
+}
+
+void
+togglegrid(const Arg *dummy)
+{
+        gridrender = !gridrender;
+        vkgrid(gridrender);
+}
+
+/* Remember the oldest input which has not been presented yet */
+void
+latinput(int key)
+{
+        struct timespec now;
+
+        if (!latencystats)
+                return;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        pthread_mutex_lock(&lat.lock);
+        if (key && !lat.haskey) {
+                lat.key = now;
+                lat.haskey = 1;
+        } else if (!key && !lat.haspty) {
+                lat.pty = now;
+                lat.haspty = 1;
+        }
+        pthread_mutex_unlock(&lat.lock);
+}
+
+/*
+ * Called from vkflush() right before the present of id is queued, attaches
+ * the pending input to it.
+ */
+void
+latframe(uint64_t id)
+{
+        LatFrame *f;
+
+        pthread_mutex_lock(&lat.lock);
+        if (id > lat.lastid && (lat.haskey || lat.haspty)) {
+                /* Drop the oldest frame if the waiter fell behind */
+                if (lat.len == LATFRAMES) {
+                        lat.head = (lat.head + 1) % LATFRAMES;
+                        lat.len--;
+                }
+                f = &lat.frames[(lat.head + lat.len++) % LATFRAMES];
+                f->id = id;
+                f->haskey = lat.haskey;
+                f->haspty = lat.haspty;
+                f->key = lat.key;
+                f->pty = lat.pty;
+                lat.haskey = lat.haspty = 0;
+        }
+        pthread_mutex_unlock(&lat.lock);
+}
+
+/* Called from the present waiter thread, id became visible at ts */
+void
+latpresented(uint64_t id, const struct timespec *ts)
+{
+        struct timespec now = *ts;
+        LatFrame *f;
+
+        pthread_mutex_lock(&lat.lock);
+        lat.lastid = id;
+        while (lat.len > 0 && (f = &lat.frames[lat.head])->id <= id) {
+                /* Older ones timed out or were dropped on a resize */
+                if (f->id == id && f->haskey)
+                        histadd(&lat.keyhist, TIMEDIFF(now, f->key));
+                if (f->id == id && f->haspty)
+                        histadd(&lat.ptyhist, TIMEDIFF(now, f->pty));
+                lat.head = (lat.head + 1) % LATFRAMES;
+                lat.len--;
+        }
+        pthread_mutex_unlock(&lat.lock);
+}
+
+void
+histadd(Histogram *h, double ms)
+{
+        int i;
+
+        for (i = 0; i < LATBUCKETS - 1 && ms >= (double)(1 << i); i++)
+                ;
+        h->n[i]++;
+        h->count++;
+        h->sum += ms;
+        if (ms > h->max)
+                h->max = ms;
+}
+
+void
+histprint(Histogram *h)
+{
+        int i, lo, bar;
+        unsigned long peak = 0;
+
+        fprintf(stderr, "%s latency: %lu frames", h->name, h->count);
+        if (!h->count) {
+                fputc('\n', stderr);
+                return;
+        }
+        fprintf(stderr, ", avg %.2f ms, max %.2f ms\n", h->sum / h->count, h->max);
+
+        for (i = 0; i < LATBUCKETS; i++)
+                peak = MAX(peak, h->n[i]);
+        for (i = 0; i < LATBUCKETS; i++) {
+                lo = i ? 1 << (i - 1) : 0;
+                bar = (int)(40 * h->n[i] / peak);
+                if (i < LATBUCKETS - 1)
+                        fprintf(stderr, "  %4d - %4d ms %8lu |", lo, 1 << i, h->n[i]);
+                else
+                        fprintf(stderr, "  %4d+       ms %8lu |", lo, h->n[i]);
+                while (bar-- > 0)
+                        fputc('#', stderr);
+                fputc('\n', stderr);
+        }
+}
+
+/* Called on the exits from run(), never from a signal handler */
+void
+latexit(void)
+{
+        if (latencystats)
+                latencydump(NULL);
+}
+
 int
 evcol(XEvent *e)
 {
@@ -607,6 +1195,8 @@ selnotify(XEvent *e)
 void
 xclipcopy(void)
 {
+        if (!xw.dpy)
+                return;
         clipcopy(NULL);
 }
 
@@ -677,7 +1267,7 @@ selrequest(XEvent *e)
 void
 setsel(char *str, Time t)
 {
-        if (!str)
+        if (!str || !xw.dpy)
                 return;
 
         free(xsel.primary);
@@ -737,7 +1327,8 @@ cresize(int width, int height)
         tresize(col, row);
         xresize(col, row);
         ttyresize(win.tw, win.th);
-        vkresize(width, height);
+        /* Zooming passes 0, 0 to keep the window size */
+        vkresize(win.w, win.h);
 }
 
 void
@@ -789,6 +1380,21 @@ xloadcolor(int i, const char *name, Color *ncolor)
                 }
         }
 
+        if (!xw.dpy) {
+                /* headless, there is no color database */
+                unsigned int r, g, b;
+
+                if (sscanf(name, "#%2x%2x%2x", &r, &g, &b) != 3) {
+                        fprintf(stderr, "headless: can't parse color %s\n", name);
+                        r = g = b = 0;
+                }
+                ncolor->r = r;
+                ncolor->g = g;
+                ncolor->b = b;
+                ncolor->a = 0xff;
+                return;
+        }
+
         XLookupColor(xw.dpy, xw.cmap, name, &col, &dcol);
         *ncolor = rgb16_to_8(&col);
 }
@@ -834,7 +1440,7 @@ xclear(int x1, int y1, int x2, int y2)
         w = (uint16_t)(x2 - x1);
         h = (uint16_t)(y2 - y1);
         col = dc.col[IS_SET(MODE_REVERSE) ? defaultfg : defaultbg];
-        vkpushquad((uint16_t)x1, (uint16_t)y1, w, h, NOUV, NOUV, col, col);
+        vkpushquad((uint16_t)x1, (uint16_t)y1, w, h, NOUV, NOUV, col, col, 0);
 }
 
 void
@@ -888,56 +1494,71 @@ xgeommasktogravity(int mask)
         return SouthEastGravity;
 }
 
-int
-xloadfont(Font *f, FcPattern *pattern)
+/*
+ * Runs the fontconfig match of pattern. The configured pattern is returned
+ * in *configured, and whether the match lacks the wanted slant or weight.
+ */
+FcPattern *
+fcmatch(FcPattern *pattern, FcPattern **configured, int *badslant, int *badweight)
 {
-        FcPattern *configured;
         FcPattern *match;
         FcResult result;
-        int wantattr, haveattr, index, glyphidx, h;
-        char *path;
-        FT_Size_Metrics metrics;
-        FT_GlyphSlot slot;
-        FT_Bitmap bitmap;
+        int wantattr, haveattr;
 
         /*
          * Manually configure instead of calling XftMatchFont
          * so that we can use the configured pattern for
          * "missing glyph" lookups.
          */
-        configured = FcPatternDuplicate(pattern);
-        if (!configured)
-                return 1;
+        *configured = FcPatternDuplicate(pattern);
+        if (!*configured)
+                return NULL;
 
-        FcConfigSubstitute(NULL, configured, FcMatchPattern);
-        FcDefaultSubstitute(configured);
-        match = FcFontMatch(NULL, configured, &result);
+        FcConfigSubstitute(NULL, *configured, FcMatchPattern);
+        FcDefaultSubstitute(*configured);
+        match = FcFontMatch(NULL, *configured, &result);
         if (!match) {
-                fputs("sadface1\n", stderr);
-                FcPatternDestroy(configured);
-                return 1;
+                FcPatternDestroy(*configured);
+                return NULL;
         }
 
+        *badslant = *badweight = 0;
         if ((FcPatternGetInteger(pattern, "slant", 0, &wantattr) == FcResultMatch)) {
                 /*
                  * Check if xft was unable to find a font with the appropriate
                  * slant but gave us one anyway. Try to mitigate.
                  */
                 if ((FcPatternGetInteger(match, "slant", 0, &haveattr) != FcResultMatch) ||
-                                haveattr < wantattr) {
-                        f->badslant = 1;
-                        fputs("font slant does not match\n", stderr);
-                }
+                                haveattr < wantattr)
+                        *badslant = 1;
         }
 
         if ((FcPatternGetInteger(pattern, "weight", 0, &wantattr) == FcResultMatch)) {
                 if ((FcPatternGetInteger(match, "weight", 0, &haveattr) != FcResultMatch) ||
-                                haveattr != wantattr) {
-                        f->badweight = 1;
-                        fputs("font weight does not match\n", stderr);
-                }
+                                haveattr != wantattr)
+                        *badweight = 1;
         }
 
+        return match;
+}
+
+int
+xloadfont(Font *f, FcPattern *pattern)
+{
+        FcPattern *configured;
+        FcPattern *match;
+        int index;
+        char *path;
+
+        if (!(match = fcmatch(pattern, &configured, &f->badslant, &f->badweight))) {
+                fputs("sadface1\n", stderr);
+                return 1;
+        }
+        if (f->badslant)
+                fputs("font slant does not match\n", stderr);
+        if (f->badweight)
+                fputs("font weight does not match\n", stderr);
+
         if (FcPatternGetString(match, FC_FILE, 0, (FcChar8 **)&path) != FcResultMatch) {
                 fputs("failed to get font file\n", stderr);
                 return 1;
@@ -948,26 +1569,111 @@ xloadfont(Font *f, FcPattern *pattern)
                 return 1;
         }
 
+        f->pattern = configured;
+        f->configured = 1;
+        f->match = match;
+        f->charset = NULL;
+        FcPatternGetCharSet(match, FC_CHARSET, 0, &f->charset);
+
+        return xopenfont(f, path, index);
+}
+
+/*
+ * Loads a style font from a known file, pattern is kept unconfigured for
+ * the fallback lookups until fontsort() runs.
+ */
+int
+xloadfile(Font *f, FcPattern *pattern, const Fontfile *file)
+{
+        f->pattern = pattern;
+        f->configured = 0;
+        f->match = FcPatternCreate();
+        FcPatternAddString(f->match, FC_FILE, (const FcChar8 *)file->file);
+        FcPatternAddInteger(f->match, FC_INDEX, file->index);
+        f->charset = NULL;
+        f->badslant = file->badslant;
+        f->badweight = file->badweight;
+
+        return xopenfont(f, file->file, file->index);
+}
+
+int
+xopenfont(Font *f, const char *path, int index)
+{
+        Font *styles[] = { &dc.font, &dc.ifont, &dc.bfont, &dc.ibfont };
+        FT_F26Dot6 size = FONTSIZE26(sdfatlas ? sdfsize : usedfontsize);
+        int i, oindex, isstyle = 0;
+        char *opath;
+        Font *o;
+
+        /*
+         * Styles missing from the family often resolve to the regular
+         * file, they share its face and glyphs instead of loading them again.
+         */
+        for (i = 0; i < LEN(styles); i++)
+                isstyle |= f == styles[i];
+        for (i = 0; isstyle && i < LEN(styles); i++) {
+                o = styles[i];
+                if (o == f || !o->face || o->owner || o->size != size)
+                        continue;
+                if (FcPatternGetString(o->match, FC_FILE, 0, (FcChar8 **)&opath) != FcResultMatch ||
+                    strcmp(opath, path))
+                        continue;
+                if (FcPatternGetInteger(o->match, FC_INDEX, 0, &oindex) != FcResultMatch)
+                        oindex = 0;
+                if (oindex == index) {
+                        f->set = NULL;
+                        f->sizes = NULL;
+                        f->nsizes = 0;
+                        xsharefont(f, o);
+                        return 0;
+                }
+        }
+
+        pthread_mutex_lock(&ftlock);
         if (FT_New_Face(dc.ft, path, index, &f->face)) {
+                pthread_mutex_unlock(&ftlock);
                 fputs("failed to open font file\n", stderr);
                 return 1;
         }
+        pthread_mutex_unlock(&ftlock);
+
+        f->set = NULL;
+        f->size = size;
+        f->owner = NULL;
+        f->sizes = NULL;
+        f->nsizes = 0;
+        if (xfontmetrics(f)) {
+                pthread_mutex_lock(&ftlock);
+                FT_Done_Face(f->face);
+                pthread_mutex_unlock(&ftlock);
+                return 1;
+        }
+        xfontglyphs(f);
+
+        return 0;
+}
+
+/* Sets the face to f->size and measures it */
+int
+xfontmetrics(Font *f)
+{
+        int glyphidx, h;
+        FT_Size_Metrics metrics;
+        FT_GlyphSlot slot;
 
-        if (FT_Set_Char_Size(f->face, (1<<6)*font_size, 0, FONTDPI, 0)) {
+        if (FT_Set_Char_Size(f->face, f->size, 0, FONTDPI, 0)) {
                 fputs("failed to set font size\n", stderr);
                 return 1;
         }
 
         metrics = f->face->size->metrics;
-        f->pattern = configured;
-        f->set = NULL;
         f->ascent = metrics.ascender >> 6;
         f->descent = metrics.descender >> 6;
         f->height = f->ascent - f->descent;
 
         glyphidx = FT_Get_Char_Index(f->face, 'W');
-        if (FT_Load_Glyph(f->face, glyphidx, FT_LOAD_RENDER|FT_LOAD_TARGET_LIGHT)) {
-                FT_Done_Face(f->face);
+        if (FT_Load_Glyph(f->face, glyphidx, LOADFLAGS)) {
                 fputs("failed to load glyph\n", stderr);
                 return 1;
         }
@@ -979,8 +1685,7 @@ xloadfont(Font *f, FcPattern *pattern)
          * fix the font height, in case the font has an underscore glyph which
          * renders outside of the bbox */
         glyphidx = FT_Get_Char_Index(f->face, '_');
-        if (FT_Load_Glyph(f->face, glyphidx, FT_LOAD_RENDER|FT_LOAD_TARGET_LIGHT)) {
-                FT_Done_Face(f->face);
+        if (FT_Load_Glyph(f->face, glyphidx, LOADFLAGS)) {
                 fputs("failed to load glyph\n", stderr);
                 return 1;
         }
@@ -990,74 +1695,300 @@ xloadfont(Font *f, FcPattern *pattern)
         if (h > f->height)
                 f->height = h;
 
-        /* Allocate the initial cache */
+#ifdef HARFBUZZ
+        if (f->hb)
+                hb_ft_font_changed(f->hb);
+#endif
+
+        /* A distance field atlas keeps the face at sdfsize, the cells zoom */
+        f->refascent = f->ascent;
+        if (sdfatlas) {
+                f->ascent = GLYPHPX(f->ascent);
+                f->descent = GLYPHPX(f->descent);
+                f->height = GLYPHPX(f->height);
+                f->width = GLYPHPX(f->width);
+        }
+
+        return 0;
+}
+
+/* Allocates an empty glyph cache */
+void
+xfontglyphs(Font *f)
+{
+        f->table = xmalloc(glyphtablesz * sizeof *f->table);
+        memset(f->table, 0xff, glyphtablesz * sizeof *f->table);
         f->keys = xmalloc(MAPINITSZ * sizeof *f->keys);
         memset(f->keys, 0xff, MAPINITSZ * sizeof *f->keys);
         f->vals = xmalloc(MAPINITSZ * sizeof *f->vals);
         f->nb = MAPINITSZ;
         f->ng = 0;
+}
 
-        return 0;
+/* Makes f use the face and the glyph cache of o, opened from the same file */
+void
+xsharefont(Font *f, Font *o)
+{
+        f->owner = o;
+        f->face = o->face;
+        f->size = o->size;
+        f->height = o->height;
+        f->width = o->width;
+        f->ascent = o->ascent;
+        f->descent = o->descent;
+        f->refascent = o->refascent;
+}
+
+/*
+ * Switches a font to another size on the same face. The glyph cache of the
+ * old size is kept for zooming back, up to zoomsizes of them per font.
+ */
+void
+xresizefont(Font *f, FT_F26Dot6 size)
+{
+        Fontsize cur, old = { 0 };
+        int i;
+
+        if (!f->face || f->size == size)
+                return;
+        if (f->owner) {
+                xresizefont(f->owner, size);
+                xsharefont(f, f->owner);
+                return;
+        }
+
+        cur = (Fontsize){ f->size, f->table, f->keys, f->vals, f->nb, f->ng };
+        for (i = 0; i < f->nsizes && f->sizes[i].size != size; i++)
+                ;
+        if (i < f->nsizes) {
+                old = f->sizes[i];
+                f->nsizes--;
+                memmove(f->sizes + i, f->sizes + i + 1, (f->nsizes - i) * sizeof *f->sizes);
+        }
+
+        if (zoomsizes > 0) {
+                if (!f->sizes)
+                        f->sizes = xmalloc(zoomsizes * sizeof *f->sizes);
+                if (f->nsizes == zoomsizes)
+                        xfreeglyphs(f->sizes + --f->nsizes);
+                memmove(f->sizes + 1, f->sizes, f->nsizes++ * sizeof *f->sizes);
+                f->sizes[0] = cur;
+        } else {
+                xfreeglyphs(&cur);
+        }
+
+        f->size = size;
+        if (old.size) {
+                f->table = old.table;
+                f->keys = old.keys;
+                f->vals = old.vals;
+                f->nb = old.nb;
+                f->ng = old.ng;
+        } else {
+                xfontglyphs(f);
+        }
+        if (xfontmetrics(f))
+                die("can't resize font\n");
+}
+
+void
+xfreeglyphs(Fontsize *s)
+{
+        free(s->table);
+        free(s->keys);
+        free(s->vals);
 }
 
 void
 xloadfonts(char *fontstr, double fontsize)
 {
-        FcPattern *pattern;
-        double fontval;
+        Font *fonts[] = { &dc.font, &dc.ifont, &dc.bfont, &dc.ibfont };
+        FcPattern *patterns[LEN(fonts)];
+        Fontfile files[LEN(fonts)];
+        int i, resolved = 0;
 
         if (FT_Init_FreeType(&dc.ft))
                 die("can't initialize freetype\n");
 
-        pattern = FcNameParse((FcChar8 *)fontstr);
-        if (!pattern)
-                die("can't open font %s\n", fontstr);
+        /* In points, xzoomfonts() changes it later */
+        usedfontsize = fontsize > 0 ? fontsize : font_size;
+        if (fontsize == 0)
+                defaultfontsize = usedfontsize;
+        if (sdfatlas) {
+                sdfspread(dc.ft);
+                glyphscale = usedfontsize / sdfsize;
+        }
+        vkatlasscale(sdfatlas ? glyphscale : 0);
 
-        if (xloadfont(&dc.font, pattern))
+        patterns[0] = FcNameParse((FcChar8 *)fontstr);
+        if (!patterns[0])
                 die("can't open font %s\n", fontstr);
+        for (i = 1; i < LEN(fonts); i++)
+                patterns[i] = FcPatternDuplicate(patterns[0]);
+        for (i = 1; i < LEN(fonts); i++) {
+                FcPatternDel(patterns[i], FC_SLANT);
+                FcPatternAddInteger(patterns[i], FC_SLANT,
+                                    (i & 1) ? FC_SLANT_ITALIC : FC_SLANT_ROMAN);
+                if (i & 2) {
+                        FcPatternDel(patterns[i], FC_WEIGHT);
+                        FcPatternAddInteger(patterns[i], FC_WEIGHT, FC_WEIGHT_BOLD);
+                }
+        }
+
+        /* Only the regular font is loaded now, the others by xstyleload() */
+        for (i = 0; i < LEN(fonts); i++) {
+                memset(fonts[i], 0, sizeof *fonts[i]);
+                fonts[i]->pattern = patterns[i];
+        }
+
+        /* Skip fontconfig with explicit font files or a cached resolution */
+        if (fontfiles[0] && !opt_font) {
+                for (i = 0; i < LEN(fonts); i++) {
+                        snprintf(files[i].file, sizeof files[i].file, "%s",
+                                 fontfiles[i] ? fontfiles[i] : fontfiles[0]);
+                        files[i].index = 0;
+                        files[i].badslant = files[i].badweight = 0;
+                }
+                resolved = 1;
+        } else if (fontcache) {
+                resolved = !fontcacheload(fontstr, files);
+        }
+
+        memcpy(stylefiles, files, sizeof stylefiles);
+        stylesresolved = resolved;
+        if (!resolved && !FcInit())
+                die("could not init fontconfig.\n");
+        xstyleload(&dc.font, FRC_NORMAL);
+
+        /* The sorter resolves the other styles for the font cache */
+        if (!resolved && fontcache) {
+                sorter.fontstr = fontstr;
+                for (i = 1; i < LEN(fonts); i++)
+                        sorter.patterns[i] = FcPatternDuplicate(patterns[i]);
+        }
 
         /* Setting character width and height. */
         win.cw = ceilf(dc.font.width * cwscale);
         win.ch = ceilf(dc.font.height * chscale);
 
-        FcPatternDel(pattern, FC_SLANT);
-        FcPatternAddInteger(pattern, FC_SLANT, FC_SLANT_ITALIC);
-        if (xloadfont(&dc.ifont, pattern))
-                die("can't open font (italic) %s\n", fontstr);
+        if (pthread_create(&sorter.thread, NULL, fontsort, NULL)) {
+                fputs("warning: could not sort the fallback fonts in the background\n", stderr);
+                fontsort(NULL);
+        } else {
+                sorter.running = 1;
+        }
+
+        prewarmed = 0;
+        rasterprewarm();
+}
+
+/*
+ * Opens a style font on first use: most sessions never show some of the
+ * styles, which then cost neither a face nor a glyph map.
+ */
+Font *
+xstyleload(Font *f, int style)
+{
+        const char *names[] = {
+                [FRC_NORMAL] = "", [FRC_ITALIC] = " (italic)",
+                [FRC_BOLD] = " (bold)", [FRC_ITALICBOLD] = " (italic bold)",
+        };
+        FcPattern *pattern;
 
-        FcPatternDel(pattern, FC_WEIGHT);
-        FcPatternAddInteger(pattern, FC_WEIGHT, FC_WEIGHT_BOLD);
-        if (xloadfont(&dc.ibfont, pattern))
-                die("can't open font (bold) %s\n", fontstr);
+        if (f->face)
+                return f;
 
-        FcPatternDel(pattern, FC_SLANT);
-        FcPatternAddInteger(pattern, FC_SLANT, FC_SLANT_ROMAN);
-        if (xloadfont(&dc.bfont, pattern))
-                die("can't open font (bold) %s\n", fontstr);
+        if (stylesresolved) {
+                if (xloadfile(f, f->pattern, stylefiles + style))
+                        die("can't open font%s %s\n", names[style], stylefiles[style].file);
+                return f;
+        }
 
+        pattern = f->pattern;
+        if (!FcInit())
+                die("could not init fontconfig.\n");
+        if (xloadfont(f, pattern))
+                die("can't open font%s %s\n", names[style], usedfont);
         FcPatternDestroy(pattern);
+
+        return f;
 }
 
 void
 xunloadfont(Font *f)
 {
-        FT_Done_Face(f->face);
-        FcPatternDestroy(f->pattern);
+        if (!f->owner) {
+                pthread_mutex_lock(&ftlock);
+                FT_Done_Face(f->face);
+                pthread_mutex_unlock(&ftlock);
+        }
+        FcPatternDestroy(f->pattern);
+        FcPatternDestroy(f->match);
+        if (f->set)
+                FcFontSetDestroy(f->set);
+        free(f->table);
         free(f->keys);
         free(f->vals);
+        while (f->nsizes > 0)
+                xfreeglyphs(f->sizes + --f->nsizes);
+        free(f->sizes);
+#ifdef HARFBUZZ
+        if (f->hb)
+                hb_font_destroy(f->hb);
+#endif
 }
 
+/*
+ * Zooms by resizing the faces already open, the style and fallback fonts
+ * stay as they are and the glyphs of recent sizes are kept.
+ */
 void
-xunloadfonts(void)
+xzoomfonts(double fontsize)
 {
-        /* Free the loaded fonts in the font cache.  */
-        while (frclen > 0)
-                xunloadfont(&frc[--frclen].font);
+        Font *fonts[] = { &dc.font, &dc.ifont, &dc.bfont, &dc.ibfont };
+        FT_F26Dot6 size;
+        Font *f;
+        size_t i;
+
+        if (fontsize <= 0)
+                return;
+
+        /* Lookups in flight would open their faces at the old size */
+        fallbackflush();
+        for (i = 0; i < fbmap.nb; i++) {
+                if (fbmap.keys[i] != NOKEY && fbmap.vals[i] == FBPENDING)
+                        fbmap.vals[i] = INT_MIN;
+        }
+        rastercollect(1);
+
+        usedfontsize = fontsize;
+        size = FONTSIZE26(fontsize);
+        if (sdfatlas) {
+                glyphscale = fontsize / sdfsize;
+                vkatlasscale(glyphscale);
+        }
+        for (i = 0; i < LEN(fonts) + frclen; i++) {
+                f = i < LEN(fonts) ? fonts[i] : &frc[i - LEN(fonts)].font;
+                /* The distance fields only scale, the faces keep their size */
+                if (sdfatlas && f->face)
+                        xfontmetrics(f);
+                else
+                        xresizefont(f, size);
+        }
+
+        win.cw = ceilf(dc.font.width * cwscale);
+        win.ch = ceilf(dc.font.height * chscale);
+
+        /* The procedural glyphs were drawn for the old cell size */
+        xforgetglyphs(&boxfont);
+        gidflush();
+#ifdef HARFBUZZ
+        shapeflush();
+#endif
 
-        xunloadfont(&dc.font);
-        xunloadfont(&dc.bfont);
-        xunloadfont(&dc.ifont);
-        xunloadfont(&dc.ibfont);
+        /* The glyph cache is keyed by the size, a zoom may hit it too */
+        prewarmed = 0;
+        rasterprewarm();
 }
 
 int
@@ -1127,12 +2058,20 @@ xinit(int cols, int rows)
         xw.scr = XDefaultScreen(xw.dpy);
         xw.vis = XDefaultVisual(xw.dpy, xw.scr);
 
-        /* font */
-        if (!FcInit())
-                die("could not init fontconfig.\n");
+        /* The device and pipelines need no window, they are made meanwhile */
+        if (latencystats)
+                vkpresentcb(latframe, latpresented);
+        vksoftware(softrender);
+        vkgrid(gridrender);
+        vkprepare(xw.dpy);
 
+        /* font */
+        if (rasterthreads >= 0)
+                rasterstart();
         usedfont = (opt_font == NULL)? font : opt_font;
         xloadfonts(usedfont, 0);
+        if (asyncfallback)
+                fallbackstart();
 
         /* colors */
         xw.cmap = XDefaultColormap(xw.dpy, xw.scr);
@@ -1159,6 +2098,11 @@ xinit(int cols, int rows)
                         win.w, win.h, 0, XDefaultDepth(xw.dpy, xw.scr), InputOutput,
                         xw.vis, CWBitGravity | CWEventMask | CWColormap, &xw.attrs);
 
+        /* The shell starts up while the window maps and the swapchain is made */
+        xsetenv();
+        ttyfd = ttynew(opt_line, shell, opt_io, opt_cmd);
+        ttyresize(cols * win.cw, rows * win.ch);
+
         /* TODO: Clear the screen */
 
         /* input methods */
@@ -1202,7 +2146,7 @@ xinit(int cols, int rows)
         XSync(xw.dpy, False);
 
         if (vkinit(xw.dpy, xw.win, win.w, win.h))
-                die("can't initialize vulkan");
+                die("can't initialize the renderer");
 
         clock_gettime(CLOCK_MONOTONIC, &xsel.tclick1);
         clock_gettime(CLOCK_MONOTONIC, &xsel.tclick2);
@@ -1213,298 +2157,2318 @@ xinit(int cols, int rows)
                 xsel.xtarget = XA_STRING;
 }
 
+/*
+ * Fibonacci hashing: runes come in dense blocks, which a plain modulo maps
+ * to long runs of neighbouring buckets.
+ */
+size_t
+runehash(Rune u, size_t nb)
+{
+        uint32_t h = u * 0x9e3779b1u;
+
+        return (h ^ h >> 16) & (nb - 1);
+}
+
+void
+rehash(Font *f)
+{
+        size_t i, nb, idx;
+        Rune *newkeys;
+        GlyphSpec *newvals, *val;
+
+        nb = f->nb*2;
+        newkeys = xmalloc(nb * sizeof *newkeys);
+        memset(newkeys, 0xff, nb * sizeof *newkeys);
+        newvals = xmalloc(nb * sizeof *newvals);
+
+        /* NOTE: This loop could be faster with an early-exit */
+        for (i = 0; i < f->nb; i++) {
+                if (f->keys[i] == NOKEY)
+                        continue;
+
+                idx = runehash(f->keys[i], nb);
+                while (newkeys[idx] != NOKEY)
+                        idx = (idx+1) & (nb-1);
+
+                newkeys[idx] = f->keys[i];
+                newvals[idx] = f->vals[i];
+        }
+
+        free(f->keys);
+        free(f->vals);
+        f->keys = newkeys;
+        f->vals = newvals;
+        f->nb = nb;
+}
+
+/* Returns the cached glyph, NULL if it is not loaded yet */
+GlyphSpec *
+lookupglyph(Font *f, Rune u)
+{
+        size_t idx;
+
+        if (f->owner)
+                f = f->owner;
+        if (u < glyphtablesz)
+                return f->table[u].uvx != NOUV ? f->table + u : NULL;
+
+        idx = runehash(u, f->nb);
+        while (f->keys[idx] != NOKEY && f->keys[idx] != u)
+                idx = (idx+1) & (f->nb-1);
+
+        return f->keys[idx] != NOKEY ? f->vals + idx : NULL;
+}
+
+/*
+ * Puts a rendered glyph into the atlas and the cache of f. With o, the
+ * bitmap only gives the size of the box the raster shader fills from the
+ * outline, NULL is returned without atlasfull if it cannot take it.
+ */
+GlyphSpec *
+storeglyph(Font *f, Rune u, const FT_Bitmap *bitmap, int left, int top, const Outline *o)
+{
+        size_t idx = 0;
+        int r;
+        float occ;
+        GlyphSpec *spec;
+
+        if (f->owner)
+                f = f->owner;
+        if (u < glyphtablesz) {
+                spec = f->table + u;
+        } else {
+                occ = (float)f->ng / (float)f->nb;
+                if (occ > 0.75f)
+                        rehash(f);
+                idx = runehash(u, f->nb);
+                while (f->keys[idx] != NOKEY && f->keys[idx] != u)
+                        idx = (idx+1) & (f->nb-1);
+                spec = f->vals + idx;
+        }
+
+        /* Only the bitmap goes to the atlas, the cell around it does not */
+        if (o) {
+                r = outlineatlas(&spec->uvx, &spec->uvy, bitmap->width, bitmap->rows,
+                                 o->seg, o->n);
+        } else {
+                r = blitatlas(&spec->uvx, &spec->uvy, bitmap->width, bitmap->rows,
+                              bitmap->pitch, bitmap->buffer);
+        }
+        if (r < 0)
+                return NULL;
+        if (r) {
+                /* Missing until the atlas starts over after this frame */
+                if (!atlasfull)
+                        fputs("font atlas is full, starting over\n", stderr);
+                atlasfull = 1;
+                return NULL;
+        }
+
+        /* From the cell origin, y down, in atlas pixels */
+        spec->w = bitmap->width;
+        spec->h = bitmap->rows;
+        spec->offx = left;
+        spec->offy = f->refascent - top;
+        if (u >= glyphtablesz) {
+                f->keys[idx] = u;
+                f->ng++;
+        }
+
+        return spec;
+}
+
+GlyphSpec *
+getglyphspec(Font *f, Rune u)
+{
+        FT_UInt glyphidx;
+        GlyphSpec *spec;
+
+        if ((spec = lookupglyph(f, u)))
+                return spec;
+
+        /* Not cached, load glyph. Missing ones come from xfallback() */
+        glyphidx = FT_Get_Char_Index(f->face, u);
+        if (glyphidx == 0)
+                return NULL;
+
+        return loadglyph(f, u, glyphidx);
+}
+
+/* Renders glyph glyphidx of f into the atlas, cached under key */
+GlyphSpec *
+loadglyph(Font *f, Rune key, FT_UInt glyphidx)
+{
+        FT_Bitmap bitmap;
+        GlyphSpec *spec;
+        int left, top;
+
+        if (gpuoutlines() && ((spec = outlineglyph(f, key, glyphidx)) || atlasfull))
+                return spec;
+
+        if (renderglyph(f->face, glyphidx)) {
+                fputs("freetype load glyph error\n", stderr);
+                return NULL;
+        }
+        glyphbitmap(f->face->glyph, &bitmap, &left, &top);
+
+        return storeglyph(f, key, &bitmap, left, top, NULL);
+}
+
+/* Whether glyphs go to the raster shader as outlines, see outlineglyph() */
+int
+gpuoutlines(void)
+{
+        return gpuraster && !sdfatlas && vkoutlines();
+}
+
+void
+outlinept(Outline *o, const FT_Vector *v, float *x, float *y)
+{
+        *x = v->x / 64.0f - o->left;
+        *y = o->top - v->y / 64.0f;
+}
+
+/* Adds a segment from the pen to x, y */
+void
+outlineseg(Outline *o, float x, float y)
+{
+        float *s;
+
+        /* Horizontal segments cover nothing, see raster.glsl */
+        if (y != o->y) {
+                if (o->n == o->cap) {
+                        o->cap = o->cap ? o->cap*2 : 256;
+                        o->seg = xrealloc(o->seg, o->cap * 4*sizeof *o->seg);
+                }
+                s = o->seg + 4*o->n++;
+                s[0] = o->x;
+                s[1] = o->y;
+                s[2] = x;
+                s[3] = y;
+        }
+        o->x = x;
+        o->y = y;
+}
+
+int
+outlinemove(const FT_Vector *to, void *user)
+{
+        Outline *o = user;
+
+        outlinept(o, to, &o->x, &o->y);
+        return 0;
+}
+
+int
+outlineline(const FT_Vector *to, void *user)
+{
+        Outline *o = user;
+        float x, y;
+
+        outlinept(o, to, &x, &y);
+        outlineseg(o, x, y);
+        return 0;
+}
+
+int
+outlineconic(const FT_Vector *control, const FT_Vector *to, void *user)
+{
+        Outline *o = user;
+        float x0 = o->x, y0 = o->y, cx, cy, x, y, t, mt, d;
+        int i, n;
+
+        outlinept(o, control, &cx, &cy);
+        outlinept(o, to, &x, &y);
+
+        /* A chord of 1/n of the curve is off by at most |p0 - 2c + p1| / 4n^2 */
+        d = hypotf(x0 - 2*cx + x, y0 - 2*cy + y);
+        n = MAX(1, MIN(CURVESTEPS, (int)ceilf(sqrtf(d / (4*CURVETOL)))));
+        for (i = 1; i <= n; i++) {
+                t = (float)i / n;
+                mt = 1 - t;
+                outlineseg(o, mt*mt*x0 + 2*mt*t*cx + t*t*x,
+                              mt*mt*y0 + 2*mt*t*cy + t*t*y);
+        }
+        return 0;
+}
+
+int
+outlinecubic(const FT_Vector *control1, const FT_Vector *control2, const FT_Vector *to, void *user)
+{
+        Outline *o = user;
+        float x0 = o->x, y0 = o->y, ax, ay, bx, by, x, y, t, mt, d;
+        int i, n;
+
+        outlinept(o, control1, &ax, &ay);
+        outlinept(o, control2, &bx, &by);
+        outlinept(o, to, &x, &y);
+
+        d = MAX(hypotf(x0 - 2*ax + bx, y0 - 2*ay + by),
+                hypotf(ax - 2*bx + x, ay - 2*by + y));
+        n = MAX(1, MIN(CURVESTEPS, (int)ceilf(sqrtf(3*d / (4*CURVETOL)))));
+        for (i = 1; i <= n; i++) {
+                t = (float)i / n;
+                mt = 1 - t;
+                outlineseg(o, mt*mt*mt*x0 + 3*mt*mt*t*ax + 3*mt*t*t*bx + t*t*t*x,
+                              mt*mt*mt*y0 + 3*mt*mt*t*ay + 3*mt*t*t*by + t*t*t*y);
+        }
+        return 0;
+}
+
+/*
+ * Hands the hinted outline of a glyph to the raster shader instead of
+ * rendering it. NULL if it has to be rendered after all: bitmap glyphs,
+ * or too many outlines for this frame.
+ */
+GlyphSpec *
+outlineglyph(Font *f, Rune u, FT_UInt glyphidx)
+{
+        static const FT_Outline_Funcs funcs = {
+                outlinemove, outlineline, outlineconic, outlinecubic, 0, 0
+        };
+        FT_GlyphSlot slot = f->face->glyph;
+        FT_Bitmap box = {0};
+        FT_BBox cbox;
+
+        if (FT_Load_Glyph(f->face, glyphidx, (LOADFLAGS & ~FT_LOAD_RENDER)|FT_LOAD_NO_BITMAP) ||
+            slot->format != FT_GLYPH_FORMAT_OUTLINE)
+                return NULL;
+
+        /* The box FreeType would render, whole pixels around the control points */
+        FT_Outline_Get_CBox(&slot->outline, &cbox);
+        outline.left = (int)((cbox.xMin & -64) / 64);
+        outline.top = (int)(((cbox.yMax + 63) & -64) / 64);
+        box.width = (unsigned int)(((cbox.xMax + 63) & -64) / 64 - outline.left);
+        box.rows = (unsigned int)(outline.top - (cbox.yMin & -64) / 64);
+
+        outline.n = 0;
+        if (FT_Outline_Decompose(&slot->outline, &funcs, &outline))
+                return NULL;
+
+        return storeglyph(f, u, &box, outline.left, outline.top, &outline);
+}
+
+/*
+ * Renders a glyph into the slot of face. With sdfatlas it is a distance
+ * field at sdfsize, which the shaders scale by glyphscale.
+ */
+int
+renderglyph(FT_Face face, FT_UInt glyphidx)
+{
+        FT_GlyphSlot slot = face->glyph;
+
+        if (!sdfatlas)
+                return FT_Load_Glyph(face, glyphidx, LOADFLAGS) != 0;
+
+        if (FT_Load_Glyph(face, glyphidx, FT_LOAD_NO_HINTING))
+                return 1;
+        /* Blanks have nothing to render, their bitmap is empty */
+        if (slot->format == FT_GLYPH_FORMAT_OUTLINE && slot->outline.n_points == 0)
+                return 0;
+
+        return FT_Render_Glyph(slot, FT_RENDER_MODE_SDF) != 0;
+}
+
+/*
+ * The part of the rendered glyph which goes to the atlas. Most of the
+ * spread around a distance field lies in the neighbouring cells, where
+ * the quad would paint over them, only SDFMARGIN of it is kept.
+ */
+void
+glyphbitmap(FT_GlyphSlot slot, FT_Bitmap *b, int *left, int *top)
+{
+        int c;
+
+        *b = slot->bitmap;
+        *left = slot->bitmap_left;
+        *top = slot->bitmap_top;
+        if (!sdfatlas)
+                return;
+
+        c = MIN(SDFSPREAD - SDFMARGIN, (int)MIN(b->width, b->rows) / 2);
+        if (c <= 0)
+                return;
+        b->buffer += c*b->pitch + c;
+        b->width -= 2*c;
+        b->rows -= 2*c;
+        *left += c;
+        *top -= c;
+}
+
+/* Sets the distance field spread of both FreeType SDF renderers */
+void
+sdfspread(FT_Library ft)
+{
+        FT_Int spread = SDFSPREAD;
+
+        FT_Property_Set(ft, "sdf", "spread", &spread);
+        FT_Property_Set(ft, "bsdf", "spread", &spread);
+}
+
+void
+xglyphcolors(Glyph *g, Color *fgp, Color *bgp)
+{
+        Font *font;
+        int frcflags;
+
+        font = xstylefont(g, &frcflags);
+        xcellcolors(g, (g->mode & ATTR_ITALIC && font->badslant) ||
+                       (g->mode & ATTR_BOLD && font->badweight), fgp, bgp);
+}
+
+/* The colors of g, plainfg if its style font lacks the slant or weight */
+void
+xcellcolors(const Glyph *g, int plainfg, Color *fgp, Color *bgp)
+{
+        uint32_t gfg = plainfg ? defaultattr : g->fg;
+        Color fg, bg, tmp;
+
+        if (IS_TRUECOL(gfg)) {
+                fg.r = TRUERED(gfg);
+                fg.g = TRUEGREEN(gfg);
+                fg.b = TRUEBLUE(gfg);
+                fg.a = 0xff;
+        } else {
+                fg = dc.col[gfg];
+        }
+
+        if (IS_TRUECOL(g->bg)) {
+                bg.r = TRUERED(g->bg);
+                bg.g = TRUEGREEN(g->bg);
+                bg.b = TRUEBLUE(g->bg);
+                bg.a = 0xff;
+        } else {
+                bg = dc.col[g->bg];
+        }
+
+        if ((g->mode & ATTR_BOLD_FAINT) == ATTR_BOLD && BETWEEN(gfg, 0, 7))
+                fg = dc.col[gfg + 8];
+
+        if (IS_SET(MODE_REVERSE)) {
+                if (COLOREQ(fg, dc.col[defaultfg])) {
+                        fg = dc.col[defaultbg];
+                } else {
+                        fg.r = ~fg.r;
+                        fg.g = ~fg.g;
+                        fg.b = ~fg.b;
+                }
+
+                if (COLOREQ(bg, dc.col[defaultbg])) {
+                        bg = dc.col[defaultfg];
+                } else {
+                        bg.r = ~bg.r;
+                        bg.g = ~bg.g;
+                        bg.b = ~bg.b;
+                }
+        }
+
+        if ((g->mode & ATTR_BOLD_FAINT) == ATTR_FAINT) {
+                fg.r /= 2;
+                fg.g /= 2;
+                fg.b /= 2;
+        }
+
+        if (g->mode & ATTR_REVERSE) {
+                tmp = fg;
+                fg = bg;
+                bg = tmp;
+        }
+
+        if (g->mode & ATTR_INVISIBLE)
+                fg = bg;
+
+        *fgp = fg;
+        *bgp = bg;
+}
+
+/* Returns the font of the style of g, and its FRC_ flags */
+Font *
+xstylefont(Glyph *g, int *frcflags)
+{
+        if ((g->mode & ATTR_ITALIC) && (g->mode & ATTR_BOLD)) {
+                *frcflags = FRC_ITALICBOLD;
+                return xstyleload(&dc.ibfont, FRC_ITALICBOLD);
+        } else if (g->mode & ATTR_ITALIC) {
+                *frcflags = FRC_ITALIC;
+                return xstyleload(&dc.ifont, FRC_ITALIC);
+        } else if (g->mode & ATTR_BOLD) {
+                *frcflags = FRC_BOLD;
+                return xstyleload(&dc.bfont, FRC_BOLD);
+        }
+        *frcflags = FRC_NORMAL;
+        return &dc.font;
+}
+
+/*
+ * Looks up the glyph in the font matching its attributes, loading a
+ * fallback font if needed. Sets *fontp to the font the glyph came from.
+ */
+GlyphSpec *
+xglyphspec(Glyph *g, Font **fontp)
+{
+        Font *font;
+        int j, frcflags;
+        GlyphSpec *spec;
+
+        font = xstylefont(g, &frcflags);
+        *fontp = font;
+
+        if (useboxdraw(g->u))
+                return boxglyph(g->u);
+        if ((spec = getglyphspec(font, g->u)))
+                return spec;
+
+        /* Also FBPENDING, the cell is drawn with its background only */
+        if ((j = xfallback(font, frcflags, g->u)) < 0)
+                return NULL;
+        *fontp = &frc[j].font;
+
+        return getglyphspec(&frc[j].font, g->u);
+}
+
+/*
+ * The handle of the glyph of u in the style of mode, for tsetchar() to
+ * store in the cell, or 0 if it was not resolved yet.
+ */
+ushort
+xglyphid(Rune u, ushort mode)
+{
+        uint32_t *slot;
+
+        /* Every printed rune comes here, only xcellglyph() adds keys */
+        slot = gidfind(u | (uint32_t)CELLSTYLE(mode) << 21);
+
+        return slot && *slot != UINT32_MAX ? gids.gen << GIDBITS | (*slot + 1) : 0;
+}
+
+/*
+ * Returns the resolved glyph of the cell g. A stale handle is resolved
+ * again and stored back, NULL if g has no glyph right now.
+ */
+Glyphid *
+xcellglyph(Glyph *g)
+{
+        uint32_t i = (g->gid & GIDMASK) - 1, *slot;
+        int style = CELLSTYLE(g->mode);
+        GlyphSpec *spec;
+        Glyphid *id;
+        Font *font;
+
+        /* The rune and style tell a handle of another generation apart */
+        if (g->gid >> GIDBITS == gids.gen && i < gids.n) {
+                id = gids.ids + i;
+                if (id->u == g->u && id->style == style)
+                        return id;
+        }
+
+        if (gids.n == GIDMASK)
+                gidflush();
+        slot = gidslot(g->u | (uint32_t)style << 21);
+        if (*slot == UINT32_MAX) {
+                /* Pending fallbacks and a full atlas are tried again */
+                if (!(spec = xglyphspec(g, &font)))
+                        return NULL;
+                if (gids.n == gids.cap) {
+                        gids.cap = gids.cap ? gids.cap*2 : 256;
+                        gids.ids = xrealloc(gids.ids, gids.cap * sizeof *gids.ids);
+                }
+                id = gids.ids + gids.n;
+                id->u = g->u;
+                id->style = style;
+                id->dx = GLYPHPX(spec->offx);
+                id->dy = GLYPHPX(spec->offy);
+                id->w = spec->w && spec->h ? GLYPHPX(spec->w) : 0;
+                id->h = spec->w && spec->h ? GLYPHPX(spec->h) : 0;
+                id->uvx = spec->uvx;
+                id->uvy = spec->uvy;
+                *slot = gids.n++;
+        }
+        g->gid = (ushort)(gids.gen << GIDBITS | (*slot + 1));
+
+        return gids.ids + *slot;
+}
+
+/* Returns the slot of key in the map of gids, UINT32_MAX while unset */
+uint32_t *
+gidslot(uint32_t key)
+{
+        size_t i, idx, nb;
+        uint32_t *newkeys, *newvals;
+
+        if (gids.nkeys >= gids.nb * 3 / 4) {
+                nb = gids.nb ? gids.nb*2 : MAPINITSZ;
+                newkeys = xmalloc(nb * sizeof *newkeys);
+                memset(newkeys, 0xff, nb * sizeof *newkeys);
+                newvals = xmalloc(nb * sizeof *newvals);
+                for (i = 0; i < gids.nb; i++) {
+                        if (gids.keys[i] == NOKEY)
+                                continue;
+                        idx = runehash(gids.keys[i], nb);
+                        while (newkeys[idx] != NOKEY)
+                                idx = (idx+1) & (nb-1);
+                        newkeys[idx] = gids.keys[i];
+                        newvals[idx] = gids.vals[i];
+                }
+                free(gids.keys);
+                free(gids.vals);
+                gids.keys = newkeys;
+                gids.vals = newvals;
+                gids.nb = nb;
+        }
+
+        idx = runehash(key, gids.nb);
+        while (gids.keys[idx] != NOKEY && gids.keys[idx] != key)
+                idx = (idx+1) & (gids.nb-1);
+        if (gids.keys[idx] == NOKEY) {
+                gids.keys[idx] = key;
+                gids.vals[idx] = UINT32_MAX;
+                gids.nkeys++;
+        }
+
+        return gids.vals + idx;
+}
+
+/* Returns the slot of key in the map of gids, NULL if it was never added */
+uint32_t *
+gidfind(uint32_t key)
+{
+        size_t idx;
+
+        if (!gids.nb)
+                return NULL;
+        idx = runehash(key, gids.nb);
+        while (gids.keys[idx] != NOKEY) {
+                if (gids.keys[idx] == key)
+                        return gids.vals + idx;
+                idx = (idx+1) & (gids.nb-1);
+        }
+
+        return NULL;
+}
+
+/* Invalidates every handle, the glyphs moved in the atlas or changed size */
+void
+gidflush(void)
+{
+        gids.gen = (gids.gen + 1) & GIDGENMASK;
+        gids.n = gids.nkeys = 0;
+        if (gids.keys)
+                memset(gids.keys, 0xff, gids.nb * sizeof *gids.keys);
+}
+
+/* Whether u is drawn by drawbox() rather than taken from the fonts */
+int
+useboxdraw(Rune u)
+{
+        return boxdraw && !sdfatlas && isboxdraw(u);
+}
+
+/*
+ * The glyph of u drawn to the exact cell size, the same in every style.
+ * It never needs a font, so TUI borders and plots do not fall back.
+ */
+GlyphSpec *
+boxglyph(Rune u)
+{
+        static uint8_t *buf;
+        static size_t bufsz;
+        FT_Bitmap bitmap = {0};
+        GlyphSpec *spec;
+        size_t sz = (size_t)win.cw * win.ch;
+
+        if (!boxfont.table)
+                xfontglyphs(&boxfont);
+        if ((spec = lookupglyph(&boxfont, u)))
+                return spec;
+
+        if (bufsz < sz) {
+                bufsz = sz;
+                buf = xrealloc(buf, bufsz);
+        }
+        drawbox(u, buf, win.cw, win.ch);
+
+        bitmap.width = win.cw;
+        bitmap.rows = win.ch;
+        bitmap.pitch = win.cw;
+        bitmap.buffer = buf;
+
+        return storeglyph(&boxfont, u, &bitmap, 0, boxfont.refascent, NULL);
+}
+
+/* Returns the slot of key in fbmap, *slot is INT_MIN while unset */
+int *
+fallbackslot(uint32_t key)
+{
+        size_t i, idx, nb;
+        uint32_t *newkeys;
+        int *newvals;
+
+        if (fbmap.n >= fbmap.nb * 3 / 4) {
+                nb = fbmap.nb ? fbmap.nb*2 : MAPINITSZ;
+                newkeys = xmalloc(nb * sizeof *newkeys);
+                memset(newkeys, 0xff, nb * sizeof *newkeys);
+                newvals = xmalloc(nb * sizeof *newvals);
+                for (i = 0; i < fbmap.nb; i++) {
+                        if (fbmap.keys[i] == NOKEY)
+                                continue;
+                        idx = runehash(fbmap.keys[i], nb);
+                        while (newkeys[idx] != NOKEY)
+                                idx = (idx+1) & (nb-1);
+                        newkeys[idx] = fbmap.keys[i];
+                        newvals[idx] = fbmap.vals[i];
+                }
+                free(fbmap.keys);
+                free(fbmap.vals);
+                fbmap.keys = newkeys;
+                fbmap.vals = newvals;
+                fbmap.nb = nb;
+        }
+
+        idx = runehash(key, fbmap.nb);
+        while (fbmap.keys[idx] != NOKEY && fbmap.keys[idx] != key)
+                idx = (idx+1) & (fbmap.nb-1);
+        if (fbmap.keys[idx] == NOKEY) {
+                fbmap.keys[idx] = key;
+                fbmap.vals[idx] = INT_MIN;
+                fbmap.n++;
+        }
+
+        return fbmap.vals + idx;
+}
+
+/*
+ * Finds the fallback font for a rune missing from the font of its style.
+ * The decision is cached, including for runes no font covers, so each
+ * rune costs at most one fontconfig query and one face per file. With the
+ * worker running, unknown runes return FBPENDING until it has decided.
+ */
+int
+xfallback(Font *font, int frcflags, Rune u)
+{
+        int *slot, j;
+
+        slot = fallbackslot(u | (uint32_t)frcflags << 21);
+        if (*slot != INT_MIN)
+                return *slot;
+
+        for (j = 0; j < frclen; j++) {
+                if (frc[j].flags == frcflags && frc[j].font.charset &&
+                    FcCharSetHasChar(frc[j].font.charset, u))
+                        break;
+        }
+        if (j < frclen) {
+                *slot = j;
+        } else if (fbq.running) {
+                /* Drawn as a placeholder until fallbackdone() */
+                pthread_mutex_lock(&fbq.lock);
+                if (fbq.ntodo == fbq.todocap) {
+                        fbq.todocap = fbq.todocap ? fbq.todocap*2 : 16;
+                        fbq.todo = xrealloc(fbq.todo, fbq.todocap * sizeof *fbq.todo);
+                }
+                fbq.todo[fbq.ntodo++] = (Fbjob){ .u = u, .flags = frcflags, .font = font, .gen = fbq.gen };
+                pthread_cond_signal(&fbq.cond);
+                pthread_mutex_unlock(&fbq.lock);
+                *slot = FBPENDING;
+        } else {
+                /* xloadfallback() leaves fbmap alone, slot is still valid */
+                *slot = xloadfallback(font, frcflags, u);
+        }
+
+        return *slot;
+}
+
+/* Asks fontconfig for a font covering u, NULL if there is none */
+FcPattern *
+fcfallback(Font *font, Rune u)
+{
+        FcResult fcres;
+        FcPattern *fcpattern, *fontpattern;
+        FcFontSet *fcsets[] = { NULL };
+        FcCharSet *fccharset, *cs;
+
+        fontsortwait();
+        fcconfigure(font);
+        if (!font->set)
+                font->set = FcFontSort(0, font->pattern,
+                                       1, 0, &fcres);
+        fcsets[0] = font->set;
+
+        fcpattern = FcPatternDuplicate(font->pattern);
+        fccharset = FcCharSetCreate();
+
+        FcCharSetAddChar(fccharset, u);
+        FcPatternAddCharSet(fcpattern, FC_CHARSET,
+                        fccharset);
+        FcPatternAddBool(fcpattern, FC_SCALABLE, 1);
+
+        FcConfigSubstitute(0, fcpattern,
+                        FcMatchPattern);
+        FcDefaultSubstitute(fcpattern);
+
+        fontpattern = FcFontSetMatch(0, fcsets, 1,
+                        fcpattern, &fcres);
+        FcPatternDestroy(fcpattern);
+        FcCharSetDestroy(fccharset);
+        if (!fontpattern)
+                return NULL;
+
+        /* The best match does not necessarily cover the rune */
+        if (FcPatternGetCharSet(fontpattern, FC_CHARSET, 0, &cs) != FcResultMatch ||
+            !FcCharSetHasChar(cs, u)) {
+                FcPatternDestroy(fontpattern);
+                return NULL;
+        }
+
+        return fontpattern;
+}
+
+void *
+fontsort(void *arg)
+{
+        FcPattern *configured, *match;
+        Fontfile files[LEN(sorter.patterns)];
+        FcResult fcres;
+        size_t i, n = 1;
+        int err;
+
+        /* Not done yet if the regular font did not need fontconfig */
+        if (!FcInit()) {
+                fputs("warning: could not init fontconfig, no fallback fonts\n", stderr);
+                return NULL;
+        }
+        fcconfigure(&dc.font);
+        dc.font.set = FcFontSort(0, dc.font.pattern, 1, 0, &fcres);
+
+        /*
+         * The other styles are loaded on first use, but the font cache
+         * has them all for the next start.
+         */
+        if (!sorter.fontstr)
+                return NULL;
+        if (!fontfile(files, dc.font.match, dc.font.badslant, dc.font.badweight)) {
+                for (; n < LEN(files); n++) {
+                        if (!(match = fcmatch(sorter.patterns[n], &configured,
+                                              &files[n].badslant, &files[n].badweight)))
+                                break;
+                        err = fontfile(files + n, match, files[n].badslant, files[n].badweight);
+                        FcPatternDestroy(configured);
+                        FcPatternDestroy(match);
+                        if (err)
+                                break;
+                }
+        }
+        if (n == LEN(files))
+                fontcachesave(sorter.fontstr, files);
+        for (i = 1; i < LEN(files); i++)
+                FcPatternDestroy(sorter.patterns[i]);
+        sorter.fontstr = NULL;
+
+        return NULL;
+}
+
+/* Substitutes the pattern of a font loaded without fontconfig */
+void
+fcconfigure(Font *f)
+{
+        if (f->configured)
+                return;
+        FcConfigSubstitute(NULL, f->pattern, FcMatchPattern);
+        FcDefaultSubstitute(f->pattern);
+        f->configured = 1;
+}
+
+/* Waits for fontsort(), only blocks if the first fallback comes early */
+void
+fontsortwait(void)
+{
+        pthread_mutex_lock(&sorter.lock);
+        if (sorter.running) {
+                pthread_join(sorter.thread, NULL);
+                sorter.running = 0;
+        }
+        pthread_mutex_unlock(&sorter.lock);
+}
+
+/* Whether the fonts of a and b come from the same face of the same file */
+int
+samefile(FcPattern *a, FcPattern *b)
+{
+        int ia, ib;
+        char *fa, *fb;
+
+        if (FcPatternGetString(a, FC_FILE, 0, (FcChar8 **)&fa) != FcResultMatch ||
+            FcPatternGetString(b, FC_FILE, 0, (FcChar8 **)&fb) != FcResultMatch ||
+            FcPatternGetInteger(b, FC_INDEX, 0, &ib) != FcResultMatch)
+                return 0;
+        if (FcPatternGetInteger(a, FC_INDEX, 0, &ia) != FcResultMatch)
+                ia = 0;
+
+        return ia == ib && !strcmp(fa, fb);
+}
+
+/*
+ * Returns the index of the fallback font loaded from the file of pattern, or -1.
+ * With the worker running frc only changes under fbq.lock.
+ */
+int
+frcfind(FcPattern *pattern)
+{
+        int j;
+
+        for (j = 0; j < frclen; j++) {
+                if (samefile(pattern, frc[j].font.match))
+                        return j;
+        }
+
+        return -1;
+}
+
+/* Appends a free slot to frc */
+Font *
+frcnew(int frcflags)
+{
+        if (frclen >= frccap) {
+                frccap += 16;
+                frc = xrealloc(frc, frccap * sizeof(Fontcache));
+        }
+        memset(&frc[frclen].font, 0, sizeof frc[frclen].font);
+        frc[frclen].flags = frcflags;
+
+        return &frc[frclen].font;
+}
+
+/*
+ * Asks fontconfig for a font covering u, returns its index in frc or -1.
+ * A font file which is already loaded is not opened again.
+ */
+int
+xloadfallback(Font *font, int frcflags, Rune u)
+{
+        int j;
+        FcPattern *fontpattern;
+
+        if (!(fontpattern = fcfallback(font, u)))
+                return -1;
+
+        if ((j = frcfind(fontpattern)) < 0) {
+                if (xloadfont(frcnew(frcflags), fontpattern))
+                        die("Failed to load fallback font");
+                j = frclen++;
+        }
+        FcPatternDestroy(fontpattern);
+
+        return j;
+}
+
+/*
+ * Runs the fontconfig search and the face load of fallback fonts, which
+ * take tens of ms for a new script, off the render path.
+ */
+void *
+fallbackworker(void *arg)
+{
+        FcPattern *fontpattern;
+        Fbjob job;
+        int loaded;
+
+        pthread_mutex_lock(&fbq.lock);
+        for (;;) {
+                while (!fbq.ntodo && !fbq.quit)
+                        pthread_cond_wait(&fbq.cond, &fbq.lock);
+                if (fbq.quit)
+                        break;
+                job = fbq.todo[0];
+                memmove(fbq.todo, fbq.todo + 1, --fbq.ntodo * sizeof *fbq.todo);
+                fbq.busy = 1;
+                pthread_mutex_unlock(&fbq.lock);
+
+                memset(&job.fallback, 0, sizeof job.fallback);
+                job.match = NULL;
+                if ((fontpattern = fcfallback(job.font, job.u))) {
+                        /* Runes of one script mostly match the same file */
+                        pthread_mutex_lock(&fbq.lock);
+                        loaded = frcfind(fontpattern) >= 0 || fallbackqueued(fontpattern);
+                        pthread_mutex_unlock(&fbq.lock);
+                        if (loaded) {
+                                job.match = fontpattern;
+                        } else {
+                                if (xloadfont(&job.fallback, fontpattern))
+                                        job.fallback.face = NULL;
+                                FcPatternDestroy(fontpattern);
+                        }
+                }
+
+                pthread_mutex_lock(&fbq.lock);
+                fbq.busy = 0;
+                if (job.gen != fbq.gen) {
+                        /* The fonts were reloaded meanwhile */
+                        if (job.fallback.face)
+                                xunloadfont(&job.fallback);
+                        if (job.match)
+                                FcPatternDestroy(job.match);
+                } else {
+                        if (fbq.ndone == fbq.donecap) {
+                                fbq.donecap = fbq.donecap ? fbq.donecap*2 : 16;
+                                fbq.done = xrealloc(fbq.done, fbq.donecap * sizeof *fbq.done);
+                        }
+                        fbq.done[fbq.ndone++] = job;
+                        if (write(fbq.pipe[1], "", 1) < 0 && errno != EAGAIN)
+                                perror("write");
+                }
+                pthread_cond_broadcast(&fbq.cond);
+        }
+        pthread_mutex_unlock(&fbq.lock);
+
+        return NULL;
+}
+
+/* Whether a face of the file of pattern waits for fallbackdone() */
+int
+fallbackqueued(FcPattern *pattern)
+{
+        size_t i;
+
+        for (i = 0; i < fbq.ndone; i++) {
+                if (fbq.done[i].fallback.face &&
+                    samefile(pattern, fbq.done[i].fallback.match))
+                        return 1;
+        }
+
+        return 0;
+}
+
+void
+fallbackstart(void)
+{
+        if (pipe(fbq.pipe) < 0) {
+                perror("pipe");
+                return;
+        }
+        fcntl(fbq.pipe[0], F_SETFL, O_NONBLOCK);
+        fcntl(fbq.pipe[1], F_SETFL, O_NONBLOCK);
+        if (pthread_create(&fbq.thread, NULL, fallbackworker, NULL)) {
+                fputs("warning: could not start the fallback font worker\n", stderr);
+                close(fbq.pipe[0]);
+                close(fbq.pipe[1]);
+                return;
+        }
+        fbq.running = 1;
+}
+
+/* Drops the queued lookups and waits for the one in flight, see xzoomfonts() */
+void
+fallbackflush(void)
+{
+        size_t i;
+
+        if (!fbq.running)
+                return;
+
+        pthread_mutex_lock(&fbq.lock);
+        fbq.gen++;
+        fbq.ntodo = 0;
+        for (i = 0; i < fbq.ndone; i++) {
+                if (fbq.done[i].fallback.face)
+                        xunloadfont(&fbq.done[i].fallback);
+                if (fbq.done[i].match)
+                        FcPatternDestroy(fbq.done[i].match);
+        }
+        fbq.ndone = 0;
+        while (fbq.busy)
+                pthread_cond_wait(&fbq.cond, &fbq.lock);
+        pthread_mutex_unlock(&fbq.lock);
+}
+
+/*
+ * Takes the fallback fonts the worker has loaded, and marks the lines
+ * which were drawn with placeholders for them dirty.
+ */
+void
+fallbackdone(void)
+{
+        Fbjob *job;
+        char buf[64];
+        size_t i;
+        int *slot, j;
+
+        while (read(fbq.pipe[0], buf, sizeof buf) > 0)
+                ;
+
+        pthread_mutex_lock(&fbq.lock);
+        for (i = 0; i < fbq.ndone; i++) {
+                job = fbq.done + i;
+                j = -1;
+                if (job->match) {
+                        j = frcfind(job->match);
+                        FcPatternDestroy(job->match);
+                } else if (job->fallback.face && (j = frcfind(job->fallback.match)) >= 0) {
+                        /* Another rune brought in the same file first */
+                        xunloadfont(&job->fallback);
+                } else if (job->fallback.face) {
+                        *frcnew(job->flags) = job->fallback;
+                        j = frclen++;
+                        fallbackcovered(j);
+                }
+                /* Unless a font loaded meanwhile covered it already */
+                slot = fallbackslot(job->u | (uint32_t)job->flags << 21);
+                if (*slot == FBPENDING) {
+                        *slot = j;
+                        tsetdirtrune(job->u);
+                }
+        }
+        fbq.ndone = 0;
+        pthread_mutex_unlock(&fbq.lock);
+}
+
+/*
+ * Gives the pending runes which the new fallback font j covers to it, like
+ * xfallback() would have, and drops their lookups. Called under fbq.lock.
+ */
+void
+fallbackcovered(int j)
+{
+        size_t i, k, n;
+        uint32_t key;
+        Rune u;
+
+        if (!frc[j].font.charset)
+                return;
+
+        for (i = 0; i < fbmap.nb; i++) {
+                key = fbmap.keys[i];
+                u = key & 0x1fffff;
+                if (key == NOKEY || fbmap.vals[i] != FBPENDING ||
+                    (int)(key >> 21) != frc[j].flags ||
+                    !FcCharSetHasChar(frc[j].font.charset, u))
+                        continue;
+                fbmap.vals[i] = j;
+                tsetdirtrune(u);
+        }
+
+        for (k = n = 0; k < fbq.ntodo; k++) {
+                key = fbq.todo[k].u | (uint32_t)fbq.todo[k].flags << 21;
+                if (*fallbackslot(key) == FBPENDING)
+                        fbq.todo[n++] = fbq.todo[k];
+        }
+        fbq.ntodo = n;
+}
+
+/* Returns the font a job renders for, frc may have moved since it was queued */
+Font *
+rasterfont(const RasterJob *job)
+{
+        Font *styles[] = {
+                [FRC_NORMAL] = &dc.font, [FRC_ITALIC] = &dc.ifont,
+                [FRC_BOLD] = &dc.bfont, [FRC_ITALICBOLD] = &dc.ibfont,
+        };
+
+        return job->frcidx >= 0 ? &frc[job->frcidx].font : styles[job->style];
+}
+
+int
+rastercmp(const void *a, const void *b)
+{
+        const RasterJob *x = a, *y = b;
+        Font *fx, *fy;
+
+        if (x->frcidx != y->frcidx)
+                return x->frcidx < y->frcidx ? -1 : 1;
+        /* Styles sharing a face share their glyphs, see xsharefont() */
+        fx = rasterfont(x);
+        fy = rasterfont(y);
+        fx = fx->owner ? fx->owner : fx;
+        fy = fy->owner ? fy->owner : fy;
+        if (fx != fy)
+                return fx < fy ? -1 : 1;
+        if (x->u != y->u)
+                return x->u < y->u ? -1 : 1;
+        return 0;
+}
+
+/* Opens the font of job with the FT_Library of the thread */
+FT_Face
+rasterface(Rasterizer *r, const RasterJob *job)
+{
+        FT_Face face;
+        int i;
+
+        for (i = 0; i < r->nfaces; i++) {
+                if (r->faces[i].index == job->index && !strcmp(r->faces[i].file, job->file))
+                        break;
+        }
+        if (i < r->nfaces) {
+                /* Zooming only resizes the faces */
+                face = r->faces[i].face;
+                if (r->faces[i].size != job->size) {
+                        if (FT_Set_Char_Size(face, job->size, 0, FONTDPI, 0))
+                                return NULL;
+                        r->faces[i].size = job->size;
+                }
+                return face;
+        }
+
+        if (r->nfaces == LEN(r->faces)) {
+                FT_Done_Face(r->faces[0].face);
+                memmove(r->faces, r->faces + 1, --r->nfaces * sizeof *r->faces);
+        }
+        if (FT_New_Face(r->ft, job->file, job->index, &face))
+                return NULL;
+        if (FT_Set_Char_Size(face, job->size, 0, FONTDPI, 0)) {
+                FT_Done_Face(face);
+                return NULL;
+        }
+        r->faces[r->nfaces].file = job->file;
+        r->faces[r->nfaces].index = job->index;
+        r->faces[r->nfaces].face = face;
+        r->faces[r->nfaces].size = job->size;
+        r->nfaces++;
+
+        return face;
+}
+
+void *
+rasterworker(void *arg)
+{
+        Rasterizer *r = arg;
+        RasterJob *job;
+        FT_Face face;
+        FT_UInt glyphidx;
+        FT_Bitmap b;
+        unsigned int y;
+
+        pthread_mutex_lock(&raster.lock);
+        for (;;) {
+                while (r->batch == raster.batch)
+                        pthread_cond_wait(&raster.cond, &raster.lock);
+                r->batch = raster.batch;
+
+                while (raster.next < raster.n) {
+                        job = raster.jobs + raster.next++;
+                        pthread_mutex_unlock(&raster.lock);
+
+                        if ((face = rasterface(r, job)) &&
+                            (glyphidx = FT_Get_Char_Index(face, job->u)) &&
+                            !renderglyph(face, glyphidx)) {
+                                glyphbitmap(face->glyph, &b, &job->left, &job->top);
+                                job->bitmap = b;
+                                job->bitmap.pitch = b.width;
+                                job->bitmap.buffer = NULL;
+                                if (b.width && b.rows)
+                                        job->bitmap.buffer = xmalloc(b.width * b.rows);
+                                for (y = 0; y < b.rows; y++) {
+                                        memcpy(job->bitmap.buffer + y*b.width,
+                                               b.buffer + (int)y*b.pitch, b.width);
+                                }
+                                job->ok = 1;
+                        }
+
+                        pthread_mutex_lock(&raster.lock);
+                }
+
+                if (--raster.busy == 0)
+                        pthread_cond_signal(&raster.done);
+        }
+        pthread_mutex_unlock(&raster.lock);
+
+        return NULL;
+}
+
+void
+rasterstart(void)
+{
+        long n = rasterthreads ? rasterthreads : sysconf(_SC_NPROCESSORS_ONLN);
+        Rasterizer *r;
+        int i;
+
+        if (n < 2)
+                return;
+
+        raster.threads = xmalloc(n * sizeof *raster.threads);
+        memset(raster.threads, 0, n * sizeof *raster.threads);
+        for (i = 0; i < n; i++) {
+                r = raster.threads + raster.nthreads;
+                if (FT_Init_FreeType(&r->ft))
+                        break;
+                if (sdfatlas)
+                        sdfspread(r->ft);
+                if (pthread_create(&r->thread, NULL, rasterworker, r)) {
+                        FT_Done_FreeType(r->ft);
+                        break;
+                }
+                raster.nthreads++;
+        }
+}
+
+/* Queues a glyph of font for the rasterizer threads */
+void
+rasterjob(Font *font, int style, int frcidx, Rune u)
+{
+        RasterJob *job;
+        char *file;
+        int index;
+
+        if (FcPatternGetString(font->match, FC_FILE, 0, (FcChar8 **)&file) != FcResultMatch)
+                return;
+        if (FcPatternGetInteger(font->match, FC_INDEX, 0, &index) != FcResultMatch)
+                index = 0;
+
+        if (raster.n == raster.cap) {
+                raster.cap = raster.cap ? raster.cap*2 : 256;
+                raster.jobs = xrealloc(raster.jobs, raster.cap * sizeof *raster.jobs);
+        }
+        job = raster.jobs + raster.n++;
+        memset(job, 0, sizeof *job);
+        job->u = u;
+        job->style = style;
+        job->frcidx = frcidx;
+        job->file = file;
+        job->index = index;
+        job->size = font->size;
+}
+
+/* Hands the queued jobs to the threads, without waiting for them */
+void
+rastersubmit(void)
+{
+        size_t i, n;
+
+        /* The same rune shows up many times on a screen */
+        qsort(raster.jobs, raster.n, sizeof *raster.jobs, rastercmp);
+        for (i = 1, n = 1; i < raster.n; i++) {
+                if (rastercmp(raster.jobs + i, raster.jobs + n-1))
+                        raster.jobs[n++] = raster.jobs[i];
+        }
+        raster.n = n;
+
+        pthread_mutex_lock(&raster.lock);
+        raster.next = 0;
+        raster.busy = raster.nthreads;
+        raster.batch++;
+        raster.inflight = 1;
+        pthread_cond_broadcast(&raster.cond);
+        pthread_mutex_unlock(&raster.lock);
+}
+
+/*
+ * Waits for the submitted batch, then puts the glyphs into the atlas in
+ * one pass, or drops them if the fonts are about to be unloaded.
+ */
+void
+rastercollect(int store)
+{
+        RasterJob *job;
+        size_t i;
+        int style;
+
+        if (!raster.inflight)
+                return;
+
+        pthread_mutex_lock(&raster.lock);
+        while (raster.busy)
+                pthread_cond_wait(&raster.done, &raster.lock);
+        raster.inflight = 0;
+        pthread_mutex_unlock(&raster.lock);
+
+        for (i = 0; i < raster.n; i++) {
+                job = raster.jobs + i;
+                if (store && job->ok && !lookupglyph(rasterfont(job), job->u))
+                        storeglyph(rasterfont(job), job->u, &job->bitmap, job->left, job->top, NULL);
+        }
+        for (style = FRC_NORMAL; store && glyphcache && style <= FRC_ITALICBOLD; style++) {
+                if (raster.prewarm & 1 << style)
+                        glyphcachesave(style);
+        }
+        raster.prewarm = 0;
+
+        for (i = 0; i < raster.n; i++)
+                free(raster.jobs[i].bitmap.buffer);
+        raster.n = 0;
+}
+
+/*
+ * Names the file of key in $XDG_CACHE_HOME/stvk, or ~/.cache/stvk: prefix
+ * followed by a hash of the key. The files store their key to tell
+ * collisions apart.
+ */
+int
+cachepath(char *path, size_t pathsz, const char *prefix, const char *key, size_t len)
+{
+        const char *dir, *sub;
+        uint64_t h = 14695981039346656037ULL;
+        size_t i;
+
+        for (i = 0; i < len; i++)
+                h = (h ^ (uint8_t)key[i]) * 1099511628211ULL;
+
+        if ((dir = getenv("XDG_CACHE_HOME")) && *dir) {
+                sub = "";
+        } else if ((dir = getenv("HOME"))) {
+                sub = "/.cache";
+        } else {
+                return 1;
+        }
+        if (snprintf(path, pathsz, "%s%s/stvk/%s%016llx", dir, sub, prefix,
+                     (unsigned long long)h) >= (int)pathsz)
+                return 1;
+
+        return 0;
+}
+
+/* Creates the directory of a file from cachepath() */
+void
+cachemkdir(char *path)
+{
+        char *slash;
+
+        /* Create $XDG_CACHE_HOME/stvk, and ~/.cache without XDG_CACHE_HOME */
+        slash = strrchr(path, '/');
+        *slash = '\0';
+        if (mkdir(path, 0700) < 0 && errno == ENOENT) {
+                *strrchr(path, '/') = '\0';
+                mkdir(path, 0700);
+                path[strlen(path)] = '/';
+                mkdir(path, 0700);
+        }
+        *slash = '/';
+}
+
+/*
+ * Newest change to the fontconfig configuration: the main file and the
+ * conf.d directories, whose mtime changes when files come and go.
+ */
+long long
+fcstamp(void)
+{
+        char paths[4][PATH_MAX];
+        const char *env;
+        struct stat st;
+        long long stamp = 0;
+        size_t i;
+
+        snprintf(paths[0], sizeof paths[0], "%s",
+                 (env = getenv("FONTCONFIG_FILE")) ? env : "/etc/fonts/fonts.conf");
+        snprintf(paths[1], sizeof paths[1], "/etc/fonts/conf.d");
+        if ((env = getenv("XDG_CONFIG_HOME")) && *env) {
+                snprintf(paths[2], sizeof paths[2], "%s/fontconfig/fonts.conf", env);
+                snprintf(paths[3], sizeof paths[3], "%s/fontconfig/conf.d", env);
+        } else {
+                env = getenv("HOME");
+                snprintf(paths[2], sizeof paths[2], "%s/.config/fontconfig/fonts.conf", env ? env : "");
+                snprintf(paths[3], sizeof paths[3], "%s/.config/fontconfig/conf.d", env ? env : "");
+        }
+        for (i = 0; i < LEN(paths); i++) {
+                if (!stat(paths[i], &st) && st.st_mtime > stamp)
+                        stamp = st.st_mtime;
+        }
+
+        return stamp;
+}
+
+/*
+ * The font cache maps a font string to the files fontconfig picked for the
+ * four styles, so that FcInit and FcFontMatch are not needed at startup.
+ * A line with the configuration stamp, then one line with the index, mtime,
+ * size and mismatched attributes and one with the path per style, then one
+ * line with the mtime and path per font directory.
+ */
+#define FCMAGIC         "stvkfc2"
+
+int
+fontcacheload(const char *fontstr, Fontfile *files)
+{
+        char path[PATH_MAX], line[PATH_MAX];
+        struct stat st;
+        long long stamp, mtime, size;
+        FILE *fp;
+        size_t i;
+        int ret = 1;
+
+        if (cachepath(path, sizeof path, "font-", fontstr, strlen(fontstr)) ||
+            !(fp = fopen(path, "r")))
+                return 1;
+
+        if (!fgets(line, sizeof line, fp) || strcmp(line, FCMAGIC "\n") ||
+            !fgets(line, sizeof line, fp) || strncmp(line, fontstr, strlen(fontstr)) ||
+            line[strlen(fontstr)] != '\n' ||
+            fscanf(fp, "%lld\n", &stamp) != 1 || stamp != fcstamp())
+                goto out;
+
+        for (i = 0; i < 4; i++) {
+                if (fscanf(fp, "%d %lld %lld %d %d\n", &files[i].index, &mtime, &size,
+                           &files[i].badslant, &files[i].badweight) != 5 ||
+                    !fgets(files[i].file, sizeof files[i].file, fp) ||
+                    !strchr(files[i].file, '\n'))
+                        goto out;
+                *strchr(files[i].file, '\n') = '\0';
+
+                /* The font files were updated or removed */
+                if (stat(files[i].file, &st) < 0 || st.st_mtime != mtime || st.st_size != size)
+                        goto out;
+        }
+
+        /* Fonts were installed or removed in one of the font directories */
+        while (fscanf(fp, "%lld ", &mtime) == 1) {
+                if (!fgets(line, sizeof line, fp) || !strchr(line, '\n'))
+                        goto out;
+                *strchr(line, '\n') = '\0';
+                if ((stat(line, &st) < 0 ? -1 : (long long)st.st_mtime) != mtime)
+                        goto out;
+        }
+        ret = 0;
+out:
+        fclose(fp);
+        return ret;
+}
+
+/* Fills file from the match of a style font, returns 0 on success */
+int
+fontfile(Fontfile *file, FcPattern *match, int badslant, int badweight)
+{
+        char *path;
+
+        if (FcPatternGetString(match, FC_FILE, 0, (FcChar8 **)&path) != FcResultMatch ||
+            FcPatternGetInteger(match, FC_INDEX, 0, &file->index) != FcResultMatch ||
+            snprintf(file->file, sizeof file->file, "%s", path) >= (int)sizeof file->file)
+                return 1;
+        file->badslant = badslant;
+        file->badweight = badweight;
+
+        return 0;
+}
+
+void
+fontcachesave(const char *fontstr, const Fontfile *files)
+{
+        char path[PATH_MAX], tmp[PATH_MAX + 8];
+        struct stat st;
+        FcStrList *dirs;
+        FcChar8 *dir;
+        FILE *fp;
+        size_t i;
+
+        if (strchr(fontstr, '\n') ||
+            cachepath(path, sizeof path, "font-", fontstr, strlen(fontstr)))
+                return;
+        cachemkdir(path);
+
+        snprintf(tmp, sizeof tmp, "%s.%d", path, (int)getpid());
+        if (!(fp = fopen(tmp, "w")))
+                return;
+
+        fprintf(fp, FCMAGIC "\n%s\n%lld\n", fontstr, fcstamp());
+        for (i = 0; i < 4; i++) {
+                if (stat(files[i].file, &st) < 0)
+                        break;
+                fprintf(fp, "%d %lld %lld %d %d\n%s\n", files[i].index, (long long)st.st_mtime,
+                        (long long)st.st_size, files[i].badslant, files[i].badweight,
+                        files[i].file);
+        }
+
+        /*
+         * Then the font directories fontconfig scans, with their subdirectories,
+         * and their mtime or -1 for the missing ones.
+         */
+        if (i == 4 && (dirs = FcConfigGetFontDirs(NULL))) {
+                while ((dir = FcStrListNext(dirs))) {
+                        if (strchr((char *)dir, '\n'))
+                                continue;
+                        fprintf(fp, "%lld %s\n", stat((char *)dir, &st) < 0 ? -1 :
+                                (long long)st.st_mtime, (char *)dir);
+                }
+                FcStrListDone(dirs);
+        }
+
+        if (fclose(fp) || i < 4 || rename(tmp, path) < 0)
+                unlink(tmp);
+}
+
+/*
+ * The cache key names the font file of the style with its mtime and size,
+ * the style, the pixel size and the render flags. The file name is a hash
+ * of it, the key itself is stored in the file to tell collisions apart.
+ */
+int
+glyphcachekey(Font *f, int style, char *path, size_t pathsz, char *key, size_t keysz)
+{
+        struct stat st;
+        char *file;
+        int index, len;
+
+        if (FcPatternGetString(f->match, FC_FILE, 0, (FcChar8 **)&file) != FcResultMatch ||
+            stat(file, &st) < 0)
+                return 1;
+        if (FcPatternGetInteger(f->match, FC_INDEX, 0, &index) != FcResultMatch)
+                index = 0;
+        len = snprintf(key, keysz, "%s:%d:%lld:%lld:%d:%d:%d:%ld:%d\n",
+                       file, index, (long long)st.st_mtime, (long long)st.st_size,
+                       style, f->face->size->metrics.x_ppem,
+                       f->face->size->metrics.y_ppem, LOADFLAGS,
+                       sdfatlas ? SDFSPREAD : 0);
+        if (len >= (int)keysz)
+                return 1;
+
+        return cachepath(path, pathsz, "", key, len);
+}
+
+/* Loads the prewarm set of a style from the glyph cache, returns 0 on a hit */
+int
+glyphcacheload(Font *f, int style)
+{
+        char path[PATH_MAX], key[4*PATH_MAX];
+        const GCHeader *hdr;
+        const GCEntry *e;
+        struct stat st;
+        FT_Bitmap bitmap;
+        uint8_t *p;
+        size_t i, keylen;
+        int fd, ret = 1;
+
+        if (glyphcachekey(f, style, path, sizeof path, key, sizeof key))
+                return 1;
+        keylen = strlen(key);
+        if ((fd = open(path, O_RDONLY)) < 0)
+                return 1;
+        if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof *hdr + keylen) {
+                close(fd);
+                return 1;
+        }
+        p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (p == MAP_FAILED)
+                return 1;
+
+        hdr = (const GCHeader *)p;
+        e = (const GCEntry *)(p + sizeof *hdr + keylen);
+        if (memcmp(hdr->magic, GCMAGIC, sizeof hdr->magic) || hdr->keylen != keylen ||
+            memcmp(p + sizeof *hdr, key, keylen) ||
+            (size_t)st.st_size < sizeof *hdr + keylen + (size_t)hdr->n * sizeof *e)
+                goto out;
+
+        memset(&bitmap, 0, sizeof bitmap);
+        for (i = 0; i < hdr->n; i++, e++) {
+                if (e->style != style ||
+                    e->off > st.st_size || (size_t)e->w * e->rows > (size_t)st.st_size - e->off)
+                        goto out;
+                if (useboxdraw(e->u) || lookupglyph(f, e->u))
+                        continue;
+                bitmap.width = e->w;
+                bitmap.rows = e->rows;
+                bitmap.pitch = e->w;
+                bitmap.buffer = p + e->off;
+                storeglyph(f, e->u, &bitmap, e->left, e->top, NULL);
+        }
+        ret = 0;
+out:
+        munmap(p, st.st_size);
+        return ret;
+}
+
+/* Writes the glyphs of a style from the collected prewarm batch to the glyph cache */
+void
+glyphcachesave(int style)
+{
+        char path[PATH_MAX], tmp[PATH_MAX + 8], key[4*PATH_MAX];
+        GCHeader hdr;
+        GCEntry e;
+        RasterJob *job, sjob = { .style = style, .frcidx = -1 };
+        FILE *fp;
+        size_t i, keylen;
+        uint32_t off;
+
+        if (glyphcachekey(rasterfont(&sjob), style, path, sizeof path, key, sizeof key))
+                return;
+        keylen = strlen(key);
+        cachemkdir(path);
+
+        snprintf(tmp, sizeof tmp, "%s.%d", path, (int)getpid());
+        if (!(fp = fopen(tmp, "w")))
+                return;
+
+        memset(&hdr, 0, sizeof hdr);
+        memcpy(hdr.magic, GCMAGIC, sizeof hdr.magic);
+        hdr.keylen = keylen;
+        for (i = 0; i < raster.n; i++)
+                hdr.n += GCJOB(raster.jobs + i, style);
+        fwrite(&hdr, sizeof hdr, 1, fp);
+        fwrite(key, 1, keylen, fp);
+
+        off = sizeof hdr + keylen + hdr.n * sizeof e;
+        for (i = 0; i < raster.n; i++) {
+                job = raster.jobs + i;
+                if (!GCJOB(job, style))
+                        continue;
+                e.u = job->u;
+                e.style = job->style;
+                e.left = job->left;
+                e.top = job->top;
+                e.w = job->bitmap.width;
+                e.rows = job->bitmap.rows;
+                e.off = off;
+                off += e.w * e.rows;
+                fwrite(&e, sizeof e, 1, fp);
+        }
+        for (i = 0; i < raster.n; i++) {
+                job = raster.jobs + i;
+                if (GCJOB(job, style) && job->bitmap.buffer)
+                        fwrite(job->bitmap.buffer, 1, job->bitmap.width * job->bitmap.rows, fp);
+        }
+
+        if (fclose(fp) || rename(tmp, path) < 0)
+                unlink(tmp);
+}
+
+/*
+ * Renders the prewarm set of the loaded styles in the background, collected
+ * by the next draw. The regular font is done after the fonts are loaded or
+ * zoomed, the other styles after the frame which opened them.
+ */
+void
+rasterprewarm(void)
+{
+        Font *styles[] = {
+                [FRC_NORMAL] = &dc.font, [FRC_ITALIC] = &dc.ifont,
+                [FRC_BOLD] = &dc.bfont, [FRC_ITALICBOLD] = &dc.ibfont,
+        };
+        Font *f;
+        size_t i;
+        int style;
+        Rune u;
+
+        if (raster.inflight || prewarmed == (1 << LEN(styles)) - 1)
+                return;
+
+        for (style = FRC_NORMAL; style <= FRC_ITALICBOLD; style++) {
+                f = styles[style];
+                /* A shared face has the glyphs of its owner */
+                if ((prewarmed & 1 << style) || !f->face || f->owner)
+                        continue;
+                prewarmed |= 1 << style;
+                if ((glyphcache && !glyphcacheload(f, style)) || !raster.nthreads)
+                        continue;
+
+                for (i = 0; i < LEN(prewarm); i++) {
+                        for (u = prewarm[i][0]; u <= prewarm[i][1]; u++) {
+                                if (!useboxdraw(u) && !lookupglyph(f, u))
+                                        rasterjob(f, style, -1, u);
+                        }
+                }
+                raster.prewarm |= 1 << style;
+        }
+        if (raster.n)
+                rastersubmit();
+        else
+                raster.prewarm = 0;
+}
+
+/*
+ * Queues the glyphs of a line that are missing from the atlas. They are
+ * rendered in parallel by xpreparedraw(), before any line is drawn.
+ */
 void
-rehash(Font *f)
+xprepareline(Line line, int x1, int y1, int x2)
 {
-        size_t i, nb, idx;
-        Rune *newkeys;
-        GlyphSpec *newvals, *val;
+        Font *font;
+        Glyph *g;
+        int x, style, j;
 
-        nb = f->nb*2;
-        newkeys = xmalloc(nb * sizeof *newkeys);
-        memset(newkeys, 0xff, nb * sizeof *newkeys);
-        newvals = xmalloc(nb * sizeof *newvals);
+        /* Outlines are cheap to extract, the misses need no threads */
+        if (!raster.nthreads || gpuoutlines())
+                return;
+        rastercollect(1);
 
-        /* NOTE: This loop could be faster with an early-exit */
-        for (i = 0; i < f->nb; i++) {
-                if (f->keys[i] == NOKEY)
+        for (x = x1; x < x2; x++) {
+                g = line + x;
+                if (g->mode & ATTR_WDUMMY)
                         continue;
 
-                idx = f->keys[i] % nb;
-                while (newkeys[idx] != NOKEY)
-                        idx = (idx+1) % nb;
+                font = xstylefont(g, &style);
+                j = -1;
+                if (useboxdraw(g->u) || lookupglyph(font, g->u))
+                        continue;
+                if (!FT_Get_Char_Index(font->face, g->u)) {
+                        if ((j = xfallback(font, style, g->u)) < 0 ||
+                            lookupglyph(&frc[j].font, g->u))
+                                continue;
+                        font = &frc[j].font;
+                }
+                rasterjob(font, style, j, g->u);
+        }
+}
 
-                newkeys[idx] = f->keys[i];
-                newvals[idx] = f->vals[i];
+void
+xpreparedraw(void)
+{
+        rastercollect(1);
+        if (raster.n < RASTERBATCH) {
+                raster.n = 0;
+                return;
         }
 
-        free(f->keys);
-        free(f->vals);
-        f->keys = newkeys;
-        f->vals = newvals;
-        f->nb = nb;
+        rastersubmit();
+        rastercollect(1);
 }
 
-GlyphSpec *
-getglyphspec(Font *f, Rune u)
+void
+xdrawglyphs(Glyph *glyphs, int len, int x, int y)
 {
-        size_t i, idx;
-        int ox, oy, ret;
-        uint16_t cw, ch;
-        float occ;
-        FT_UInt glyphidx;
-        FT_Error error;
-        FT_GlyphSlot slot;
-        FT_Bitmap bitmap;
-        GlyphSpec *spec;
-
-        idx = u % f->nb;
-        while (f->keys[idx] != NOKEY && f->keys[idx] != u)
-                idx = (idx+1) % f->nb;
+        int i, j;
 
-        if (f->keys[idx] != NOKEY)
-                return f->vals + idx;
+#ifdef HARFBUZZ
+        if (shaping) {
+                xdrawshaped(glyphs, len, x, y);
+                return;
+        }
+#endif
+
+        /* Runs fit the gids left after a flush, see xdrawcells() */
+        for (i = 0; i < len; i = j) {
+                for (j = i + 1; j < len && j - i < GIDMASK &&
+                                !ATTRCMP(glyphs[i], glyphs[j]); j++)
+                        ;
+                if (!(glyphs[i].mode & ATTR_WDUMMY))
+                        xdrawcells(glyphs + i, j - i, x + i, y);
+        }
+}
 
-        /* Not cached, load glyph */
-        glyphidx = FT_Get_Char_Index(f->face, u);
-        if (glyphidx == 0) {
-                /* Can't find the glyph in the font. Use fontcache to get
-                 * a fallback font TODO: Implement this. */
-                return NULL;
-        } else {
-                error = FT_Load_Glyph(f->face, glyphidx, FT_LOAD_RENDER|FT_LOAD_TARGET_LIGHT);
-                if (error) {
-                        fputs("freetype load glyph error: %02x\n", stderr);
-                        return NULL;
-                }
+uint32_t
+encodescalar(VKQUAD *q, const Glyphid **ids, uint32_t n, uint16_t xp,
+             uint16_t yp, uint16_t cw, Color fg, Color bg, uint16_t *b)
+{
+        const Glyphid *id;
+        uint32_t i, m;
+
+        for (i = m = 0; i < n; i++, xp += cw) {
+                id = ids[i];
+                q[m].x = xp + id->dx;
+                q[m].y = yp + id->dy;
+                q[m].uv = (Rect){ id->uvx, id->uvy, id->w, id->h };
+                q[m].fg = fg;
+                q[m].bg = bg;
+                /* Empty glyphs lie within the run, they never grow b */
+                b[0] = MIN(b[0], q[m].x);
+                b[1] = MIN(b[1], q[m].y);
+                b[2] = MAX(b[2], (uint16_t)(q[m].x + id->w));
+                b[3] = MAX(b[3], (uint16_t)(q[m].y + id->h));
+                m += id->w != 0;
+        }
 
-                occ = (float)f->ng / (float)f->nb;
-                if (occ > 0.75f) {
-                        rehash(f);
-                        idx = u % f->nb;
-                        while (f->keys[idx] != NOKEY && f->keys[idx] != u)
-                                idx = (idx+1) % f->nb;
-                }
+        return m;
+}
 
-                spec = f->vals + idx;
-                slot = f->face->glyph;
-                bitmap = slot->bitmap;
-
-                ox = slot->bitmap_left;
-                oy = f->ascent - slot->bitmap_top;
-                cw = MAX(win.cw, bitmap.width);
-                ch = MAX(win.ch, bitmap.rows);
-
-                ret = blitatlas(&spec->uvx, &spec->uvy, bitmap.width, bitmap.rows,
-                                cw, ch, MAX(0, ox), MAX(0, oy),
-                                bitmap.pitch, bitmap.buffer);
-                if (ret) {
-                        fputs("font atlas is full\n", stderr);
-                        return NULL;
-                }
+#ifdef XSIMD
+/*
+ * The first 16 bytes of a quad are the first 12 of its Glyphid moved by
+ * the cell position, followed by the foreground. Every quad is written
+ * and the next one overwrites it when it was empty, there's no branch.
+ */
+__attribute__((target("sse4.1")))
+static uint32_t
+encodesse4(VKQUAD *q, const Glyphid **ids, uint32_t n, uint16_t xp,
+           uint16_t yp, uint16_t cw, Color fg, Color bg, uint16_t *b)
+{
+        __m128i pos = _mm_setr_epi16(xp, yp, 0, 0, 0, 0, 0, 0);
+        __m128i step = _mm_setr_epi16(cw, 0, 0, 0, 0, 0, 0, 0);
+        __m128i lo = _mm_setr_epi16(b[0], b[1], -1, -1, -1, -1, -1, -1);
+        __m128i hi = _mm_setr_epi16(b[2], b[3], 0, 0, 0, 0, 0, 0);
+        __m128i v;
+        uint32_t i, m, c;
+
+        memcpy(&c, &fg, sizeof c);
+        for (i = m = 0; i < n; i++) {
+                v = _mm_loadu_si128((const __m128i *)ids[i]);
+                v = _mm_add_epi16(v, pos);
+                lo = _mm_min_epu16(lo, v);
+                /* x + w and y + h */
+                hi = _mm_max_epu16(hi, _mm_add_epi16(v, _mm_srli_si128(v, 8)));
+                _mm_storeu_si128((__m128i *)(q + m), _mm_insert_epi32(v, (int)c, 3));
+                q[m].bg = bg;
+                m += ids[i]->w != 0;
+                pos = _mm_add_epi16(pos, step);
+        }
+        b[0] = (uint16_t)_mm_extract_epi16(lo, 0);
+        b[1] = (uint16_t)_mm_extract_epi16(lo, 1);
+        b[2] = (uint16_t)_mm_extract_epi16(hi, 0);
+        b[3] = (uint16_t)_mm_extract_epi16(hi, 1);
 
-                f->keys[idx] = u;
-                spec->w = cw;
-                spec->h = ch;
-                spec->offx = MIN(0, ox);
-                spec->offy = MIN(0, oy);
-                f->ng++;
+        return m;
+}
 
-                return spec;
+/* Two cells at a time, one in each 128-bit lane */
+__attribute__((target("avx2")))
+static uint32_t
+encodeavx2(VKQUAD *q, const Glyphid **ids, uint32_t n, uint16_t xp,
+           uint16_t yp, uint16_t cw, Color fg, Color bg, uint16_t *b)
+{
+        __m256i pos = _mm256_setr_epi16(xp, yp, 0, 0, 0, 0, 0, 0,
+                                        xp + cw, yp, 0, 0, 0, 0, 0, 0);
+        __m256i step = _mm256_setr_epi16(2*cw, 0, 0, 0, 0, 0, 0, 0,
+                                         2*cw, 0, 0, 0, 0, 0, 0, 0);
+        __m256i lo = _mm256_setr_epi16(b[0], b[1], -1, -1, -1, -1, -1, -1,
+                                       b[0], b[1], -1, -1, -1, -1, -1, -1);
+        __m256i hi = _mm256_setr_epi16(b[2], b[3], 0, 0, 0, 0, 0, 0,
+                                       b[2], b[3], 0, 0, 0, 0, 0, 0);
+        __m256i vfg, v;
+        __m128i l, h;
+        uint32_t i, m, c;
+
+        memcpy(&c, &fg, sizeof c);
+        vfg = _mm256_set1_epi32((int)c);
+        for (i = m = 0; i + 2 <= n; i += 2) {
+                v = _mm256_inserti128_si256(
+                        _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)ids[i])),
+                        _mm_loadu_si128((const __m128i *)ids[i + 1]), 1);
+                v = _mm256_add_epi16(v, pos);
+                lo = _mm256_min_epu16(lo, v);
+                hi = _mm256_max_epu16(hi, _mm256_add_epi16(v, _mm256_srli_si256(v, 8)));
+                v = _mm256_blend_epi32(v, vfg, 0x88);
+                _mm_storeu_si128((__m128i *)(q + m), _mm256_castsi256_si128(v));
+                q[m].bg = bg;
+                m += ids[i]->w != 0;
+                _mm_storeu_si128((__m128i *)(q + m), _mm256_extracti128_si256(v, 1));
+                q[m].bg = bg;
+                m += ids[i + 1]->w != 0;
+                pos = _mm256_add_epi16(pos, step);
         }
+        l = _mm_min_epu16(_mm256_castsi256_si128(lo), _mm256_extracti128_si256(lo, 1));
+        h = _mm_max_epu16(_mm256_castsi256_si128(hi), _mm256_extracti128_si256(hi, 1));
+        b[0] = (uint16_t)_mm_extract_epi16(l, 0);
+        b[1] = (uint16_t)_mm_extract_epi16(l, 1);
+        b[2] = (uint16_t)_mm_extract_epi16(h, 0);
+        b[3] = (uint16_t)_mm_extract_epi16(h, 1);
+
+        return m + encodescalar(q + m, ids + i, n - i, xp + i*cw, yp, cw, fg, bg, b);
+}
+#endif
 
-        return NULL;
+Encodefn
+pickencode(void)
+{
+#ifdef XSIMD
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+                return encodeavx2;
+        if (__builtin_cpu_supports("sse4.1"))
+                return encodesse4;
+#endif
+        return encodescalar;
 }
 
+/*
+ * Draws n cells of the same attributes at column x: the font and colors
+ * are resolved once, then one background for all of them and the glyph
+ * quads filled in place from the resolved glyphs, see xcellglyph().
+ */
 void
-xdrawglyphs(Glyph *glyphs, int len, int x, int y)
+xdrawcells(Glyph *glyphs, int n, int x, int y)
 {
-        Font *font = &dc.font;
-        int i, j;
-        int frcflags = FRC_NORMAL;
+        Font *font;
+        const Glyphid *id, *base;
+        Color fg, bg;
+        uint16_t xp, yp, cw, b[4];
+        uint32_t m, gen;
+        int i, style;
+        uint8_t flags;
+
+        font = xstylefont(glyphs, &style);
+        xcellcolors(glyphs, (glyphs->mode & ATTR_ITALIC && font->badslant) ||
+                            (glyphs->mode & ATTR_BOLD && font->badweight), &fg, &bg);
+        /* The blink phase is picked by the overlay pass */
+        flags = (glyphs->mode & ATTR_BLINK) ? QUAD_BLINK : 0;
+
+        cw = win.cw * ((glyphs->mode & ATTR_WIDE) ? 2 : 1);
+        xp = (uint16_t)(x*win.cw + borderpx);
+        yp = (uint16_t)(y*win.ch + borderpx);
+        vkpushquad(xp, yp, n*cw, win.ch, NOUV, NOUV, fg, bg, flags);
+
+        /* Picked here, the headless replay draws without xinit() */
+        if (!cellrun.encode)
+                cellrun.encode = pickencode();
+        if (cellrun.cap < (uint32_t)n) {
+                cellrun.cap = n;
+                cellrun.ids = xrealloc(cellrun.ids, cellrun.cap * sizeof *cellrun.ids);
+        }
+        /* Resolving may move or flush the entries the earlier ones point to */
+        do {
+                base = gids.ids;
+                gen = gids.gen;
+                for (i = 0; i < n; i++)
+                        cellrun.ids[i] = (id = xcellglyph(glyphs + i)) ? id : &nogid;
+        } while (gids.ids != base || gids.gen != gen);
+
+        /* Glyphs may stick out of their cells, the dirty rect grows with them */
+        b[0] = xp;
+        b[1] = yp;
+        b[2] = xp + n*cw;
+        b[3] = yp + win.ch;
+        bg.a = flags;
+        m = cellrun.encode(vkreservequads(n), cellrun.ids, n, xp, yp, cw, fg, bg, b);
+        vkcommitquads(m, (Rect){ b[0], b[1], b[2] - b[0], b[3] - b[1] }, flags);
+
+        if (glyphs->mode & ATTR_UNDERLINE)
+                vkpushquad(xp, yp + font->ascent + 1, n*cw, 1, NOUV, NOUV,
+                           fg, bg, flags|QUAD_FILL);
+        if (glyphs->mode & ATTR_STRUCK)
+                vkpushquad(xp, yp + 2*font->ascent/3, n*cw, 1, NOUV, NOUV,
+                           fg, bg, flags|QUAD_FILL);
+}
+
+#ifdef HARFBUZZ
+/*
+ * Draws the line by runs of cells with the same attributes the style font
+ * has glyphs for, each shaped as a whole. Wide cells and the ones needing
+ * a fallback font or boxdraw go through xdrawcells() as before.
+ */
+void
+xdrawshaped(Glyph *glyphs, int len, int x, int y)
+{
+        Font *font;
         Glyph *g;
+        int i, j, style;
+
+        for (i = 0; i < len; i = j) {
+                font = xstylefont(glyphs + i, &style);
+                for (j = i; j < len && !ATTRCMP(glyphs[i], glyphs[j]); j++) {
+                        g = glyphs + j;
+                        if ((g->mode & (ATTR_WIDE|ATTR_WDUMMY)) || useboxdraw(g->u) ||
+                            (!lookupglyph(font, g->u) && !FT_Get_Char_Index(font->face, g->u)))
+                                break;
+                }
+                if (j > i) {
+                        xdrawrun(glyphs + i, j - i, x + i, y, font);
+                        continue;
+                }
+
+                if (!(glyphs[i].mode & ATTR_WDUMMY))
+                        xdrawcells(glyphs + i, 1, x + i, y);
+                j = i + 1;
+        }
+}
+
+/*
+ * Draws n cells of the same attributes as one shaped run of font: their
+ * background, then each cluster from its first cell.
+ */
+void
+xdrawrun(Glyph *glyphs, int n, int x, int y, Font *font)
+{
+        static Rune *runes;
+        static int cap;
+        ShapedRun *run;
+        ShapedGlyph *sg;
         GlyphSpec *spec;
-        uint16_t xp, yp, runewidth;
-        Color fg, bg, tmp;
-        FcResult fcres;
-        FcPattern *fcpattern, *fontpattern;
-        FcFontSet *fcsets[] = { NULL };
-        FcCharSet *fccharset;
+        uint16_t xp, yp, cx, cy;
+        uint8_t flags;
+        Color fg, bg;
+        int i, k;
+
+        if (cap < n) {
+                cap = n;
+                runes = xrealloc(runes, cap * sizeof *runes);
+        }
+        for (i = 0; i < n; i++)
+                runes[i] = glyphs[i].u;
 
         xp = (uint16_t)(x*win.cw + borderpx);
         yp = (uint16_t)(y*win.ch + borderpx);
-        for (i = 0; i < len; i++) {
-                g = glyphs + i;
-                if (g->mode & ATTR_WDUMMY)
-                        continue;
-
-                runewidth = win.cw * ((g->mode & ATTR_WIDE) ? 2 : 1);
-
-                if ((g->mode & ATTR_ITALIC) && (g->mode & ATTR_BOLD)) {
-                        font = &dc.ibfont;
-                        frcflags = FRC_ITALICBOLD;
-                } else if (g->mode & ATTR_ITALIC) {
-                        font = &dc.ifont;
-                        frcflags = FRC_ITALIC;
-                } else if (g->mode & ATTR_BOLD) {
-                        font = &dc.bfont;
-                        frcflags = FRC_BOLD;
+        xglyphcolors(glyphs, &fg, &bg);
+        flags = (glyphs->mode & ATTR_BLINK) ? QUAD_BLINK : 0;
+
+        vkpushquad(xp, yp, n*win.cw, win.ch, NOUV, NOUV, fg, bg, flags);
+
+        run = shaperun(font, runes, n);
+        for (i = 0; i < run->nglyph; i += k) {
+                sg = run->glyphs + i;
+                for (k = 1; i + k < run->nglyph && sg[k].cell == sg->cell; k++)
+                        ;
+                cx = xp + sg->cell*win.cw;
+                cy = yp;
+                if (k > 1) {
+                        /* Marks and the like, composed with their base */
+                        spec = clusterglyph(font, sg, k);
                 } else {
-                        font = &dc.font;
+                        cx += GLYPHPX(sg->dx);
+                        cy += GLYPHPX(sg->dy);
+                        if (!(spec = lookupglyph(font, GLYPHKEY(sg->idx))))
+                                spec = loadglyph(font, GLYPHKEY(sg->idx), sg->idx);
                 }
+                if (spec && spec->w && spec->h)
+                        vkpushquad(cx + GLYPHPX(spec->offx), cy + GLYPHPX(spec->offy),
+                                   GLYPHPX(spec->w), GLYPHPX(spec->h),
+                                   spec->uvx, spec->uvy, fg, bg, flags);
+        }
 
-                if (g->mode & ATTR_ITALIC && g->mode & ATTR_BOLD) {
-                        if (dc.ibfont.badslant || dc.ibfont.badweight)
-                                g->fg = defaultattr;
-                } else if ((g->mode & ATTR_ITALIC && dc.ifont.badslant) ||
-                                (g->mode & ATTR_BOLD && dc.bfont.badweight)) {
-                        g->fg = defaultattr;
-                }
+        if (glyphs->mode & ATTR_UNDERLINE)
+                vkpushquad(xp, yp + font->ascent + 1, n*win.cw, 1, NOUV, NOUV,
+                           fg, bg, flags|QUAD_FILL);
+        if (glyphs->mode & ATTR_STRUCK)
+                vkpushquad(xp, yp + 2*font->ascent/3, n*win.cw, 1, NOUV, NOUV,
+                           fg, bg, flags|QUAD_FILL);
+}
 
-                if (IS_TRUECOL(g->fg)) {
-                        fg.r = TRUERED(g->fg);
-                        fg.g = TRUEGREEN(g->fg);
-                        fg.b = TRUEBLUE(g->fg);
-                } else {
-                        fg = dc.col[g->fg];
-                }
+/*
+ * Returns the shaped run of n runes of f, shaping it on a miss into a new
+ * entry or the least recently used one.
+ */
+ShapedRun *
+shaperun(Font *f, const Rune *runes, int n)
+{
+        hb_glyph_info_t *info;
+        hb_glyph_position_t *pos;
+        hb_position_t pen = 0;
+        unsigned int i, ng;
+        uint64_t h = 14695981039346656037ULL;
+        ShapedRun *r;
+        ShapedGlyph *g;
+        int j, *p;
+
+        if (f->owner)
+                f = f->owner;
+        for (j = 0; j < n; j++)
+                h = (h ^ runes[j]) * 1099511628211ULL;
+        h = (h ^ (uintptr_t)f) * 1099511628211ULL;
+
+        if (!shaped.buckets) {
+                shaped.cap = MAX(1, shapecache);
+                for (shaped.nb = 1; shaped.nb < 2*shaped.cap; shaped.nb *= 2)
+                        ;
+                shaped.runs = xmalloc(shaped.cap * sizeof *shaped.runs);
+                memset(shaped.runs, 0, shaped.cap * sizeof *shaped.runs);
+                shaped.buckets = xmalloc(shaped.nb * sizeof *shaped.buckets);
+                shaped.buf = hb_buffer_create();
+                shapeflush();
+        }
 
-                if (IS_TRUECOL(g->bg)) {
-                        bg.r = TRUERED(g->bg);
-                        bg.g = TRUEGREEN(g->bg);
-                        bg.b = TRUEBLUE(g->bg);
+        for (j = shaped.buckets[h & (shaped.nb-1)]; j >= 0; j = r->chain) {
+                r = shaped.runs + j;
+                if (r->hash == h && r->font == f && r->nrune == n &&
+                    !memcmp(r->runes, runes, n * sizeof *runes)) {
+                        shapeunlink(j);
+                        break;
+                }
+        }
+        if (j < 0) {
+                if (shaped.n < shaped.cap) {
+                        j = shaped.n++;
                 } else {
-                        bg = dc.col[g->bg];
+                        j = shaped.tail;
+                        shapeunlink(j);
+                        p = shaped.buckets + (shaped.runs[j].hash & (shaped.nb-1));
+                        while (*p != j)
+                                p = &shaped.runs[*p].chain;
+                        *p = shaped.runs[j].chain;
+                }
+                r = shaped.runs + j;
+                r->hash = h;
+                r->font = f;
+                r->nrune = n;
+                r->runes = xrealloc(r->runes, n * sizeof *r->runes);
+                memcpy(r->runes, runes, n * sizeof *runes);
+                r->chain = shaped.buckets[h & (shaped.nb-1)];
+                shaped.buckets[h & (shaped.nb-1)] = j;
+
+                if (!f->hb) {
+                        f->hb = hb_ft_font_create_referenced(f->face);
+                        hb_ft_font_set_load_flags(f->hb, LOADFLAGS & ~FT_LOAD_RENDER);
+                }
+                hb_buffer_clear_contents(shaped.buf);
+                hb_buffer_add_utf32(shaped.buf, (const uint32_t *)runes, n, 0, n);
+                hb_buffer_guess_segment_properties(shaped.buf);
+                /* Cells stay in logical order, there is no bidi */
+                hb_buffer_set_direction(shaped.buf, HB_DIRECTION_LTR);
+                hb_shape(f->hb, shaped.buf, NULL, 0);
+                info = hb_buffer_get_glyph_infos(shaped.buf, &ng);
+                pos = hb_buffer_get_glyph_positions(shaped.buf, NULL);
+
+                /* The glyphs of a cluster are placed from its cell on */
+                r->glyphs = xrealloc(r->glyphs, MAX(1, ng) * sizeof *r->glyphs);
+                r->nglyph = (int)ng;
+                for (i = 0; i < ng; i++) {
+                        if (i == 0 || info[i].cluster != info[i-1].cluster)
+                                pen = 0;
+                        g = r->glyphs + i;
+                        g->idx = info[i].codepoint;
+                        g->cell = (uint16_t)info[i].cluster;
+                        g->dx = (int16_t)((pen + pos[i].x_offset + 32) >> 6);
+                        g->dy = (int16_t)(-((pos[i].y_offset + 32) >> 6));
+                        pen += pos[i].x_advance;
                 }
+        }
 
-                if ((g->mode & ATTR_BOLD_FAINT) == ATTR_BOLD && BETWEEN(g->fg, 0, 7))
-                        fg = dc.col[g->fg + 8];
+        /* Most recently used */
+        r->prev = -1;
+        r->next = shaped.head;
+        if (shaped.head >= 0)
+                shaped.runs[shaped.head].prev = j;
+        shaped.head = j;
+        if (shaped.tail < 0)
+                shaped.tail = j;
 
-                if (IS_SET(MODE_REVERSE)) {
-                        if (COLOREQ(fg, dc.col[defaultfg])) {
-                                fg = dc.col[defaultbg];
-                        } else {
-                                fg.r = ~fg.r;
-                                fg.g = ~fg.g;
-                                fg.b = ~fg.b;
-                        }
+        return r;
+}
 
-                        if (COLOREQ(bg, dc.col[defaultbg])) {
-                                bg = dc.col[defaultfg];
-                        } else {
-                                bg.r = ~bg.r;
-                                bg.g = ~bg.g;
-                                bg.b = ~bg.b;
-                        }
-                }
+/* Takes run i out of the recently used list */
+void
+shapeunlink(int i)
+{
+        ShapedRun *r = shaped.runs + i;
 
-                if ((g->mode & ATTR_BOLD_FAINT) == ATTR_FAINT) {
-                        fg.r /= 2;
-                        fg.g /= 2;
-                        fg.b /= 2;
-                }
+        if (r->prev >= 0)
+                shaped.runs[r->prev].next = r->next;
+        else
+                shaped.head = r->next;
+        if (r->next >= 0)
+                shaped.runs[r->next].prev = r->prev;
+        else
+                shaped.tail = r->prev;
+}
+
+/* Forgets every shaped run, their offsets are for the old font size */
+void
+shapeflush(void)
+{
+        if (!shaped.buckets)
+                return;
+        memset(shaped.buckets, 0xff, shaped.nb * sizeof *shaped.buckets);
+        shaped.n = 0;
+        shaped.head = shaped.tail = -1;
+}
+
+/* Hands out a glyph cache key for each distinct cluster */
+Rune
+clusterkey(const ShapedGlyph *sg, int n)
+{
+        uint64_t h = 14695981039346656037ULL, *hashes;
+        Rune *keys;
+        size_t i, j, nb;
 
-                if (g->mode & ATTR_REVERSE) {
-                        tmp = fg;
-                        fg = bg;
-                        bg = tmp;
+        for (i = 0; i < (size_t)n; i++) {
+                h = (h ^ sg[i].idx) * 1099511628211ULL;
+                h = (h ^ (uint16_t)sg[i].dx) * 1099511628211ULL;
+                h = (h ^ (uint16_t)sg[i].dy) * 1099511628211ULL;
+        }
+        h |= 1;
+
+        if (clusters.n >= clusters.nb * 3 / 4) {
+                nb = clusters.nb ? clusters.nb*2 : MAPINITSZ;
+                hashes = xmalloc(nb * sizeof *hashes);
+                memset(hashes, 0, nb * sizeof *hashes);
+                keys = xmalloc(nb * sizeof *keys);
+                for (i = 0; i < clusters.nb; i++) {
+                        if (!clusters.hashes[i])
+                                continue;
+                        for (j = clusters.hashes[i] & (nb-1); hashes[j]; j = (j+1) & (nb-1))
+                                ;
+                        hashes[j] = clusters.hashes[i];
+                        keys[j] = clusters.keys[i];
                 }
+                free(clusters.hashes);
+                free(clusters.keys);
+                clusters.hashes = hashes;
+                clusters.keys = keys;
+                clusters.nb = nb;
+        }
 
-                if (g->mode & ATTR_BLINK && win.mode & MODE_BLINK)
-                        fg = bg;
+        for (j = h & (clusters.nb-1); clusters.hashes[j]; j = (j+1) & (clusters.nb-1)) {
+                if (clusters.hashes[j] == h)
+                        return clusters.keys[j];
+        }
+        clusters.hashes[j] = h;
+        clusters.keys[j] = CLUSTERKEY(clusters.n);
+        clusters.n++;
 
-                if (g->mode & ATTR_INVISIBLE)
-                        fg = bg;
+        return clusters.keys[j];
+}
 
-                spec = getglyphspec(font, g->u);
-                if (spec) {
-                        vkpushquad(xp + spec->offx, yp - spec->offy,
-                                   spec->w, spec->h,
-                                   spec->uvx, spec->uvy, fg, bg);
-                } else {
-                        /* Look up the cache */
-                        for (j = 0; j < frclen; j++) {
-                                if (frc[j].flags == frcflags) {
-                                        spec = getglyphspec(&frc[j].font, g->u);
-                                        if (spec) {
-                                                font = &frc[j].font;
-                                                break;
-                                        }
-                                }
+/*
+ * The n glyphs of a cluster, a base and its marks say, drawn over each
+ * other into one bitmap. Quads are opaque, one per glyph would cover the
+ * ones before.
+ */
+GlyphSpec *
+clusterglyph(Font *f, const ShapedGlyph *sg, int n)
+{
+        static uint8_t *buf;
+        static size_t bufsz;
+        FT_Bitmap bitmap = {0}, b;
+        GlyphSpec *spec;
+        Rune key;
+        int i, pass, x, y, left, top;
+        int x0 = INT_MAX, y0 = INT_MIN, x1 = INT_MIN, y1 = INT_MAX;
+        uint8_t *dst, *src;
+
+        key = clusterkey(sg, n);
+        if ((spec = lookupglyph(f, key)))
+                return spec;
+
+        /* The box around all of them, then each one maxed into it */
+        for (pass = 0; pass < 2; pass++) {
+                for (i = 0; i < n; i++) {
+                        if (renderglyph(f->face, sg[i].idx))
+                                continue;
+                        glyphbitmap(f->face->glyph, &b, &left, &top);
+                        left += sg[i].dx;
+                        top -= sg[i].dy;
+                        if (pass == 0) {
+                                x0 = MIN(x0, left);
+                                y0 = MAX(y0, top);
+                                x1 = MAX(x1, left + (int)b.width);
+                                y1 = MIN(y1, top - (int)b.rows);
+                                continue;
                         }
-                        if (spec) {
-                                vkpushquad(xp + spec->offx, yp - spec->offy,
-                                           spec->w, spec->h,
-                                           spec->uvx, spec->uvy, fg, bg);
-                        } else {
-                                if (!font->set)
-                                        font->set = FcFontSort(0, font->pattern,
-                                                               1, 0, &fcres);
-                                fcsets[0] = font->set;
-
-                                fcpattern = FcPatternDuplicate(font->pattern);
-                                fccharset = FcCharSetCreate();
-
-                                FcCharSetAddChar(fccharset, g->u);
-                                FcPatternAddCharSet(fcpattern, FC_CHARSET,
-                                                fccharset);
-                                FcPatternAddBool(fcpattern, FC_SCALABLE, 1);
-
-                                FcConfigSubstitute(0, fcpattern,
-                                                FcMatchPattern);
-                                FcDefaultSubstitute(fcpattern);
-
-                                fontpattern = FcFontSetMatch(0, fcsets, 1,
-                                                fcpattern, &fcres);
-                                if (frclen >= frccap) {
-                                        frccap += 16;
-                                        frc = xrealloc(frc, frccap * sizeof(Fontcache));
-                                }
-                                font = &frc[frclen].font;
-                                memset(font, 0, sizeof *font);
-                                if (xloadfont(font, fontpattern))
-                                        die("Failed to load fallback font");
-                                frc[frclen].flags = frcflags;
-                                frclen++;
-                                spec = getglyphspec(font, g->u);
-                                if (spec)
-                                        vkpushquad(xp + spec->offx, yp - spec->offy,
-                                                   spec->w, spec->h,
-                                                   spec->uvx, spec->uvy, fg, bg);
-                                else
-                                        vkpushquad(xp, yp, win.cw, win.ch, NOUV, NOUV, fg, bg);
-
-                                FcPatternDestroy(fcpattern);
-                                FcCharSetDestroy(fccharset);
+                        for (y = 0; y < (int)b.rows; y++) {
+                                src = b.buffer + y*b.pitch;
+                                dst = buf + (y0 - top + y)*bitmap.pitch + left - x0;
+                                for (x = 0; x < (int)b.width; x++)
+                                        dst[x] = MAX(dst[x], src[x]);
                         }
                 }
+                if (pass)
+                        break;
 
-                /* TODO: Change to the original st-style, in which the modes are lumped together,
-                 * so that drawing underline and strikethrough is more efficient */
-
-                if (g->mode & ATTR_UNDERLINE)
-                        vkpushquad(xp, yp + font->ascent + 1, runewidth, 1, NOUV, NOUV, fg, fg);
-
-                if (g->mode & ATTR_STRUCK)
-                        vkpushquad(xp, yp + 2*font->ascent/3, runewidth, 1, NOUV, NOUV, fg, fg);
-
-                xp += runewidth;
+                if (x0 >= x1 || y1 >= y0)
+                        x0 = x1 = y0 = y1 = 0;
+                bitmap.width = x1 - x0;
+                bitmap.rows = y0 - y1;
+                bitmap.pitch = bitmap.width;
+                if (bufsz < (size_t)bitmap.width * bitmap.rows) {
+                        bufsz = (size_t)bitmap.width * bitmap.rows;
+                        buf = xrealloc(buf, bufsz);
+                }
+                memset(buf, 0, (size_t)bitmap.width * bitmap.rows);
+                bitmap.buffer = buf;
         }
 
+        return storeglyph(f, key, &bitmap, x0, y0, NULL);
+}
+#endif
+
+int
+cursorblinks(void)
+{
+        return IS_SET(MODE_FOCUSED) && !IS_SET(MODE_HIDE) &&
+                (win.cursor == 0 || win.cursor == 1 ||
+                 win.cursor == 3 || win.cursor == 5);
 }
 
+/*
+ * The cursor never touches the render target, it is drawn by the overlay
+ * pass, so there is no old cell to restore.
+ */
 void
 xdrawcursor(int cx, int cy, Glyph g, int ox, int oy, Glyph og)
 {
+        CursorSpec c = {0};
+        GlyphSpec *spec;
+        Font *font;
         Color drawcol;
 
-        /* remove the old cursor */
-        if (selected(ox, oy))
-                og.mode ^= ATTR_REVERSE;
-        xdrawglyphs(&og, 1, ox, oy);
+        c.r = (Rect){ borderpx + cx*win.cw, borderpx + cy*win.ch, win.cw, win.ch };
+        c.thick = cursorthickness;
 
-        if (IS_SET(MODE_HIDE))
+        if (IS_SET(MODE_HIDE)) {
+                vkcursor(&c);
                 return;
+        }
 
         /*
          * Select the right color for the right mode.
@@ -1531,6 +4495,7 @@ xdrawcursor(int cx, int cy, Glyph g, int ox, int oy, Glyph og)
                 }
                 drawcol = dc.col[g.bg];
         }
+        c.fg = c.bg = drawcol;
 
         /* draw the new one */
         if (IS_SET(MODE_FOCUSED)) {
@@ -1541,25 +4506,33 @@ xdrawcursor(int cx, int cy, Glyph g, int ox, int oy, Glyph og)
                         case 0: /* Blinking Block */
                         case 1: /* Blinking Block (Default) */
                         case 2: /* Steady Block */
-                                xdrawglyphs(&g, 1, cx, cy);
+                                c.style = CUR_BLOCK;
+                                if (g.mode & ATTR_WIDE)
+                                        c.r.w *= 2;
+                                xglyphcolors(&g, &c.fg, &c.bg);
+                                if ((spec = xglyphspec(&g, &font))) {
+                                        c.gx = c.r.x + GLYPHPX(spec->offx);
+                                        c.gy = c.r.y + GLYPHPX(spec->offy);
+                                        c.uv = (Rect){ spec->uvx, spec->uvy,
+                                                       GLYPHPX(spec->w), GLYPHPX(spec->h) };
+                                }
                                 break;
                         case 3: /* Blinking Underline */
                         case 4: /* Steady Underline */
-                                vkpushquad(borderpx + cx*win.cw, borderpx + (cy+1)*win.ch - cursorthickness,
-                                                win.cw, cursorthickness, NOUV, NOUV, drawcol, drawcol);
+                                c.style = CUR_UNDERLINE;
                                 break;
                         case 5: /* Blinking bar */
                         case 6: /* Steady bar */
-                                vkpushquad(borderpx + cx*win.cw, borderpx + cy*win.ch,
-                                                cursorthickness, win.ch, NOUV, NOUV, drawcol, drawcol);
+                                c.style = CUR_BAR;
                                 break;
                 }
+                if (cursorblinks())
+                        c.style |= CUR_BLINK;
         } else {
-                vkpushquad(borderpx + cx*win.cw, borderpx + cy*win.ch, win.cw-1, 1, NOUV, NOUV, drawcol, drawcol);
-                vkpushquad(borderpx + cx*win.cw, borderpx + cy*win.ch, 1, win.ch-1, NOUV, NOUV, drawcol, drawcol);
-                vkpushquad(borderpx + (cx+1)*win.cw-1, borderpx + cy*win.ch, 1, win.ch-1, NOUV, NOUV, drawcol, drawcol);
-                vkpushquad(borderpx + cx*win.cw, borderpx + (cy+1)*win.ch-1, win.cw, 1, NOUV, NOUV, drawcol, drawcol);
+                c.style = CUR_HOLLOW;
         }
+
+        vkcursor(&c);
 }
 
 void
@@ -1577,6 +4550,8 @@ xseticontitle(char *p)
         XTextProperty prop;
         DEFAULT(p, opt_title);
 
+        if (!xw.dpy)
+                return;
         Xutf8TextListToTextProperty(xw.dpy, &p, 1, XUTF8StringStyle,
                         &prop);
         XSetWMIconName(xw.dpy, xw.win, &prop);
@@ -1590,6 +4565,8 @@ xsettitle(char *p)
         XTextProperty prop;
         DEFAULT(p, opt_title);
 
+        if (!xw.dpy)
+                return;
         Xutf8TextListToTextProperty(xw.dpy, &p, 1, XUTF8StringStyle,
                         &prop);
         XSetWMName(xw.dpy, xw.win, &prop);
@@ -1600,19 +4577,71 @@ xsettitle(char *p)
 int
 xstartdraw(void)
 {
+        drawnrows = 0;
         return IS_SET(MODE_VISIBLE);
 }
 
 void
 xdrawline(Line line, int x1, int y1, int x2)
 {
+        drawnrows++;
         xdrawglyphs(&line[x1], x2-x1, x1, y1);
 }
 
 void
 xfinishdraw(void)
 {
+        if (drawnrows >= win.th / win.ch)
+                vkredrawn();
         vkflush();
+
+        /* The styles this frame opened, see xstyleload() */
+        rasterprewarm();
+
+        /*
+         * The glyphs which did not fit are drawn by the next frame, into an
+         * empty atlas. If they don't fit in that either, it stays partial.
+         */
+        if (atlasfull && !atlasredraw) {
+                xresetatlas();
+                tfulldirt();
+                atlasredraw = 1;
+        } else {
+                atlasfull = 0;
+                atlasredraw = 0;
+        }
+}
+
+/* Forgets every glyph in the atlas, at all sizes */
+void
+xresetatlas(void)
+{
+        Font *fonts[] = { &dc.font, &dc.ifont, &dc.bfont, &dc.ibfont };
+        Font *f;
+        size_t i;
+
+        resetatlas();
+        for (i = 0; i < LEN(fonts) + frclen; i++) {
+                f = i < LEN(fonts) ? fonts[i] : &frc[i - LEN(fonts)].font;
+                if (f->face)
+                        xforgetglyphs(f);
+        }
+        xforgetglyphs(&boxfont);
+        gidflush();
+        atlasfull = 0;
+}
+
+/* Empties the glyph caches of f, the atlas keeps the glyphs */
+void
+xforgetglyphs(Font *f)
+{
+        if (!f->table)
+                return;
+        memset(f->table, 0xff, glyphtablesz * sizeof *f->table);
+        memset(f->keys, 0xff, f->nb * sizeof *f->keys);
+        f->ng = 0;
+        while (f->nsizes > 0)
+                xfreeglyphs(f->sizes + --f->nsizes);
 }
 
 void
@@ -1650,6 +4679,8 @@ unmap(XEvent *ev)
 void
 xsetpointermotion(int set)
 {
+        if (!xw.dpy)
+                return;
         MODBIT(xw.attrs.event_mask, set, PointerMotionMask);
         XChangeWindowAttributes(xw.dpy, xw.win, CWEventMask, &xw.attrs);
 }
@@ -1685,6 +4716,8 @@ xseturgency(int add)
 void
 xbell(void)
 {
+        if (!xw.dpy)
+                return;
         if (!(IS_SET(MODE_FOCUSED)))
                 xseturgency(1);
         if (bellvolume)
@@ -1773,6 +4806,11 @@ kpress(XEvent *ev)
         if (IS_SET(MODE_KBDLOCK))
                 return;
 
+        latinput(1);
+
+        /* keep the cursor visible while typing */
+        clock_gettime(CLOCK_MONOTONIC, &win.blinkepoch);
+
         if (xw.ime.xic)
                 len = XmbLookupString(xw.ime.xic, e, buf, sizeof buf, &ksym, &status);
         else
@@ -1825,6 +4863,7 @@ cmessage(XEvent *e)
                 }
         } else if (e->xclient.data.l[0] == xw.wmdeletewin) {
                 ttyhangup();
+                latexit();
                 exit(0);
         }
 }
@@ -1844,9 +4883,13 @@ run(void)
         XEvent ev;
         int w = win.w, h = win.h;
         fd_set rfd;
-        int xfd = XConnectionNumber(xw.dpy), ttyfd, xev, drawing;
-        struct timespec seltv, *tv, now, lastblink, trigger;
+        int xfd = XConnectionNumber(xw.dpy), xev, drawing;
+        int fbfd = fbq.running ? fbq.pipe[0] : -1;
+        struct timespec seltv, *tv, now, trigger;
         double timeout;
+        uint32_t elapsed;
+        sigset_t selmask;
+        int status;
 
         /* Waiting for window mapping */
         do {
@@ -1864,13 +4907,24 @@ run(void)
                 }
         } while (ev.type != MapNotify);
 
-        ttyfd = ttynew(opt_line, shell, opt_io, opt_cmd);
         cresize(w, h);
+        clock_gettime(CLOCK_MONOTONIC, &win.blinkepoch);
+
+        /* SIGCHLD only interrupts pselect(), so ttyexited() can't miss it */
+        pthread_sigmask(SIG_SETMASK, NULL, &selmask);
+        sigdelset(&selmask, SIGCHLD);
+
+        for (timeout = -1, drawing = 0;;) {
+                if ((status = ttyexited()) >= 0) {
+                        latexit();
+                        exit(status);
+                }
 
-        for (timeout = -1, drawing = 0, lastblink = (struct timespec){0};;) {
                 FD_ZERO(&rfd);
                 FD_SET(ttyfd, &rfd);
                 FD_SET(xfd, &rfd);
+                if (fbfd >= 0)
+                        FD_SET(fbfd, &rfd);
 
                 if (XPending(xw.dpy))
                         timeout = 0;  /* existing events might not set xfd */
@@ -1879,15 +4933,17 @@ run(void)
                 seltv.tv_nsec = 1E6 * (timeout - 1E3 * seltv.tv_sec);
                 tv = timeout >= 0 ? &seltv : NULL;
 
-                if (pselect(MAX(xfd, ttyfd)+1, &rfd, NULL, NULL, tv, NULL) < 0) {
+                if (pselect(MAX(MAX(xfd, ttyfd), fbfd)+1, &rfd, NULL, NULL, tv, &selmask) < 0) {
                         if (errno == EINTR)
                                 continue;
                         die("select failed: %s\n", strerror(errno));
                 }
                 clock_gettime(CLOCK_MONOTONIC, &now);
 
-                if (FD_ISSET(ttyfd, &rfd))
+                if (FD_ISSET(ttyfd, &rfd)) {
+                        latinput(0);
                         ttyread();
+                }
 
                 xev = 0;
                 while (XPending(xw.dpy)) {
@@ -1899,6 +4955,11 @@ run(void)
                                 (handler[ev.type])(&ev);
                 }
 
+                if (fbfd >= 0 && FD_ISSET(fbfd, &rfd)) {
+                        fallbackdone();
+                        xev = 1;
+                }
+
                 /*
                  * To reduce flicker and tearing, when new content or event
                  * triggers drawing, we first wait a bit to ensure we got
@@ -1923,22 +4984,107 @@ run(void)
 
                 /* idle detected or maxlatency exhausted -> draw */
                 timeout = -1;
-                if (blinktimeout && tattrset(ATTR_BLINK)) {
-                        timeout = blinktimeout - TIMEDIFF(now, lastblink);
-                        if (timeout <= 0) {
-                                if (-timeout > blinktimeout) /* start visible */
-                                        win.mode |= MODE_BLINK;
-                                win.mode ^= MODE_BLINK;
-                                tsetdirtattr(ATTR_BLINK);
-                                lastblink = now;
-                                timeout = blinktimeout;
-                        }
+                if (blinktimeout && (cursorblinks() || tattrset(ATTR_BLINK))) {
+                        /* the phase is resolved on the GPU, only wake up on flips */
+                        elapsed = (uint32_t)TIMEDIFF(now, win.blinkepoch);
+                        vkblink(elapsed, blinktimeout);
+                        timeout = blinktimeout - elapsed % blinktimeout;
+                } else {
+                        vkblink(0, 0);
                 }
 
                 draw();
                 XFlush(xw.dpy);
                 drawing = 0;
+                if (atlasredraw)
+                        timeout = 0;
+        }
+}
+
+void
+headlessframe(const VKFrame *f)
+{
+        uint64_t h = 0xcbf29ce484222325ULL; /* FNV-1a */
+        const uint8_t *row;
+        uint32_t x, y;
+        char path[PATH_MAX];
+        FILE *fp;
+
+        for (y = 0, row = f->data; y < f->h; y++, row += f->stride) {
+                for (x = 0; x < f->w*4; x++)
+                        h = (h ^ row[x]) * 0x100000001b3ULL;
+        }
+
+        hlframe.got = 1;
+        hlframe.hash = h;
+        hlframe.gpums = f->gpums;
+
+        if (!opt_dump)
+                return;
+
+        snprintf(path, sizeof path, "%s/%06u.ppm", opt_dump, hlframe.n);
+        if (!(fp = fopen(path, "w")))
+                die("can't open %s: %s\n", path, strerror(errno));
+        fprintf(fp, "P6\n%u %u\n255\n", f->w, f->h);
+        for (y = 0, row = f->data; y < f->h; y++, row += f->stride) {
+                for (x = 0; x < f->w; x++) {
+                        /* BGRA -> RGB */
+                        fputc(row[4*x+2], fp);
+                        fputc(row[4*x+1], fp);
+                        fputc(row[4*x], fp);
+                }
+        }
+        fclose(fp);
+}
+
+/*
+ * Replays a recording without X: every read of it becomes a frame, which
+ * is rendered offscreen. Prints the frame number, the CPU and GPU time in
+ * ms and a hash of the pixels for every frame which changed anything.
+ */
+void
+headless(void)
+{
+        struct timespec t0, t1;
+        double cpums, cpusum = 0, gpusum = 0;
+
+        usedfont = (opt_font == NULL)? font : opt_font;
+        xloadfonts(usedfont, 0);
+        xloadcols();
+
+        win.w = 2 * borderpx + cols * win.cw;
+        win.h = 2 * borderpx + rows * win.ch;
+        win.mode = MODE_NUMLOCK|MODE_VISIBLE|MODE_FOCUSED;
+
+        vkframecb(headlessframe);
+        vkgrid(gridrender);
+        if (vkinit(NULL, 0, win.w, win.h))
+                die("can't initialize vulkan");
+
+        ttyreplay(opt_replay);
+        cresize(win.w, win.h);
+        vkblink(0, 0);
+
+        while (ttyread() > 0) {
+                hlframe.got = 0;
+                clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t0);
+                draw();
+                clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t1);
+                if (!hlframe.got)
+                        continue;
+
+                cpums = TIMEDIFF(t1, t0);
+                cpusum += cpums;
+                gpusum += MAX(hlframe.gpums, 0);
+                printf("%u %.3f %.3f %016llx\n", hlframe.n, cpums, hlframe.gpums,
+                                (unsigned long long)hlframe.hash);
+                hlframe.n++;
         }
+
+        if (hlframe.n)
+                fprintf(stderr, "%u frames, cpu %.3f ms/frame, gpu %.3f ms/frame\n",
+                                hlframe.n, cpusum / hlframe.n, gpusum / hlframe.n);
+        vkfree();
 }
 
 void
@@ -1951,12 +5097,16 @@ usage(void)
                         "       %s [-aiv] [-c class] [-f font] [-g geometry]"
                         " [-n name] [-o file]\n"
                         "          [-T title] [-t title] [-w windowid] -l line"
-                        " [stty_args ...]\n", argv0, argv0);
+                        " [stty_args ...]\n"
+                        "       %s [-G] [-f font] [-g geometry] [-d dir] -H file\n",
+                        argv0, argv0, argv0);
 }
 
 int
 main(int argc, char *argv[])
 {
+        sigset_t chld;
+
         xw.l = xw.t = 0;
         xw.isfixed = False;
         xsetcursor(cursorshape);
@@ -1968,6 +5118,9 @@ main(int argc, char *argv[])
                 case 'c':
                         opt_class = EARGF(usage());
                         break;
+                case 'd':
+                        opt_dump = EARGF(usage());
+                        break;
                 case 'e':
                         if (argc > 0)
                                 --argc, ++argv;
@@ -1979,6 +5132,12 @@ main(int argc, char *argv[])
                         xw.gm = XParseGeometry(EARGF(usage()),
                                         &xw.l, &xw.t, &cols, &rows);
                         break;
+                case 'G':
+                        gridrender = 1;
+                        break;
+                case 'H':
+                        opt_replay = EARGF(usage());
+                        break;
                 case 'i':
                         xw.isfixed = 1;
                         break;
@@ -2013,12 +5172,21 @@ run:
                 opt_title = (opt_line || !opt_cmd) ? "st" : opt_cmd[0];
 
         setlocale(LC_CTYPE, "");
+        /* The device is made on a thread of its own, see vkprepare() */
+        XInitThreads();
         XSetLocaleModifiers("");
         cols = MAX(cols, 1);
         rows = MAX(rows, 1);
         tnew(cols, rows);
+        if (opt_replay) {
+                headless();
+                return 0;
+        }
+        /* Blocked before any thread exists, see run() */
+        sigemptyset(&chld);
+        sigaddset(&chld, SIGCHLD);
+        pthread_sigmask(SIG_BLOCK, &chld, NULL);
         xinit(cols, rows);
-        xsetenv();
         selinit();
         run();
 